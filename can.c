@@ -1,470 +1,4692 @@
 #include "can.h"
 
-void SPI_to_CAN_master_init(void) {
-    stdio_init_all();
-
-    spi_set_format(spi_default, MSG_SIZE, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
-
-    uint real_baudrate = spi_init(spi_default, CLK_SPD);
+#ifdef MCP2518FD_TRACE
+#include "hardware/clocks.h"
+#include "hardware/structs/m33.h"
+#endif
+
+#ifdef MCP2518FD_PIO_SPI
+#include "hardware/clocks.h"
+#include "mcp2518fd_spi.pio.h"
+#endif
+
+/*
+the SPI transfer, INT/DMA handlers, FIFO drains and TX commit run from SRAM with MCP2518FD_HOT_IN_RAM so an XIP cache
+miss can't land in the middle of servicing INT. a miss costs a QSPI fetch, several us at worst, more than the whole
+RX service for a classic frame. everything else (bring-up, config, stats) stays in flash
+*/
+#if MCP2518FD_HOT_IN_RAM
+#define MCP_HOT(func) __not_in_flash_func(func)
+#else
+#define MCP_HOT(func) func
+#endif
+
+/*
+one bus per SPI instance, shared by every MCP2518FD whose CS hangs off it.
+the bus owns the DMA channel pair and a queue of pending transfers so transfers to different devices go out
+back to back: the DMA completion IRQ releases one device's CS and immediately starts the next queued transfer.
+*/
+
+typedef struct {
+    mcp2518fd_dev_t *dev;
+    uint8_t *txbuffer;
+    uint8_t *rxbuffer;
+    uint16_t len;
+    spi_MCP_callback_t callback;
+    void *ctx;
+#ifdef MCP2518FD_TRACE
+    const char *trace_site;
+    uint32_t trace_start;
+    uint32_t trace_cs;
+    uint8_t trace_flags;          //on top of MCP2518FD_TRACE_DMA
+#endif
+} mcp_spi_xfer_t;
+
+#define MCP_SPI_QUEUE_LEN 8
+
+struct mcp2518fd_bus {
+    spi_inst_t *spi;
+    bool initialised;
+
+#ifdef MCP2518FD_PIO_SPI
+    PIO pio;                  //set for a PIO bus, spi is NULL then
+    uint sm;
+    uint pio_offset;
+    uint pio_cs;              //CS pin the state machine's SET currently points at
+#endif
+
+    int dma_tx_chan;
+    int dma_rx_chan;
+
+    volatile bool busy;
+    mcp_spi_xfer_t current;
+    mcp_spi_xfer_t queue[MCP_SPI_QUEUE_LEN];
+    volatile uint8_t queue_head;
+    volatile uint8_t queue_tail;
+
+    mcp2518fd_dev_t *devs[MCP2518FD_MAX_DEVICES];
+    uint8_t ndevs;
+    volatile bool in_service; //an INT service routine currently owns this bus
+};
+
+#ifdef MCP2518FD_PIO_SPI
+#define MCP_NBUSES (2 + NUM_PIOS)
+#else
+#define MCP_NBUSES 2
+#endif
+
+static mcp2518fd_bus_t mcp_buses[MCP_NBUSES]; //spi0, spi1, then one per PIO block
+
+static inline bool mcp_bus_is_pio(const mcp2518fd_bus_t *bus) {
+#ifdef MCP2518FD_PIO_SPI
+    return bus->pio != NULL;
+#else
+    (void)bus;
+    return false;
+#endif
+}
 
-    gpio_set_function(PICO_DEFAULT_SPI_RX_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(PICO_DEFAULT_SPI_TX_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(PICO_DEFAULT_SPI_SCK_PIN, GPIO_FUNC_SPI);
+//MCP2518FD SPI has to stay under 0.85 * SYSCLK/2, and under what the bus itself can do (the PL022 tops out at CLK_SPD
+//with the pad timing it gets, the PIO bus is good for MCP2518FD_SCK_MAX)
+static uint32_t mcp_spi_max_hz(const mcp2518fd_bus_t *bus, uint32_t sysclk_hz) {
+    uint32_t max_hz = sysclk_hz / 200 * 85;
+    uint32_t bus_max = mcp_bus_is_pio(bus) ? MCP2518FD_SCK_MAX : CLK_SPD;
 
-    gpio_pull_up(PICO_DEFAULT_SPI_RX_PIN);
-    gpio_pull_up(PICO_DEFAULT_SPI_TX_PIN);
+    return max_hz < bus_max ? max_hz : bus_max;
+}
 
-    gpio_set_function(PICO_DEFAULT_SPI_CSN_PIN, GPIO_FUNC_SIO);
-    gpio_set_dir(PICO_DEFAULT_SPI_CSN_PIN, GPIO_OUT);
-    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, HIGH);
+//returns the SCK actually running, always at or under hz
+static uint32_t mcp_set_sck(mcp2518fd_dev_t *dev, uint32_t hz) {
+#ifdef MCP2518FD_PIO_SPI
+    mcp2518fd_bus_t *bus = dev->bus;
 
-    /*
-    i can build in support for multiple slaves later by using CSn pins connected to the pico2
-    would involve taking in a CSn as an argument for the write/read functions
-    i can also use bit manipulation to minimize the total memory of program
-    */
+    if(mcp_bus_is_pio(bus)) {
+        uint32_t clk = clock_get_hz(clk_sys);
+        uint32_t div = (clk + MCP2518FD_SPI_CYCLES_PER_BIT*hz - 1) / (MCP2518FD_SPI_CYCLES_PER_BIT*hz);
 
-}
+        if(div < 1) {
+            div = 1;
+        } else if(div > 0xFFFF) {
+            div = 0xFFFF;
+        }
 
-//need bit padding for 4 bytes
-//need polling after reset 
-//learn DMA for large data transfer
-//REMEMBER MSB FIRST for individual bytes but for multi-bytes LSB first (for data transmission and reconstruction)
+        pio_sm_set_clkdiv_int_frac(bus->pio, bus->sm, div, 0);
 
-void SPI_read_word_from_MCP(uint16_t addr, uint32_t *data) {
-    uint8_t txbuffer[6] = {0};
-    uint8_t rxbuffer[6] = {0};
+        return clk / (MCP2518FD_SPI_CYCLES_PER_BIT*div);
+    }
+#endif
 
-    txbuffer[0] = (MCP2518FD_INSTR_READ << 4) | (addr >> 8) & 0x0F;
-    txbuffer[1] = addr & 0xFF; 
+    return spi_set_baudrate(dev->spi, hz);
+}
 
-    spi_write_to_MCP(txbuffer, rxbuffer, 6);
+uint32_t MCP2518fd_set_sck(mcp2518fd_dev_t *dev, uint32_t hz) {
+    uint32_t max_hz = mcp_spi_max_hz(dev->bus, dev->clock ? dev->clock->sysclk_hz : MCP2518FD_SYSCLK_HZ);
 
-    *data = (rxbuffer[2] << 0) | (rxbuffer[3] << 8) | (rxbuffer[4] << 16) | (rxbuffer[5] << 24);
+    if(hz == 0 || hz > max_hz) {
+        hz = max_hz;
+    }
 
+    return mcp_set_sck(dev, hz);
 }
 
-void SPI_write_word_to_MCP(uint16_t addr, uint32_t data) {
+static mcp2518fd_dev_t *mcp_devices[MCP2518FD_MAX_DEVICES];
+static uint8_t mcp_ndevices = 0;
+
+/*
+trace ring, see can.h. one ring per core so the only thing a producer races with is an IRQ on its own core, which
+disabling interrupts around the push takes care of. the drain side is head/tail like the RX ring
+*/
+#ifdef MCP2518FD_TRACE
+typedef struct {
+    mcp2518fd_trace_entry_t entries[MCP2518FD_TRACE_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t dropped;
+} mcp_trace_ring_t;
+
+static mcp_trace_ring_t mcp_trace_rings[2];
+
+static const char *mcp_trace_sites[2];
+static bool mcp_trace_hz_printed = false;
+
+const char *mcp2518fd_trace_site_enter(const char *site) {
+    const char *prev = mcp_trace_sites[get_core_num()];
+    mcp_trace_sites[get_core_num()] = site;
+    return prev;
+}
 
-    uint8_t txbuffer[6] = {0};
-    uint8_t rxbuffer[6] = {0};
+void mcp2518fd_trace_site_restore(const char **prev) {
+    mcp_trace_sites[get_core_num()] = *prev;
+}
 
-    txbuffer[0] = (MCP2518FD_INSTR_WRITE << 4) | ((addr >> 8) & 0x0F);
-    txbuffer[1] = addr & 0xFF;
-    txbuffer[2] = (data >> 0) & 0xFF;
-    txbuffer[3] = (data >> 8) & 0xFF;
-    txbuffer[4] = (data >> 16) & 0xFF;
-    txbuffer[5] = (data >> 24) & 0xFF;
+static inline uint32_t mcp_trace_now(void) {
+    return m33_hw->dwt_cyccnt;
+}
 
-    spi_write_to_MCP(txbuffer, rxbuffer, 6);
+static void mcp_trace_init(void) {
+    m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+    m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
 }
 
-void spi_write_to_MCP(uint8_t *txbuffer, uint8_t *rxbuffer, uint16_t len) {
-    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, LOW);
+static void mcp_trace_record(mcp2518fd_dev_t *dev, const uint8_t *txbuffer, uint16_t len, uint8_t flags, const char *site, uint32_t start, uint32_t cs, uint32_t clocked, uint32_t end) {
+    uint32_t irq_state = save_and_disable_interrupts();
+    mcp_trace_ring_t *ring = &mcp_trace_rings[get_core_num()];
 
-    spi_write_read_blocking(spi_default, txbuffer, rxbuffer, len);
+    if(ring->head - ring->tail >= MCP2518FD_TRACE_SIZE) {
+        ring->dropped++;
+        restore_interrupts(irq_state);
+        return;
+    }
 
-    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, HIGH);
+    mcp2518fd_trace_entry_t *e = &ring->entries[ring->head & (MCP2518FD_TRACE_SIZE - 1)];
 
-}
+    e->site = site;
+    e->start = start;
+    e->cs = cs;
+    e->clocked = clocked;
+    e->end = end;
+    e->opcode = txbuffer[0] >> 4;
+    e->addr = ((txbuffer[0] & 0x0F) << 8) | txbuffer[1];
+    e->len = len;
+    e->cs_pin = dev->cs_pin;
+    e->flags = flags;
 
-void spi_reset_MCP_chip() {
+    __dmb();
+    ring->head++;
 
-    uint8_t txbuffer[6] = {0};
-    uint8_t rxbuffer[6] = {0};
-    txbuffer[0] = (MCP2518FD_INSTR_RESET << 4) | (0x00 >> 4) & 0x0F;
-    txbuffer[1] = 0x00;
+    restore_interrupts(irq_state);
+}
 
-    spi_write_to_MCP(txbuffer, rxbuffer, 2);
+#define MCP_TRACE_STAMP(t) uint32_t t = mcp_trace_now()
+#define MCP_TRACE_SITE() (mcp_trace_sites[get_core_num()])
+#define MCP_TRACE_RECORD(dev, tx, len, flags, site, start, cs, clocked, end) \
+    mcp_trace_record(dev, tx, len, flags, site, start, cs, clocked, end)
+#else
+#define MCP_TRACE_STAMP(t)
+#define MCP_TRACE_RECORD(dev, tx, len, flags, site, start, cs, clocked, end)
+#endif
+
+/*
+prints up to max queued entries (0 = all of them) over stdio and returns how many went out. this is the only place the
+trace touches stdio, so call it from wherever the application can afford the printf time, not from the service loop
+line format: TRACE,core,site,opcode,addr,len,cs_pin,flags,start,wait,clock,finish (cycles), after a TRACE_HZ,clk_sys line
+*/
+uint16_t MCP2518fd_trace_drain(uint16_t max) {
+#ifdef MCP2518FD_TRACE
+    uint16_t printed = 0;
+
+    if(!mcp_trace_hz_printed) {
+        printf("TRACE_HZ,%lu\n", (unsigned long)clock_get_hz(clk_sys));
+        mcp_trace_hz_printed = true;
+    }
 
-}
+    for(uint8_t core = 0; core < 2; core++) {
+        mcp_trace_ring_t *ring = &mcp_trace_rings[core];
 
-int8_t MCP2518fd_set_mode(CAN_OPERATION_MODE mode) {
-    //see header file line 202 for CAN_OPERATION_MODE enum 
-    REG_CiCON CAN_ctrl_reg;
+        while(ring->tail != ring->head && (max == 0 || printed < max)) {
+            mcp2518fd_trace_entry_t e = ring->entries[ring->tail & (MCP2518FD_TRACE_SIZE - 1)];
 
-    SPI_read_word_from_MCP(MCP2518FD_REG_CiCON, &CAN_ctrl_reg.word);
+            __dmb(); //copy out before the slot is handed back
+            ring->tail++;
 
-    if(CAN_ctrl_reg.bF.OpMode == mode) {
-        return 0;
+            printf("TRACE,%u,%s,%u,0x%03X,%u,%u,%u,%lu,%lu,%lu,%lu\n",
+                   core, e.site ? e.site : "-", e.opcode, e.addr, e.len, e.cs_pin, e.flags,
+                   (unsigned long)e.start, (unsigned long)(e.cs - e.start),
+                   (unsigned long)(e.clocked - e.cs), (unsigned long)(e.end - e.clocked));
+            printed++;
+        }
     }
 
-    CAN_ctrl_reg.bF.RequestOpMode = mode;
+    return printed;
+#else
+    (void)max;
+    return 0;
+#endif
+}
 
-    SPI_write_word_to_MCP(MCP2518FD_REG_CiCON, CAN_ctrl_reg.word);
+uint32_t MCP2518fd_trace_dropped(void) {
+#ifdef MCP2518FD_TRACE
+    return mcp_trace_rings[0].dropped + mcp_trace_rings[1].dropped;
+#else
+    return 0;
+#endif
+}
 
-    uint16_t timeout = 10000;
+static void mcp_dev_setup_common(mcp2518fd_dev_t *dev, mcp2518fd_bus_t *bus, uint sck_pin, uint tx_pin, uint rx_pin, uint cs_pin, uint int_pin) {
+    memset(dev, 0, sizeof(*dev));
+
+    dev->sck_pin = sck_pin;
+    dev->tx_pin = tx_pin;
+    dev->rx_pin = rx_pin;
+    dev->cs_pin = cs_pin;
+    dev->int_pin = int_pin;
+    dev->bus = bus;
+
+    dev->tx_fifos = 1;
+    dev->rx_fifos = 2;
+    dev->tef_depth = 8;
+    dev->mode = CAN_NORMAL_MODE;
+    dev->timestamps = true;
+    dev->stats.period_us = MCP2518FD_STATS_PERIOD_US;
+}
 
-    while(timeout--) {
-        SPI_read_word_from_MCP(MCP2518FD_REG_CiCON, &CAN_ctrl_reg.word);
+void MCP2518fd_dev_setup(mcp2518fd_dev_t *dev, spi_inst_t *spi, uint sck_pin, uint tx_pin, uint rx_pin, uint cs_pin, uint int_pin) {
+    mcp_dev_setup_common(dev, &mcp_buses[spi_get_index(spi)], sck_pin, tx_pin, rx_pin, cs_pin, int_pin);
 
-        if(CAN_ctrl_reg.bF.OpMode == mode) {
-            return 0;
-        }
+    dev->spi = spi;
+}
 
-        sleep_us(100);
+#ifdef MCP2518FD_PIO_SPI
+//same as MCP2518fd_dev_setup but the bus is a PIO state machine, every device given the same PIO shares it (and its pins)
+void MCP2518fd_dev_setup_pio(mcp2518fd_dev_t *dev, PIO pio, uint sck_pin, uint tx_pin, uint rx_pin, uint cs_pin, uint int_pin) {
+    mcp2518fd_bus_t *bus = &mcp_buses[2 + pio_get_index(pio)];
 
-    }
+    mcp_dev_setup_common(dev, bus, sck_pin, tx_pin, rx_pin, cs_pin, int_pin);
 
-    return -1;
+    dev->spi = NULL;
+    bus->pio = pio;
+}
 
+//true once the state machine has clocked out everything it was given and is sat waiting for the next count word
+static inline bool MCP_HOT(mcp_pio_parked)(mcp2518fd_bus_t *bus) {
+    return pio_sm_is_tx_fifo_empty(bus->pio, bus->sm) && pio_sm_get_pc(bus->pio, bus->sm) == bus->pio_offset + mcp2518fd_spi_offset_entry;
 }
 
-int8_t MCP2518fd_oscillator_check() {
-    REG_OSC osc_ctrl_reg; 
-    //check line 544 of can.h for more info on REG_OSC bitfield union
+//hands another device's CS pin to the state machine, parked high. the SM is stopped for the pin writes so the
+//forced SET instructions can't land in the middle of a transfer
+static void mcp_pio_add_cs(mcp2518fd_bus_t *bus, uint cs_pin) {
+    while(!mcp_pio_parked(bus)) {
+        tight_loop_contents();
+    }
 
-    sleep_ms(2);
-    //give time for oscillator to start if it hasn't already
+    pio_sm_set_enabled(bus->pio, bus->sm, false);
 
-    uint16_t timeout = 10000;
+    pio_sm_set_pins_with_mask(bus->pio, bus->sm, 1u << cs_pin, 1u << cs_pin);
+    pio_sm_set_pindirs_with_mask(bus->pio, bus->sm, 1u << cs_pin, 1u << cs_pin);
+    pio_gpio_init(bus->pio, cs_pin);
 
-    uint8_t error;
+    pio_sm_set_set_pins(bus->pio, bus->sm, bus->pio_cs, 1); //set_pins_with_mask moves the SET base around
+    pio_sm_exec(bus->pio, bus->sm, pio_encode_jmp(bus->pio_offset + mcp2518fd_spi_offset_entry));
+    pio_sm_set_enabled(bus->pio, bus->sm, true);
+}
 
-    while(timeout--) {
-        SPI_read_word_from_MCP(MCP2518FD_REG_OSC, &osc_ctrl_reg.word);
+//points CS at this device and kicks off a len byte transfer, the bytes themselves come after from DMA or the CPU
+static void MCP_HOT(mcp_pio_start)(mcp2518fd_bus_t *bus, mcp2518fd_dev_t *dev, uint16_t len) {
+    if(bus->pio_cs != dev->cs_pin) {
+        //SET base can only move between transfers, the previous device's CS has to be back up first
+        while(!mcp_pio_parked(bus)) {
+            tight_loop_contents();
+        }
 
-        if(osc_ctrl_reg.bF.OscReady) {
-            return 0;
-            //means that the oscillator is stable and ready to be modified
+        pio_sm_set_set_pins(bus->pio, bus->sm, dev->cs_pin, 1);
+        bus->pio_cs = dev->cs_pin;
+    }
+
+    pio_sm_put(bus->pio, bus->sm, (uint32_t)len*8 - 1);
+}
+
+//blocking PIO transfer for the short ones, same job as spi_write_read_blocking
+static void MCP_HOT(mcp_pio_transfer_blocking)(mcp2518fd_bus_t *bus, const uint8_t *txbuffer, uint8_t *rxbuffer, uint16_t len) {
+    io_rw_8 *txfifo = (io_rw_8 *)&bus->pio->txf[bus->sm];
+    io_rw_8 *rxfifo = (io_rw_8 *)&bus->pio->rxf[bus->sm];
+    uint16_t tx_left = len;
+    uint16_t rx_left = len;
+
+    while(tx_left || rx_left) {
+        if(tx_left && !pio_sm_is_tx_fifo_full(bus->pio, bus->sm)) {
+            *txfifo = *txbuffer++;
+            tx_left--;
         }
 
-        sleep_us(100);
+        if(rx_left && !pio_sm_is_rx_fifo_empty(bus->pio, bus->sm)) {
+            *rxbuffer++ = *rxfifo;
+            rx_left--;
+        }
     }
+}
+#endif
 
-    return -1;
+void SPI_to_CAN_master_init(mcp2518fd_dev_t *dev) {
+    stdio_init_all();
+    can_pool_init();
 
-    /*
-    I will be using 40 Mhz internal crystal oscillator (no PLL)
-    which determines SYSCLK (for CAN FD controller module and RAM message memory access)
-    */
+#ifdef MCP2518FD_TRACE
+    mcp_trace_init(); //the cycle counter is per core, this runs on whichever core drives the device
+#endif
 
+    mcp2518fd_bus_t *bus = dev->bus;
 
-}
+    //the bus itself only gets set up once, later devices on the same SPI just add their CS pin
+#ifdef MCP2518FD_PIO_SPI
+    if(mcp_bus_is_pio(bus)) {
+        if(!bus->initialised) {
+            bus->spi = NULL;
+            bus->pio_offset = pio_add_program(bus->pio, &mcp2518fd_spi_program);
+            bus->sm = pio_claim_unused_sm(bus->pio, true);
+            bus->pio_cs = dev->cs_pin;
 
-int8_t MCP2518fd_devid_verify() {
-    REG_DEVID devid_reg;
-    
-    SPI_read_word_from_MCP(MCP2518FD_REG_DEVID, &devid_reg.word);
+            //startup rate for the default SYSCLK, mcp_set_sck retunes it once the clock profile is known
+            uint32_t hz = mcp_spi_max_hz(bus, MCP2518FD_SYSCLK_HZ);
+            uint32_t div = (clock_get_hz(clk_sys) + MCP2518FD_SPI_CYCLES_PER_BIT*hz - 1) / (MCP2518FD_SPI_CYCLES_PER_BIT*hz);
 
-    if(devid_reg.bF.DEV!= 0x01) {
-        return -1;
-    }
+            mcp2518fd_spi_program_init(bus->pio, bus->sm, bus->pio_offset, dev->sck_pin, dev->tx_pin, dev->rx_pin, dev->cs_pin, div);
 
-    return 0;
+            SPI_DMA_init(dev);
 
+            bus->initialised = true;
+        } else if(bus->pio_cs != dev->cs_pin) {
+            mcp_pio_add_cs(bus, dev->cs_pin);
+        }
+    } else
+#endif
+    if(!bus->initialised) {
+        bus->spi = dev->spi;
 
-}
+        spi_set_format(dev->spi, MSG_SIZE, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
 
-int8_t MCP2518fd_CAN_controller_config() {
+        uint real_baudrate = spi_init(dev->spi, CLK_SPD);
+        (void)real_baudrate;
 
-    REG_CiCON CiCON_reg;
+        gpio_set_function(dev->rx_pin, GPIO_FUNC_SPI);
+        gpio_set_function(dev->tx_pin, GPIO_FUNC_SPI);
+        gpio_set_function(dev->sck_pin, GPIO_FUNC_SPI);
 
-    SPI_read_word_from_MCP(MCP2518FD_REG_CiCON, &CiCON_reg.word);
+        gpio_pull_up(dev->rx_pin);
+        gpio_pull_up(dev->tx_pin);
 
-    uint8_t timeout = 10000;
+        SPI_DMA_init(dev);
 
-    while(CiCON_reg.bF.isBusy && timeout--) {
-        sleep_us(100);
-        SPI_read_word_from_MCP(MCP2518FD_REG_CiCON, &CiCON_reg.word);
+        bus->initialised = true;
     }
 
-    if(!timeout) {
-        return -1;
+    if(!mcp_bus_is_pio(bus)) {
+        gpio_init(dev->cs_pin);
+        gpio_set_function(dev->cs_pin, GPIO_FUNC_SIO);
+        gpio_set_dir(dev->cs_pin, GPIO_OUT);
+        gpio_put(dev->cs_pin, HIGH);
     }
-    
-    /*
-    I am choosing the simplest configuration to make a working prototype that can be tweaked later on
-    */
-
-    CiCON_reg.bF.DNetFilterCount = 0x0;
-    CiCON_reg.bF.IsoCrcEnable = 1;
-    CiCON_reg.bF.ProtocolExceptionEventDisable = 0;
-    CiCON_reg.bF.WakeUpFilterEnable = 0;
-    CiCON_reg.bF.WakeUpFilterTime = 0;
-    CiCON_reg.bF.BitRateSwitchDisable = 0;
-    CiCON_reg.bF.RestrictReTxAttempts = 0;
-    CiCON_reg.bF.EsiInGatewayMode = 0;
-    CiCON_reg.bF.SystemErrorToListenOnly = 0;
-    CiCON_reg.bF.StoreInTEF = 0;
-    CiCON_reg.bF.TXQEnable = 1;
-    CiCON_reg.bF.TxBandWidthSharing = 0x0;
 
-    SPI_write_word_to_MCP(MCP2518FD_REG_CiCON, CiCON_reg.word);
-    //do i need to poll again?
+    bool known = false;
+    for(uint8_t i = 0; i < bus->ndevs; i++) {
+        known |= (bus->devs[i] == dev);
+    }
 
-    return 0;
+    if(!known && bus->ndevs < MCP2518FD_MAX_DEVICES && mcp_ndevices < MCP2518FD_MAX_DEVICES) {
+        bus->devs[bus->ndevs++] = dev;
+        mcp_devices[mcp_ndevices++] = dev;
+    }
 
-    
 }
 
-void MCP2518fd_nominal_bit_timing_config() {
-    /*
-    TQ (time quantum) = (BRP+1)/(SYSCLK)
+/*
+DMA transfer engine
+
+two channels are paired per transfer: TX feeds the SPI data register from txbuffer, RX drains it into rxbuffer.
+the RX channel always finishes last (the final byte has to be clocked back in), so its completion IRQ is
+where CS gets released and the transfer is marked done.
+*/
+
+/*
+while an MCP INT pin IRQ is armed, a foreground transaction must not be cut in half by an RX service routine
+running its own transactions on the same bus (CS would get yanked mid-frame). so the INT IRQs of every device on
+the bus are held off for the length of every foreground CS window and released once the bus goes idle, the service
+routine itself doesn't need to do this. INT is level triggered so nothing is lost while it is held.
+*/
+static void MCP_HOT(mcp_int_irq_set)(mcp2518fd_bus_t *bus, bool enabled) {
+    if(bus->in_service) {
+        return;
+    }
 
-    BRP is baud rate prescalar
+    for(uint8_t i = 0; i < bus->ndevs; i++) {
+        if(bus->devs[i]->int_irq_armed) {
+            gpio_set_irq_enabled(bus->devs[i]->int_pin, GPIO_IRQ_LEVEL_LOW, enabled);
+        }
+    }
+}
 
-    TQ = 25 nanoseconds if we choose BRP = 0
+static inline void mcp_int_irq_hold(mcp2518fd_bus_t *bus) {
+    mcp_int_irq_set(bus, false);
+}
 
+static inline void mcp_int_irq_release(mcp2518fd_bus_t *bus) {
+    mcp_int_irq_set(bus, true);
+}
 
-    every bit in CAN is transmitted/received like this:
+//caller has interrupts disabled and bus->current filled in
+static void MCP_HOT(spi_dma_start)(mcp2518fd_bus_t *bus) {
+    mcp_spi_xfer_t *xfer = &bus->current;
 
-    SYNC (1 TQ) + PROP (N TQ) + PHASE 1 (N TQ) + PHASE 2 (N TQ)
+    dma_channel_set_read_addr(bus->dma_tx_chan, xfer->txbuffer, false);
+    dma_channel_set_trans_count(bus->dma_tx_chan, xfer->len, false);
+    dma_channel_set_write_addr(bus->dma_rx_chan, xfer->rxbuffer, false);
+    dma_channel_set_trans_count(bus->dma_rx_chan, xfer->len, false);
 
-    PROP + PHASE 1 >= 2*(propagation delay + transceiver delay)/TQ (for shorter wires)
+#ifdef MCP2518FD_PIO_SPI
+    if(mcp_bus_is_pio(bus)) {
+        mcp_pio_start(bus, xfer->dev, xfer->len);
+    } else
+#endif
+    gpio_put(xfer->dev->cs_pin, LOW);
 
-    PHASE 2 >= 2 TQ
+#ifdef MCP2518FD_TRACE
+    xfer->trace_cs = mcp_trace_now();
+#endif
 
-    sampling point = (1 + PROP + PHASE 1)/(1 + PROP + PHASE 1 + PHASE 2) --> gives percentage of bit time where sampling occurs, aim for 75 - 80%? 
+    //start both at once so the RX channel is armed before the first byte comes back
+    dma_start_channel_mask((1u << bus->dma_tx_chan) | (1u << bus->dma_rx_chan));
+}
 
+//finishes a DMA transfer and starts the next queued one, called from the DMA IRQ or from whoever is waiting on the
+//bus, whichever gets there first (a waiter inside another IRQ at the same priority would otherwise spin forever)
+static void MCP_HOT(spi_dma_complete)(mcp2518fd_bus_t *bus) {
+    uint32_t irq_state = save_and_disable_interrupts();
 
-    NBT (nominal bit time) = 1 + PROP + PHASE 1 + PHASE 2
+    if(!bus->busy || dma_channel_is_busy(bus->dma_rx_chan)) {
+        restore_interrupts(irq_state);
+        return;
+    }
 
-    Bit rate = SYSCLK / ((BRP+1)*NBT)
+    MCP_TRACE_STAMP(t_clocked);
 
-    Synchronization jump width (SJW) <= MIN(PHASE 1, PHASE 2) but typically 4 TQ wide
+    if(!mcp_bus_is_pio(bus)) {
+        gpio_put(bus->current.dev->cs_pin, HIGH); //the PIO program raises CS itself
+    }
 
+#ifdef MCP2518FD_TRACE
+    mcp_spi_xfer_t done = bus->current;
+#endif
 
-    set BRP = 0
-    and set total time for each bit to be 80 TQ
-    then our bit rate with a 40Mhz SYSCLK will be 500 kbps
+    spi_MCP_callback_t callback = bus->current.callback;
+    void *ctx = bus->current.ctx;
 
-    with 80 TQ, 1 will automatically be allocated to the SYNC section (unchangeable)
+    if(bus->queue_tail != bus->queue_head) {
+        bus->current = bus->queue[bus->queue_tail];
+        bus->queue_tail = (bus->queue_tail + 1) % MCP_SPI_QUEUE_LEN;
+        spi_dma_start(bus);
+    } else {
+        bus->busy = false;
+    }
 
-    I will go for a sampling point percentage of 80%, which means our PROP + PHASE 1 (TSEG1) will be allocated 63 TQ and our PHASE 2 (TSEG2) will be allocated 16 TQ
-    for maximum flexibility i will do SJW = 16 TQ 
-    */ 
+    bool idle = !bus->busy;
 
+    restore_interrupts(irq_state);
 
-    REG_CiNBTCFG NBT_reg; 
+    if(idle) {
+        mcp_int_irq_release(bus);
+    }
 
-    NBT_reg.bF.SJW = 15;
-    NBT_reg.bF.TSEG2 = 15;
-    NBT_reg.bF.TSEG1 = 62;
-    NBT_reg.bF.BRP = 0;
+    MCP_TRACE_STAMP(t_end);
+    MCP_TRACE_RECORD(done.dev, done.txbuffer, done.len, MCP2518FD_TRACE_DMA | done.trace_flags, done.trace_site, done.trace_start, done.trace_cs, t_clocked, t_end);
 
-    //0-based register so subtract one to desired number of TQ to assign
+    if(callback) {
+        callback(ctx);
+    }
+}
 
-    SPI_write_word_to_MCP(MCP2518FD_REG_CiNBTCFG, NBT_reg.word);
+static void MCP_HOT(spi_dma_irq_handler)(void) {
+    for(uint8_t i = 0; i < MCP_NBUSES; i++) {
+        mcp2518fd_bus_t *bus = &mcp_buses[i];
 
+        if(bus->dma_rx_chan < 0 || !bus->initialised || !dma_channel_get_irq0_status(bus->dma_rx_chan)) {
+            continue; //shared IRQ line, not ours
+        }
 
+        dma_channel_acknowledge_irq0(bus->dma_rx_chan);
 
+        spi_dma_complete(bus);
+    }
 }
 
-void MCP2518fd_data_bit_timing_config() {
-    REG_CiDBTCFG DBT_reg;
+void SPI_DMA_init(mcp2518fd_dev_t *dev) {
+    static bool irq_installed = false;
+    mcp2518fd_bus_t *bus = dev->bus;
+
+    bus->dma_tx_chan = dma_claim_unused_channel(true);
+    bus->dma_rx_chan = dma_claim_unused_channel(true);
+
+    dma_channel_config tx_cfg = dma_channel_get_default_config(bus->dma_tx_chan);
+    channel_config_set_transfer_data_size(&tx_cfg, DMA_SIZE_8);
+    channel_config_set_read_increment(&tx_cfg, true);
+    channel_config_set_write_increment(&tx_cfg, false);
+    volatile void *tx_reg;
+    volatile void *rx_reg;
+
+#ifdef MCP2518FD_PIO_SPI
+    if(mcp_bus_is_pio(bus)) {
+        //byte writes to the TX FIFO get replicated across the word, the SM only shifts the top 8 bits out
+        channel_config_set_dreq(&tx_cfg, pio_get_dreq(bus->pio, bus->sm, true));
+        tx_reg = &bus->pio->txf[bus->sm];
+        rx_reg = &bus->pio->rxf[bus->sm];
+    } else
+#endif
+    {
+        channel_config_set_dreq(&tx_cfg, spi_get_dreq(dev->spi, true));
+        tx_reg = &spi_get_hw(dev->spi)->dr;
+        rx_reg = &spi_get_hw(dev->spi)->dr;
+    }
 
-    //nearly the same principles as NBT, but faster for data transmission, and signal sampling point will be at around 75%
-    //so fewer TQ will be used (20 TQ), NBT = 20 TQ
+    dma_channel_configure(bus->dma_tx_chan, &tx_cfg, tx_reg, NULL, 0, false);
 
-    /*
-    TQ = (BRP+1)/SYSCLK = 25 ns
+    dma_channel_config rx_cfg = dma_channel_get_default_config(bus->dma_rx_chan);
+    channel_config_set_transfer_data_size(&rx_cfg, DMA_SIZE_8);
+    channel_config_set_read_increment(&rx_cfg, false);
+    channel_config_set_write_increment(&rx_cfg, true);
+#ifdef MCP2518FD_PIO_SPI
+    if(mcp_bus_is_pio(bus)) {
+        channel_config_set_dreq(&rx_cfg, pio_get_dreq(bus->pio, bus->sm, false));
+    } else
+#endif
+    channel_config_set_dreq(&rx_cfg, spi_get_dreq(dev->spi, false));
 
-    bit rate = SYSCL/((1+BRP)*NBT)
-    sample point = (1+TSEG1)/NBT
+    dma_channel_configure(bus->dma_rx_chan, &rx_cfg, NULL, rx_reg, 0, false);
 
-    TSEG1 = 14 TQ
-    TSEG2 = 5 TQ
-    */
+    dma_channel_set_irq0_enabled(bus->dma_rx_chan, true);
+
+    if(!irq_installed) {
+        irq_add_shared_handler(DMA_IRQ_0, spi_dma_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        irq_set_enabled(DMA_IRQ_0, true);
+        irq_installed = true;
+    }
+}
 
-    DBT_reg.bF.BRP = 0;
-    DBT_reg.bF.SJW = 3;
-    DBT_reg.bF.TSEG1 = 13;
-    DBT_reg.bF.TSEG2 = 4;
+//true once the bus this device sits on has nothing in flight or queued
+bool MCP_HOT(spi_MCP_transfer_done)(mcp2518fd_dev_t *dev) {
+    return !dev->bus->busy;
+}
 
-    SPI_write_word_to_MCP(MCP2518FD_REG_CiDBTCFG, DBT_reg.word);
+void MCP_HOT(spi_MCP_wait_transfer)(mcp2518fd_dev_t *dev) {
+    mcp2518fd_bus_t *bus = dev->bus;
 
+    while(bus->busy) {
+        if(!dma_channel_is_busy(bus->dma_rx_chan)) {
+            spi_dma_complete(bus);
+        }
+    }
 }
 
-void MCP2518fd_TDC_config() {
+//queues a transfer and returns straight away, buffers must stay valid until the callback fires.
+//transfers to any device on the same bus go out in order, back to back. returns false if the queue is full.
+//the callback runs from the DMA IRQ, or from spi_MCP_wait_transfer() if that notices completion first
+bool MCP_HOT(spi_write_to_MCP_async)(mcp2518fd_dev_t *dev, uint8_t *txbuffer, uint8_t *rxbuffer, uint16_t len, spi_MCP_callback_t callback, void *ctx) {
+    mcp2518fd_bus_t *bus = dev->bus;
 
-    REG_CiTDC TDC_reg;
+    if(len == 0) {
+        return false;
+    }
 
-    TDC_reg.bF.TDCMode = 0b10; //activate auto TDC mode
-    TDC_reg.bF.TDCOffset = 0;
-    TDC_reg.bF.EdgeFilterEnable = 0; //enable this if there are noise and synchronization issues in startup
-    TDC_reg.bF.SID11Enable = 0;
+    mcp_spi_xfer_t xfer = {
+        .dev = dev,
+        .txbuffer = txbuffer,
+        .rxbuffer = rxbuffer,
+        .len = len,
+        .callback = callback,
+        .ctx = ctx,
+#ifdef MCP2518FD_TRACE
+        .trace_site = MCP_TRACE_SITE(),
+        .trace_start = mcp_trace_now(),
+#endif
+    };
+
+    uint32_t irq_state = save_and_disable_interrupts();
+
+    dev->stats.spi_bytes += len;
+
+    if(!bus->busy) {
+        mcp_int_irq_hold(bus);
+        bus->busy = true;
+        bus->current = xfer;
+        spi_dma_start(bus);
+    } else {
+        uint8_t next = (bus->queue_head + 1) % MCP_SPI_QUEUE_LEN;
+
+        if(next == bus->queue_tail) {
+            restore_interrupts(irq_state);
+            return false;
+        }
+
+        bus->queue[bus->queue_head] = xfer;
+        bus->queue_head = next;
+    }
 
-    SPI_write_word_to_MCP(MCP2518FD_REG_CiTDC, TDC_reg.word);
+    restore_interrupts(irq_state);
 
+    return true;
 }
 
-void MCP2518fd_TXQ_FIFO_config() { //CiTXQCON
-    REG_CiTXQCON TXQ_reg;
+//need bit padding for 4 bytes
+//need polling after reset 
+//REMEMBER MSB FIRST for individual bytes but for multi-bytes LSB first (for data transmission and reconstruction)
 
+/*
+the chip sends multi-byte values LSB first and the M33 is little endian too, so a word on the wire is a word in memory
+and marshalling is a plain copy. the 4 byte memcpy compiles to one (unaligned capable) LDR/STR; the burst buffers
+below put the data 4 byte aligned behind the command prefix so block copies go word by word as well
+*/
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "SPI marshalling assumes a little endian host"
+#endif
+
+static inline uint32_t mcp_get_word(const uint8_t *b) {
+    uint32_t word;
+    memcpy(&word, b, 4);
+    return word;
+}
 
-    TXQ_reg.txBF.TxNotFullIE = 0;
-    TXQ_reg.txBF.TxEmptyIE = 0;
-    TXQ_reg.txBF.TxAttemptIE = 0;
+static inline void mcp_put_word(uint8_t *b, uint32_t word) {
+    memcpy(b, &word, 4);
+}
 
-    //for now not using any interrupts for TX queue
+//command prefix (2 bytes, 3 for CRC) right before an aligned data[]
+typedef struct {
+    uint8_t pad[2];
+    uint8_t cmd[2];
+    union {
+        uint8_t data[BUF_LEN];
+        uint32_t words[BUF_LEN/4]; //for building message objects in place
+    };
+} __attribute__((aligned(4))) mcp_burst_buf_t;
+
+typedef struct {
+    uint8_t pad[1];
+    uint8_t cmd[3];
+    uint8_t data[BUF_LEN + 2]; //+ CRC
+} __attribute__((aligned(4))) mcp_crc_burst_buf_t;
+
+void MCP_HOT(SPI_read_word_from_MCP)(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t *data) {
+    uint8_t txbuffer[6] = {0};
+    uint8_t rxbuffer[6] = {0};
 
-    TXQ_reg.txBF.FRESET = 1; //reset all FIFOs
-    TXQ_reg.txBF.TxPriority = 31; //set as highest priority FIFO
-    TXQ_reg.txBF.TxAttempts = 0; //unlimited attempts for message transmission because we are treating the TX queue as highest priority, so messages are critical
+    txbuffer[0] = (MCP2518FD_INSTR_READ << 4) | (addr >> 8) & 0x0F;
+    txbuffer[1] = addr & 0xFF; 
 
-    TXQ_reg.txBF.FifoSize = 3; //4 messages per slot 
-    TXQ_reg.txBF.PayLoadSize = 0b000; //8 bytes 
+    spi_write_to_MCP(dev, txbuffer, rxbuffer, 6);
 
-    //FifoSize defines the number of slots within the FIFO. each slot holds a singular CAN message.
-    
-    SPI_write_word_to_MCP(MCP2518FD_REG_CiTXQCON, TXQ_reg.word);
-    
-   
+    *data = mcp_get_word(&rxbuffer[2]);
 
 }
 
-void MCP2518fd_set_TXQ_UINC() { //UINC belongs in the CiTEFCON and CiTXQCONregister
-    REG_CiTXQCON TXQ_reg;
+void MCP_HOT(SPI_write_word_to_MCP)(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t data) {
 
-    SPI_read_word_from_MCP(MCP2518FD_REG_CiTXQCON, &TXQ_reg.word);
+    uint8_t txbuffer[6] = {0};
+    uint8_t rxbuffer[6] = {0};
 
-    TXQ_reg.txBF.UINC = 1;
+    txbuffer[0] = (MCP2518FD_INSTR_WRITE << 4) | ((addr >> 8) & 0x0F);
+    txbuffer[1] = addr & 0xFF;
+    mcp_put_word(&txbuffer[2], data);
 
-    SPI_write_word_to_MCP(MCP2518FD_REG_CiTXQCON, TXQ_reg.word);
+    spi_write_to_MCP(dev, txbuffer, rxbuffer, 6);
+}
 
+/*
+burst access, the MCP2518FD auto-increments the address for as long as CS stays low
+so one 2 byte command header covers the whole block instead of one header per word.
+blocks bigger than BUF_LEN get split into BUF_LEN sized CS windows.
+*/
 
-    //should i poll here?
+void MCP_HOT(SPI_read_block_from_MCP)(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t *buf, uint16_t nwords) {
+    mcp_burst_buf_t tx = {0};
+    mcp_burst_buf_t rx;
 
-    //in terms of the design, UINC is meant to be incremented whenever i write a new message within the transmit buffer
-    //should i do this in tandem with the TXREQ bit?
+    while(nwords) {
+        uint16_t chunk = (nwords > BUF_LEN/4) ? BUF_LEN/4 : nwords;
 
+        tx.cmd[0] = (MCP2518FD_INSTR_READ << 4) | ((addr >> 8) & 0x0F);
+        tx.cmd[1] = addr & 0xFF;
 
-}
+        spi_write_to_MCP(dev, tx.cmd, rx.cmd, 2 + chunk*4);
 
-void MCP2518fd_FIFO_config(uint8_t n, uint8_t m) { //CiFIFOCON
+        memcpy(buf, rx.data, chunk*4);
 
-    REG_CiFIFOCON TXFIFOCON_reg;
+        addr += chunk*4;
+        buf += chunk;
+        nwords -= chunk;
+    }
+}
 
-    TXFIFOCON_reg.txBF.PayLoadSize = 0b000;
-    TXFIFOCON_reg.txBF.FifoSize = 9;
+void MCP_HOT(SPI_write_block_to_MCP)(mcp2518fd_dev_t *dev, uint16_t addr, const uint32_t *buf, uint16_t nwords) {
+    mcp_burst_buf_t tx;
+    mcp_burst_buf_t rx;
 
-    TXFIFOCON_reg.txBF.TxAttempts = 2;
-    TXFIFOCON_reg.txBF.TxPriority = 0; //lowest priority 
-    TXFIFOCON_reg.txBF.FRESET = 1; //reset this FIFO
+    while(nwords) {
+        uint16_t chunk = (nwords > BUF_LEN/4) ? BUF_LEN/4 : nwords;
 
-    TXFIFOCON_reg.txBF.TxEnable = 1; //set as Tx FIFO
+        tx.cmd[0] = (MCP2518FD_INSTR_WRITE << 4) | ((addr >> 8) & 0x0F);
+        tx.cmd[1] = addr & 0xFF;
 
-    TXFIFOCON_reg.txBF.RTREnable = 1;
-    TXFIFOCON_reg.txBF.TxAttemptIE = 1;
-    TXFIFOCON_reg.txBF.TxEmptyIE = 1;
-    TXFIFOCON_reg.txBF.TxHalfFullIE = 1;
-    TXFIFOCON_reg.txBF.TxNotFullIE = 1;
+        memcpy(tx.data, buf, chunk*4);
 
-    for(uint8_t i = 1; i <= n; i++) {
-        SPI_write_word_to_MCP(MCP2518FD_REG_CiFIFOCON+i*12, TXFIFOCON_reg.word);
+        spi_write_to_MCP(dev, tx.cmd, rx.cmd, 2 + chunk*4);
+
+        addr += chunk*4;
+        buf += chunk;
+        nwords -= chunk;
     }
+}
 
+/*
+in-place read: buf[0..1] gets the command header and the data comes back right behind it in the same buffer.
+this is safe full duplex because byte i is always shifted out before byte i is shifted back in,
+so callers can receive a message object straight into its final (aligned) home without a second copy.
+len includes the 2 command bytes.
+*/
+void MCP_HOT(SPI_read_raw_from_MCP)(mcp2518fd_dev_t *dev, uint16_t addr, uint8_t *buf, uint16_t len) {
+    buf[0] = (MCP2518FD_INSTR_READ << 4) | ((addr >> 8) & 0x0F);
+    buf[1] = addr & 0xFF;
+
+    spi_write_to_MCP(dev, buf, buf, len);
+}
 
-    //check header files at lines 123-126 to ensure base address of FIFO and REG_STRIDE is correct
+//partial register write, SFRs can be written a byte at a time (e.g. just the enable half of CiINT)
+void MCP_HOT(SPI_write_bytes_to_MCP)(mcp2518fd_dev_t *dev, uint16_t addr, const uint8_t *data, uint8_t len) {
+    uint8_t txbuffer[6] = {0};
+    uint8_t rxbuffer[6] = {0};
 
-    REG_CiFIFOCON RXFIFOCON_reg;
+    if(len > 4) {
+        return;
+    }
 
-    RXFIFOCON_reg.rxBF.PayLoadSize = 0b000;
-    RXFIFOCON_reg.rxBF.FifoSize = 9;
-    
-    RXFIFOCON_reg.rxBF.FRESET = 1;
-    RXFIFOCON_reg.rxBF.TxEnable = 0;
-    RXFIFOCON_reg.rxBF.RxTimeStampEnable = 0;
-    RXFIFOCON_reg.rxBF.RxOverFlowIE = 1;
-    RXFIFOCON_reg.rxBF.RxFullIE = 1;
-    RXFIFOCON_reg.rxBF.RxHalfFullIE = 1;
-    RXFIFOCON_reg.rxBF.RxNotEmptyIE = 1;
-    
+    txbuffer[0] = (MCP2518FD_INSTR_WRITE << 4) | ((addr >> 8) & 0x0F);
+    txbuffer[1] = addr & 0xFF;
 
-    for(uint8_t j = 1; j <= m; j++) {
-        SPI_write_word_to_MCP(MCP2518FD_REG_CiFIFOCON+(n+j)*12, RXFIFOCON_reg.word);
+    for(uint8_t i = 0; i < len; i++) {
+        txbuffer[2 + i] = data[i];
     }
 
-    MCP2518fd_filter_and_mask_enable_config(n, m);    
+    spi_write_to_MCP(dev, txbuffer, rxbuffer, 2 + len);
+}
 
+void MCP_HOT(SPI_write_byte_to_MCP)(mcp2518fd_dev_t *dev, uint16_t addr, uint8_t data) {
+    SPI_write_bytes_to_MCP(dev, addr, &data, 1);
 }
 
-void MCP2518fd_filter_and_mask_enable_config(uint8_t n, uint8_t m) { //CiFLTCON
+/*
+CRC transfers (READ_CRC / WRITE_CRC / WRITE_SAFE)
 
-    //setting catch-all filters only for RX FIFOs
+    CMD+ADDR (2) + N (1) + data + CRC-16 (2, MSB first), CRC = poly 0x8005, init 0xFFFF over everything before it
+    N counts bytes for SFRs and words for RAM
 
-    REG_CiFLTCON filter_control_reg;
-    REG_CiFLTOBJ filter_reg;
-    REG_CiMASK mask_reg;
+these are separate calls so the hot RX path keeps using plain READ and only what needs protecting pays for it.
+they always go over DMA (blocking) so the CRC gets folded in while the bytes are on the wire instead of in a second
+pass afterwards: a write sends the body while the CRC of it is worked out and tacks the 2 CRC bytes on the end, a read
+folds in each received byte as soon as the RX channel's write pointer moves past it. the RP2350 DMA sniffer can't do
+0x8005 so this is crc16_table on the CPU, a table lookup per byte is far quicker than a byte on the wire.
 
-    filter_reg.word = 0;
-    mask_reg.word = 0;
-    
-    for(int i = 0; i < m; i++) {
+the chip flags a bad write CRC in REG_CRC.CRCERRIF and drops the write, check it with MCP2518fd_crc_check()
+*/
 
-        uint8_t fifo_num = n+1+i;
+#define MCP_CRC_CHUNK_WORDS (BUF_LEN/4 - 1) //N is 8 bits, so SFR bursts stop at 252 bytes
 
-        SPI_write_word_to_MCP(MCP2518FD_REG_CiFLTOBJ + i*MCP2518FD_FILTER_REG_STRIDE, filter_reg.word);
-        SPI_write_word_to_MCP(MCP2518FD_REG_CiMASK + i*MCP2518FD_FILTER_REG_STRIDE, mask_reg.word);
+static inline uint16_t mcp_crc16_update(uint16_t crc, const uint8_t *data, uint16_t len) {
+    for(uint16_t i = 0; i < len; i++) {
+        crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ data[i]) & 0xFF];
+    }
 
-        uint16_t filter_control_reg_addr = MCP2518FD_REG_CiFLTCON + (i/4)*4;
+    return crc;
+}
 
-        SPI_read_word_from_MCP(filter_control_reg_addr, &filter_control_reg.word);
+static inline bool mcp_addr_is_ram(uint16_t addr) {
+    return addr >= MCP2518FD_RAM_START && addr < MCP2518FD_RAM_END;
+}
 
-        switch(i%4) {
-            case 0:
-                filter_control_reg.bF.FLTEN0 = 1;
-                filter_control_reg.bF.F0BP = fifo_num;
-                break;
+/*
+blocking DMA transfer with the CRC worked out on the fly, returns the CRC of everything but the 2 trailing bytes.
+the bus is claimed the same way spi_write_to_MCP_async() does it, so an async transfer queued from an IRQ meanwhile
+waits behind this one instead of restarting the channels under it, and the normal completion path finishes it. the
+RX channel's IRQ stays off until then, the read side follows its write pointer and the IRQ would move it on
+*/
+static uint16_t spi_crc_transfer(mcp2518fd_dev_t *dev, uint8_t *txbuffer, uint8_t *rxbuffer, uint16_t len, bool write) {
+    mcp2518fd_bus_t *bus = dev->bus;
+    uint32_t irq_state;
 
-            case 1:
-                filter_control_reg.bF.FLTEN1 = 1;
-                filter_control_reg.bF.F1BP = fifo_num;
-                break;
+    MCP_TRACE_STAMP(t_start);
 
-            case 2:
-                filter_control_reg.bF.FLTEN2 = 1;
-                filter_control_reg.bF.F2BP = fifo_num;
-                break;
+    while(1) {
+        spi_MCP_wait_transfer(dev);
 
-            case 3:
-                filter_control_reg.bF.FLTEN3 = 1;
-                filter_control_reg.bF.F3BP = fifo_num;
-                break;
+        irq_state = save_and_disable_interrupts();
+
+        if(!bus->busy) {
+            break;
         }
 
-        SPI_write_word_to_MCP(filter_control_reg_addr, filter_control_reg.word);
+        restore_interrupts(irq_state); //something got queued after the wait, go round again
     }
 
+    mcp_int_irq_hold(bus);
+    dma_channel_set_irq0_enabled(bus->dma_rx_chan, false);
+    bus->busy = true;
+    bus->current = (mcp_spi_xfer_t){
+        .dev = dev,
+        .txbuffer = txbuffer,
+        .rxbuffer = rxbuffer,
+        .len = len,
+#ifdef MCP2518FD_TRACE
+        .trace_site = MCP_TRACE_SITE(),
+        .trace_start = t_start,
+        .trace_flags = MCP2518FD_TRACE_CRC,
+#endif
+    };
+
+    dev->stats.spi_bytes += len;
+
+    dma_channel_set_read_addr(bus->dma_tx_chan, txbuffer, false);
+    dma_channel_set_trans_count(bus->dma_tx_chan, write ? len - 2 : len, false); //write CRC isn't known yet
+    dma_channel_set_write_addr(bus->dma_rx_chan, rxbuffer, false);
+    dma_channel_set_trans_count(bus->dma_rx_chan, len, false);
+
+#ifdef MCP2518FD_PIO_SPI
+    if(mcp_bus_is_pio(bus)) {
+        mcp_pio_start(bus, dev, len); //whole length up front, SCK just stalls until the CRC bytes are in
+    } else
+#endif
+    gpio_put(dev->cs_pin, LOW);
+
+#ifdef MCP2518FD_TRACE
+    bus->current.trace_cs = mcp_trace_now();
+#endif
+
+    dma_start_channel_mask((1u << bus->dma_tx_chan) | (1u << bus->dma_rx_chan));
+
+    restore_interrupts(irq_state);
+
+    uint16_t crc = mcp_crc16_update(0xFFFF, txbuffer, 3); //CMD+ADDR and N always come from our side
+
+    if(write) {
+        crc = mcp_crc16_update(crc, &txbuffer[3], len - 5);
+
+        txbuffer[len - 2] = crc >> 8;
+        txbuffer[len - 1] = crc & 0xFF;
+
+        dma_channel_wait_for_finish_blocking(bus->dma_tx_chan);
+        dma_channel_transfer_from_buffer_now(bus->dma_tx_chan, &txbuffer[len - 2], 2); //CS is still low, SCK just pauses
+    } else {
+        uint16_t done = 3;
+
+        while(done < len - 2) {
+            uint16_t landed = (uint8_t *)(uintptr_t)dma_channel_hw_addr(bus->dma_rx_chan)->write_addr - rxbuffer;
+
+            if(landed > len - 2) {
+                landed = len - 2;
+            }
+
+            if(landed > done) {
+                crc = mcp_crc16_update(crc, &rxbuffer[done], landed - done);
+                done = landed;
+            }
+        }
+    }
+
+    dma_channel_wait_for_finish_blocking(bus->dma_rx_chan);
+
+    spi_dma_complete(bus); //CS, the INT release and the next queued transfer
+    dma_channel_set_irq0_enabled(bus->dma_rx_chan, true); //still flagged, the handler just finds nothing to do
 
-  
+    return crc;
 }
 
+//returns -1 if any chunk came back with a bad CRC, buf is still filled in but shouldn't be trusted
+int8_t SPI_read_block_crc_from_MCP(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t *buf, uint16_t nwords) {
+    mcp_crc_burst_buf_t tx = {0};
+    mcp_crc_burst_buf_t rx;
+    uint8_t *txbuffer = tx.cmd;
+    uint8_t *rxbuffer = rx.cmd;
+    int8_t result = 0;
 
-//CiINT
-//IOCON
-//set to normal mode (poll)
+    while(nwords) {
+        uint16_t chunk = (nwords > MCP_CRC_CHUNK_WORDS) ? MCP_CRC_CHUNK_WORDS : nwords;
+        uint16_t len = 3 + chunk*4 + 2;
 
-int8_t MCP2518fd_available_RAM_calc() {
-    //RAM used = (8 + PayLoadSize)*(FifoSize+1), 
-    //8 additional bytes from the header (ID word + Control word), 
-    //but is 12 with timestamps (disabled)
-    return 0;
+        txbuffer[0] = (MCP2518FD_INSTR_READ_CRC << 4) | ((addr >> 8) & 0x0F);
+        txbuffer[1] = addr & 0xFF;
+        txbuffer[2] = mcp_addr_is_ram(addr) ? chunk : chunk*4;
 
-}
+        uint16_t crc = spi_crc_transfer(dev, txbuffer, rxbuffer, len, false);
 
-int8_t MCP2518fd_init() {
-    SPI_to_CAN_master_init();
+        if(crc != (((uint16_t)rxbuffer[len - 2] << 8) | rxbuffer[len - 1])) {
+            dev->crc_errors++;
+            result = -1;
+        }
 
-    spi_reset_MCP_chip(); //should set CAN controller mode to configuration mode already but further checks are made later
+        memcpy(buf, rx.data, chunk*4);
 
-    sleep_ms(2);
+        addr += chunk*4;
+        buf += chunk;
+        nwords -= chunk;
+    }
 
-    REG_OSC osc;
+    return result;
+}
 
-    uint32_t timeout = 1000;
+void SPI_write_block_crc_to_MCP(mcp2518fd_dev_t *dev, uint16_t addr, const uint32_t *buf, uint16_t nwords) {
+    mcp_crc_burst_buf_t tx;
+    mcp_crc_burst_buf_t rx;
+    uint8_t *txbuffer = tx.cmd;
+    uint8_t *rxbuffer = rx.cmd;
 
-    while(--timeout) {
-        SPI_read_word_from_MCP(MCP2518FD_REG_OSC, &osc.word);
-        if(osc.bF.OscReady) {
+    while(nwords) {
+        uint16_t chunk = (nwords > MCP_CRC_CHUNK_WORDS) ? MCP_CRC_CHUNK_WORDS : nwords;
+
+        txbuffer[0] = (MCP2518FD_INSTR_WRITE_CRC << 4) | ((addr >> 8) & 0x0F);
+        txbuffer[1] = addr & 0xFF;
+        txbuffer[2] = mcp_addr_is_ram(addr) ? chunk : chunk*4;
+
+        memcpy(tx.data, buf, chunk*4);
+
+        spi_crc_transfer(dev, txbuffer, rxbuffer, 3 + chunk*4 + 2, true);
+
+        addr += chunk*4;
+        buf += chunk;
+        nwords -= chunk;
+    }
+}
+
+//single SFR byte that only gets written if its CRC checks out on the chip side, for the ones that must not be corrupted
+void SPI_write_byte_safe_to_MCP(mcp2518fd_dev_t *dev, uint16_t addr, uint8_t data) {
+    uint8_t txbuffer[5];
+    uint8_t rxbuffer[5];
+
+    txbuffer[0] = (MCP2518FD_INSTR_WRITE_SAFE << 4) | ((addr >> 8) & 0x0F);
+    txbuffer[1] = addr & 0xFF;
+    txbuffer[2] = data;
+
+    uint16_t crc = mcp_crc16_update(0xFFFF, txbuffer, 3); //too short for DMA to be worth it
+
+    txbuffer[3] = crc >> 8;
+    txbuffer[4] = crc & 0xFF;
+
+    spi_write_to_MCP(dev, txbuffer, rxbuffer, 5);
+}
+
+//-1 if the chip has seen a bad CRC or a malformed CRC command since the last check, flags are cleared either way
+int8_t MCP2518fd_crc_check(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    REG_CRC crc_reg;
+
+    crc_reg.word = MCP2518fd_reg_read(dev, MCP2518FD_REG_CRC);
+
+    if(!crc_reg.bF.CRCERRIF && !crc_reg.bF.FERRIF) {
+        return 0;
+    }
+
+    SPI_write_byte_to_MCP(dev, MCP2518FD_REG_CRC + 2, 0); //flag byte only, the enables in byte 3 stay as they are
+
+    dev->crc_errors++;
+
+    return -1;
+}
+
+void MCP_HOT(spi_write_to_MCP)(mcp2518fd_dev_t *dev, uint8_t *txbuffer, uint8_t *rxbuffer, uint16_t len) {
+    MCP_TRACE_STAMP(t_start);
+
+    spi_MCP_wait_transfer(dev); //never cut into a DMA transfer that is still in flight (on any device on this bus)
+
+    if(len >= SPI_DMA_MIN_LEN) {
+        spi_write_to_MCP_async(dev, txbuffer, rxbuffer, len, NULL, NULL);
+        spi_MCP_wait_transfer(dev);
+        return;
+    }
+
+    mcp_int_irq_hold(dev->bus);
+
+    dev->stats.spi_bytes += len;
+
+#ifdef MCP2518FD_PIO_SPI
+    if(mcp_bus_is_pio(dev->bus)) {
+        mcp_pio_start(dev->bus, dev, len);
+    } else
+#endif
+    gpio_put(dev->cs_pin, LOW);
+
+    MCP_TRACE_STAMP(t_cs);
+
+#ifdef MCP2518FD_PIO_SPI
+    if(mcp_bus_is_pio(dev->bus)) {
+        mcp_pio_transfer_blocking(dev->bus, txbuffer, rxbuffer, len);
+    } else
+#endif
+    spi_write_read_blocking(dev->spi, txbuffer, rxbuffer, len);
+
+    MCP_TRACE_STAMP(t_clocked);
+
+    if(!mcp_bus_is_pio(dev->bus)) {
+        gpio_put(dev->cs_pin, HIGH);
+    }
+
+    mcp_int_irq_release(dev->bus);
+
+    MCP_TRACE_STAMP(t_end);
+    MCP_TRACE_RECORD(dev, txbuffer, len, 0, MCP_TRACE_SITE(), t_start, t_cs, t_clocked, t_end);
+
+}
+
+void spi_reset_MCP_chip(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+
+    uint8_t txbuffer[6] = {0};
+    uint8_t rxbuffer[6] = {0};
+    txbuffer[0] = (MCP2518FD_INSTR_RESET << 4) | (0x00 >> 4) & 0x0F;
+    txbuffer[1] = 0x00;
+
+    spi_write_to_MCP(dev, txbuffer, rxbuffer, 2);
+
+}
+
+/*
+shadow register file
+
+RAM copy of the configuration registers so changing a few bits doesn't need a read over SPI first.
+bits the hardware owns (status, ready flags, trigger bits like UINC/TXREQ/FRESET) are marked volatile:
+they are never cached (always 0 in the shadow) and anything that needs them has to MCP2518fd_reg_read() the chip.
+*/
+
+//volatile bits for 0x000 - 0x04C, 0xFFFFFFFF means pure status and not worth caching at all
+static const uint32_t mcp_ctrl_volatile_bits[20] = {
+    /* 0x000 CiCON    */ 0x08E00800, //AbortAllTx, OpMode, isBusy
+    /* 0x004 CiNBTCFG */ 0x00000000,
+    /* 0x008 CiDBTCFG */ 0x00000000,
+    /* 0x00C CiTDC    */ 0x0000003F, //measured TDCValue
+    /* 0x010 CiTBC    */ 0xFFFFFFFF,
+    /* 0x014 CiTSCON  */ 0x00000000,
+    /* 0x018 CiVEC    */ 0xFFFFFFFF,
+    /* 0x01C CiINT    */ 0x0000FFFF, //flags, enables are cached
+    /* 0x020 CiRXIF   */ 0xFFFFFFFF,
+    /* 0x024 CiTXIF   */ 0xFFFFFFFF,
+    /* 0x028 CiRXOVIF */ 0xFFFFFFFF,
+    /* 0x02C CiTXATIF */ 0xFFFFFFFF,
+    /* 0x030 CiTXREQ  */ 0xFFFFFFFF,
+    /* 0x034 CiTREC   */ 0xFFFFFFFF,
+    /* 0x038 CiBDIAG0 */ 0xFFFFFFFF,
+    /* 0x03C CiBDIAG1 */ 0xFFFFFFFF,
+    /* 0x040 CiTEFCON */ 0x00000500, //UINC, FRESET
+    /* 0x044 CiTEFSTA */ 0xFFFFFFFF,
+    /* 0x048 CiTEFUA  */ 0xFFFFFFFF,
+    /* 0x04C CiFIFOBA */ 0xFFFFFFFF
+};
+
+#define MCP_FIFOCON_VOLATILE_BITS 0x00000700 //UINC, TXREQ, FRESET
+
+static const uint32_t mcp_specific_volatile_bits[5] = {
+    /* 0xE00 OSC    */ 0x00001500, //PllReady, OscReady, SclkReady
+    /* 0xE04 IOCON  */ 0x00030000, //GPIO input state
+    /* 0xE08 CRC    */ 0x0003FFFF, //last CRC, CRCERRIF, FERRIF
+    /* 0xE0C ECCCON */ 0x00000000,
+    /* 0xE10 ECCSTA */ 0xFFFFFFFF
+};
+
+//finds the shadow slot for addr, NULL if it isn't shadowed. FIFO STA/UA are never shadowed
+static uint32_t *MCP_HOT(mcp_shadow_slot)(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t *volatile_bits) {
+    if(addr & 0x3) {
+        return NULL;
+    }
+
+    if(addr <= MCP2518FD_REG_CiFIFOBA) {
+        *volatile_bits = mcp_ctrl_volatile_bits[addr/4];
+        return &dev->shadow.ctrl[addr/4];
+    }
+
+    if(addr >= MCP2518FD_REG_CiFIFOCON && addr < MCP2518FD_REG_CiFLTCON) {
+        if((addr - MCP2518FD_REG_CiFIFOCON) % MCP2518FD_FIFO_REG_STRIDE) {
+            return NULL;
+        }
+        *volatile_bits = MCP_FIFOCON_VOLATILE_BITS;
+        return &dev->shadow.fifo[(addr - MCP2518FD_REG_CiFIFOCON)/MCP2518FD_FIFO_REG_STRIDE];
+    }
+
+    if(addr >= MCP2518FD_REG_CiFLTCON && addr < MCP2518FD_REG_CiFLTOBJ) {
+        *volatile_bits = 0;
+        return &dev->shadow.fltcon[(addr - MCP2518FD_REG_CiFLTCON)/4];
+    }
+
+    if(addr >= MCP2518FD_REG_CiFLTOBJ && addr < MCP2518FD_REG_CiFLTOBJ + 32*MCP2518FD_FILTER_REG_STRIDE) {
+        *volatile_bits = 0;
+        return &dev->shadow.fltobj[(addr - MCP2518FD_REG_CiFLTOBJ)/4];
+    }
+
+    if(addr >= MCP2518FD_REG_OSC && addr <= MCP2518FD_REG_ECCSTA) {
+        *volatile_bits = mcp_specific_volatile_bits[(addr - MCP2518FD_REG_OSC)/4];
+        return &dev->shadow.specific[(addr - MCP2518FD_REG_OSC)/4];
+    }
+
+    return NULL;
+}
+
+static void mcp_shadow_store(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t value) {
+    uint32_t volatile_bits;
+    uint32_t *slot = mcp_shadow_slot(dev, addr, &volatile_bits);
+
+    if(slot) {
+        *slot = value & ~volatile_bits;
+    }
+}
+
+//reseed from the datasheet reset values, call right after a chip reset
+void MCP2518fd_shadow_reset(mcp2518fd_dev_t *dev) {
+    for(uint8_t i = 0; i < 20; i++) {
+        dev->shadow.ctrl[i] = mcp2518fd_ctrl_reset_vals[i] & ~mcp_ctrl_volatile_bits[i];
+    }
+
+    for(uint8_t i = 0; i < 32; i++) {
+        dev->shadow.fifo[i] = mcp2518fd_fifo_reset_vals[0] & ~MCP_FIFOCON_VOLATILE_BITS;
+    }
+
+    memset(dev->shadow.fltcon, 0, sizeof(dev->shadow.fltcon));
+    memset(dev->shadow.fltobj, 0, sizeof(dev->shadow.fltobj));
+
+    for(uint8_t i = 0; i < 5; i++) {
+        dev->shadow.specific[i] = mcp2518fd_specific_reset_vals[i] & ~mcp_specific_volatile_bits[i];
+    }
+}
+
+/*
+config image. the bring-up builds the whole configuration in the shadow (seeded from the reset value tables by
+MCP2518fd_shadow_reset) and MCP2518fd_config_image_load() sends it as one burst per block instead of a transaction
+per register: 0x000-0x04C, the FIFO control block from CiTXQCON to the last FIFO touched, and the filter objects and
+masks from 0x1F0 followed by the filter controls at 0x1D0. each burst covers first to last dirty word, untouched words in between go out with their shadow value and
+FIFO STA/UA and the fully volatile status registers as 0. that's only harmless straight after a reset in
+configuration mode (it clears flags and zeroes TBC), so this is a bring-up tool, not a general write cache.
+OSC/IOCON/CRC/ECC and anything not shadowed still go straight to the chip while the image is active
+*/
+#define MCP_IMAGE_CTRL 0
+#define MCP_IMAGE_FIFO 1
+#define MCP_IMAGE_FLTCON 2
+#define MCP_IMAGE_FLTOBJ 3
+
+static int8_t mcp_image_region(uint16_t addr, uint8_t *index) {
+    if(addr & 0x3) {
+        return -1;
+    }
+
+    if(addr <= MCP2518FD_REG_CiFIFOBA) {
+        *index = addr/4;
+        return MCP_IMAGE_CTRL;
+    }
+
+    if(addr >= MCP2518FD_REG_CiFIFOCON && addr < MCP2518FD_REG_CiFLTCON) {
+        if((addr - MCP2518FD_REG_CiFIFOCON) % MCP2518FD_FIFO_REG_STRIDE) {
+            return -1;
+        }
+        *index = (addr - MCP2518FD_REG_CiFIFOCON)/MCP2518FD_FIFO_REG_STRIDE;
+        return MCP_IMAGE_FIFO;
+    }
+
+    if(addr >= MCP2518FD_REG_CiFLTCON && addr < MCP2518FD_REG_CiFLTOBJ) {
+        *index = (addr - MCP2518FD_REG_CiFLTCON)/4;
+        return MCP_IMAGE_FLTCON;
+    }
+
+    if(addr >= MCP2518FD_REG_CiFLTOBJ && addr < MCP2518FD_REG_CiFLTOBJ + 32*MCP2518FD_FILTER_REG_STRIDE) {
+        *index = (addr - MCP2518FD_REG_CiFLTOBJ)/4;
+        return MCP_IMAGE_FLTOBJ;
+    }
+
+    return -1;
+}
+
+static bool mcp_image_is_dirty(mcp2518fd_dev_t *dev, uint16_t addr) {
+    uint8_t index;
+    int8_t region = mcp_image_region(addr, &index);
+
+    return dev->image.active && region >= 0 && (dev->image.dirty[region] & (1ull << index));
+}
+
+//true if the write was taken into the image, false if it has to go to the chip
+static bool MCP_HOT(mcp_image_stage)(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t value) {
+    uint8_t index;
+    uint32_t volatile_bits;
+    int8_t region = mcp_image_region(addr, &index);
+
+    if(!dev->image.active || region < 0) {
+        return false;
+    }
+
+    uint32_t *slot = mcp_shadow_slot(dev, addr, &volatile_bits);
+
+    if(!slot || volatile_bits == 0xFFFFFFFF) {
+        return false;
+    }
+
+    *slot = value & ~volatile_bits;
+    dev->image.dirty[region] |= 1ull << index;
+
+    if(region == MCP_IMAGE_FIFO) {
+        dev->image.trigger[index] |= value & MCP_FIFOCON_VOLATILE_BITS;
+    } else if(addr == MCP2518FD_REG_CiTEFCON) {
+        dev->image.trigger[32] |= value & mcp_ctrl_volatile_bits[index];
+    }
+
+    return true;
+}
+
+void MCP2518fd_config_image_begin(mcp2518fd_dev_t *dev) {
+    memset(&dev->image, 0, sizeof(dev->image));
+    dev->image.active = true;
+}
+
+static void mcp_image_span(uint64_t dirty, uint8_t *first, uint8_t *last) {
+    *first = __builtin_ctzll(dirty);
+    *last = 63 - __builtin_clzll(dirty);
+}
+
+void MCP2518fd_config_image_load(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    mcp2518fd_config_image_t *image = &dev->image;
+    uint32_t buf[32 * 3]; //biggest span is the whole FIFO control block, the filter block is 72 words
+    uint8_t first, last;
+
+    image->active = false;
+
+    if(image->dirty[MCP_IMAGE_CTRL]) {
+        mcp_image_span(image->dirty[MCP_IMAGE_CTRL], &first, &last);
+
+        for(uint8_t i = first; i <= last; i++) {
+            buf[i - first] = dev->shadow.ctrl[i];
+
+            if(i == MCP2518FD_REG_CiTEFCON/4) {
+                buf[i - first] |= image->trigger[32];
+            }
+        }
+
+        SPI_write_block_to_MCP(dev, first*4, buf, last - first + 1);
+    }
+
+    if(image->dirty[MCP_IMAGE_FIFO]) {
+        mcp_image_span(image->dirty[MCP_IMAGE_FIFO], &first, &last);
+
+        uint16_t nwords = (last - first)*3 + 1; //stops at the last CON, its STA/UA aren't needed
+
+        memset(buf, 0, nwords*4);
+
+        for(uint8_t i = first; i <= last; i++) {
+            buf[(i - first)*3] = dev->shadow.fifo[i] | image->trigger[i];
+        }
+
+        SPI_write_block_to_MCP(dev, MCP2518FD_REG_CiFIFOCON + first*MCP2518FD_FIFO_REG_STRIDE, buf, nwords);
+    }
+
+    //FLTOBJ/MASK first: the chip ignores writes to them while their FLTCON enable bit is set, so a FLTCON with FLTENn
+    //going out ahead of them (one burst in address order would do that) leaves that filter at obj = mask = 0
+    if(image->dirty[MCP_IMAGE_FLTOBJ]) {
+        mcp_image_span(image->dirty[MCP_IMAGE_FLTOBJ], &first, &last);
+
+        for(uint8_t i = first; i <= last; i++) {
+            buf[i - first] = dev->shadow.fltobj[i];
+        }
+
+        SPI_write_block_to_MCP(dev, MCP2518FD_REG_CiFLTOBJ + first*4, buf, last - first + 1);
+    }
+
+    if(image->dirty[MCP_IMAGE_FLTCON]) {
+        mcp_image_span(image->dirty[MCP_IMAGE_FLTCON], &first, &last);
+
+        for(uint8_t i = first; i <= last; i++) {
+            buf[i - first] = dev->shadow.fltcon[i];
+        }
+
+        SPI_write_block_to_MCP(dev, MCP2518FD_REG_CiFLTCON + first*4, buf, last - first + 1);
+    }
+
+    memset(image->dirty, 0, sizeof(image->dirty));
+}
+
+//cached value if the register is shadowed (volatile bits read back as 0), otherwise goes to the chip
+uint32_t MCP_HOT(MCP2518fd_reg_get)(mcp2518fd_dev_t *dev, uint16_t addr) {
+    uint32_t volatile_bits;
+    uint32_t *slot = mcp_shadow_slot(dev, addr, &volatile_bits);
+
+    if(slot && volatile_bits != 0xFFFFFFFF) {
+        return *slot;
+    }
+
+    uint32_t value;
+    SPI_read_word_from_MCP(dev, addr, &value);
+    return value;
+}
+
+//always reads the chip, use when the volatile bits matter
+uint32_t MCP2518fd_reg_read(mcp2518fd_dev_t *dev, uint16_t addr) {
+    uint32_t value;
+
+    SPI_read_word_from_MCP(dev, addr, &value);
+
+    if(mcp_image_is_dirty(dev, addr)) {
+        //the chip hasn't seen the staged value yet, only its volatile bits are worth anything
+        uint32_t volatile_bits;
+        uint32_t *slot = mcp_shadow_slot(dev, addr, &volatile_bits);
+
+        return (value & volatile_bits) | *slot;
+    }
+
+    mcp_shadow_store(dev, addr, value);
+
+    return value;
+}
+
+/*
+only the bytes that differ from the shadow get written (as one contiguous span), so setting UINC/TXREQ/FRESET is a
+3 byte transaction to the control byte and writing a value that is already there costs nothing.
+volatile bits are 0 in the shadow so any trigger bit that is set always counts as changed, and clearable flags
+that are left at 0 are never written by accident.
+*/
+void MCP_HOT(MCP2518fd_reg_write)(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t value) {
+    uint32_t volatile_bits;
+    uint32_t *slot = mcp_shadow_slot(dev, addr, &volatile_bits);
+
+    if(mcp_image_stage(dev, addr, value)) {
+        return;
+    }
+
+    if(!slot || volatile_bits == 0xFFFFFFFF) {
+        SPI_write_word_to_MCP(dev, addr, value);
+        return;
+    }
+
+    uint32_t changed = value ^ *slot;
+
+    if(changed) {
+        REG_t reg;
+        reg.word = value;
+
+        uint8_t first = __builtin_ctz(changed) / 8;
+        uint8_t last = (31 - __builtin_clz(changed)) / 8;
+
+        SPI_write_bytes_to_MCP(dev, addr + first, &reg.byte[first], last - first + 1);
+    }
+
+    *slot = value & ~volatile_bits;
+}
+
+//full 4 byte write regardless of the shadow, for when the chip may have lost its state
+void MCP2518fd_reg_write_full(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t value) {
+    if(mcp_image_stage(dev, addr, value)) {
+        return;
+    }
+
+    SPI_write_word_to_MCP(dev, addr, value);
+    mcp_shadow_store(dev, addr, value);
+}
+
+void MCP2518fd_reg_write_block(mcp2518fd_dev_t *dev, uint16_t addr, const uint32_t *buf, uint16_t nwords) {
+    if(dev->image.active) {
+        uint16_t i = 0;
+
+        while(i < nwords && mcp_image_stage(dev, addr + i*4, buf[i])) {
+            i++;
+        }
+
+        if(i == nwords) {
+            return;
+        }
+
+        //both ends of a block are normally in the same region, anything that isn't stageable goes out as is
+        addr += i*4;
+        buf += i;
+        nwords -= i;
+    }
+
+    SPI_write_block_to_MCP(dev, addr, buf, nwords);
+
+    for(uint16_t i = 0; i < nwords; i++) {
+        mcp_shadow_store(dev, addr + i*4, buf[i]);
+    }
+}
+
+//remember what was written to a FIFO (or TXQ) control register, FIFO resets put the head back at slot 0
+static void mcp_fifo_layout_record(mcp2518fd_dev_t *dev, uint8_t fifo, uint32_t con_word, bool timestamp) {
+    REG_CiFIFOCON con;
+    con.word = con_word;
+
+    dev->fifo_layout[fifo].payload_bytes = mcp2518fd_payload_size_bytes[con.txBF.PayLoadSize];
+    dev->fifo_layout[fifo].depth = con.txBF.FifoSize + 1;
+    dev->fifo_layout[fifo].head = 0;
+    dev->fifo_layout[fifo].timestamp = timestamp;
+}
+
+/*
+bounded polling for the bring-up path. the first re-read comes after MCP_POLL_MIN_US and the gap doubles up to
+MCP_POLL_MAX_US, so a chip that is already there costs one SPI read and a slow one isn't hammered. all ones is never
+accepted since that's what MISO floats to while the chip is still in reset (or not fitted)
+*/
+#define MCP_POLL_MIN_US 2
+#define MCP_POLL_MAX_US 256
+#define MCP_OSC_TIMEOUT_US 10000     //crystal start up and PLL lock, datasheet worst case is ~3 ms
+#define MCP_MODE_TIMEOUT_US 100000   //mode changes wait for the bus to go idle, a long frame at 125k is ~1 ms
+
+static int8_t mcp_poll_reg(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t mask, uint32_t value, uint32_t timeout_us, uint32_t *word) {
+    uint64_t start = time_us_64();
+    uint32_t delay = MCP_POLL_MIN_US;
+
+    while(1) {
+        uint32_t w = MCP2518fd_reg_read(dev, addr);
+
+        if(w != 0xFFFFFFFF && (w & mask) == value) {
+            if(word) {
+                *word = w;
+            }
+            return 0;
+        }
+
+        uint32_t elapsed = time_us_64() - start;
+
+        if(elapsed >= timeout_us) {
+            return -1;
+        }
+
+        busy_wait_us_32(delay < timeout_us - elapsed ? delay : timeout_us - elapsed);
+
+        delay = delay * 2 < MCP_POLL_MAX_US ? delay * 2 : MCP_POLL_MAX_US;
+    }
+}
+
+int8_t MCP2518fd_set_mode(mcp2518fd_dev_t *dev, CAN_OPERATION_MODE mode) {
+    MCP2518FD_TRACE_FUNC();
+    //see header file line 202 for CAN_OPERATION_MODE enum 
+    REG_CiCON CAN_ctrl_reg;
+
+    //the request goes straight out of the shadow, no read first. if we're already in the mode the first poll returns
+    CAN_ctrl_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiCON);
+
+    CAN_ctrl_reg.bF.RequestOpMode = mode;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiCON, CAN_ctrl_reg.word);
+
+    REG_CiCON mask, value;
+    mask.word = 0;
+    value.word = 0;
+    mask.bF.OpMode = 0b111;
+    value.bF.OpMode = mode;
+
+    return mcp_poll_reg(dev, MCP2518FD_REG_CiCON, mask.word, value.word, MCP_MODE_TIMEOUT_US, NULL);
+}
+
+int8_t MCP2518fd_oscillator_check(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    REG_OSC osc_ready;
+    //check line 544 of can.h for more info on REG_OSC bitfield union
+
+    osc_ready.word = 0;
+    osc_ready.bF.OscReady = 1;
+
+    //straight after a reset the oscillator is usually still running, so this tends to pass on the first read
+    return mcp_poll_reg(dev, MCP2518FD_REG_OSC, osc_ready.word, osc_ready.word, MCP_OSC_TIMEOUT_US, NULL);
+
+    /*
+    I will be using 40 Mhz internal crystal oscillator (no PLL)
+    which determines SYSCLK (for CAN FD controller module and RAM message memory access)
+
+    PLL/SCLKDIV setups are picked with dev->clock and applied by MCP2518fd_clock_config
+    */
+
+
+}
+
+
+/*
+switches SYSCLK to a clock profile: PLL and/or SCLKDIV in REG_OSC, wait for the clock to settle, then bring SPI up
+to whatever the new SYSCLK allows. only valid in configuration mode. SPI is shared by everything on the bus so all
+devices on one SPI should use profiles with the same SYSCLK
+*/
+int8_t MCP2518fd_clock_config(mcp2518fd_dev_t *dev, const mcp2518fd_clock_profile_t *profile) {
+    MCP2518FD_TRACE_FUNC();
+    REG_OSC osc_reg;
+
+    osc_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_OSC);
+
+    osc_reg.bF.PllEnable = profile->pll;
+    osc_reg.bF.SCLKDIV = profile->sclk_div2;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_OSC, osc_reg.word);
+
+    REG_OSC ready;
+    ready.word = 0;
+    ready.bF.OscReady = 1;
+    ready.bF.SclkReady = 1;
+    ready.bF.PllReady = profile->pll;
+
+    if(mcp_poll_reg(dev, MCP2518FD_REG_OSC, ready.word, ready.word, MCP_OSC_TIMEOUT_US, NULL)) {
+        return -1;
+    }
+
+    mcp_set_sck(dev, mcp_spi_max_hz(dev->bus, profile->sysclk_hz));
+
+    return 0;
+}
+
+int8_t MCP2518fd_devid_verify(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    REG_DEVID devid_reg;
+    
+    SPI_read_word_from_MCP(dev, MCP2518FD_REG_DEVID, &devid_reg.word);
+
+    if(devid_reg.bF.DEV!= 0x01) {
+        return -1;
+    }
+
+    return 0;
+
+
+}
+
+int8_t MCP2518fd_CAN_controller_config(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+
+    REG_CiCON CiCON_reg, busy;
+
+    busy.word = 0;
+    busy.bF.isBusy = 1;
+
+    if(mcp_poll_reg(dev, MCP2518FD_REG_CiCON, busy.word, 0, MCP_MODE_TIMEOUT_US, &CiCON_reg.word)) {
+        return -1;
+    }
+    
+    /*
+    I am choosing the simplest configuration to make a working prototype that can be tweaked later on
+    */
+
+    CiCON_reg.bF.DNetFilterCount = 0x0;
+    CiCON_reg.bF.IsoCrcEnable = 1;
+    CiCON_reg.bF.ProtocolExceptionEventDisable = 0;
+    CiCON_reg.bF.WakeUpFilterEnable = dev->sleep_cfg != NULL; //only matters in Sleep, keeps bus glitches from waking it
+    CiCON_reg.bF.WakeUpFilterTime = dev->sleep_cfg ? dev->sleep_cfg->wake_filter_time : 0;
+    CiCON_reg.bF.BitRateSwitchDisable = 0;
+    CiCON_reg.bF.RestrictReTxAttempts = 0;
+    CiCON_reg.bF.EsiInGatewayMode = 0;
+    CiCON_reg.bF.SystemErrorToListenOnly = 0;
+    CiCON_reg.bF.StoreInTEF = 0; //turned on by MCP2518fd_TEF_config once the TEF is sized
+    CiCON_reg.bF.TXQEnable = 1;
+    CiCON_reg.bF.TxBandWidthSharing = 0x0;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiCON, CiCON_reg.word);
+    //do i need to poll again?
+
+    return 0;
+
+    
+}
+
+void MCP2518fd_nominal_bit_timing_config(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    /*
+    TQ (time quantum) = (BRP+1)/(SYSCLK)
+
+    BRP is baud rate prescalar
+
+    TQ = 25 nanoseconds if we choose BRP = 0
+
+
+    every bit in CAN is transmitted/received like this:
+
+    SYNC (1 TQ) + PROP (N TQ) + PHASE 1 (N TQ) + PHASE 2 (N TQ)
+
+    PROP + PHASE 1 >= 2*(propagation delay + transceiver delay)/TQ (for shorter wires)
+
+    PHASE 2 >= 2 TQ
+
+    sampling point = (1 + PROP + PHASE 1)/(1 + PROP + PHASE 1 + PHASE 2) --> gives percentage of bit time where sampling occurs, aim for 75 - 80%? 
+
+
+    NBT (nominal bit time) = 1 + PROP + PHASE 1 + PHASE 2
+
+    Bit rate = SYSCLK / ((BRP+1)*NBT)
+
+    Synchronization jump width (SJW) <= MIN(PHASE 1, PHASE 2) but typically 4 TQ wide
+
+
+    set BRP = 0
+    and set total time for each bit to be 80 TQ
+    then our bit rate with a 40Mhz SYSCLK will be 500 kbps
+
+    with 80 TQ, 1 will automatically be allocated to the SYNC section (unchangeable)
+
+    I will go for a sampling point percentage of 80%, which means our PROP + PHASE 1 (TSEG1) will be allocated 63 TQ and our PHASE 2 (TSEG2) will be allocated 16 TQ
+    for maximum flexibility i will do SJW = 16 TQ 
+    */ 
+
+
+    REG_CiNBTCFG NBT_reg; 
+
+    //the search above is done at compile time by can_bit_timing.hpp, for the default profile it lands on
+    //SJW = 15, TSEG2 = 15, TSEG1 = 62, BRP = 0 (0-based register so one less than the TQ count)
+    NBT_reg.word = dev->clock ? dev->clock->nbtcfg : mcp2518fd_nbtcfg_word;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiNBTCFG, NBT_reg.word);
+
+
+
+}
+
+void MCP2518fd_data_bit_timing_config(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    REG_CiDBTCFG DBT_reg;
+
+    //nearly the same principles as NBT, but faster for data transmission, and signal sampling point will be at around 75%
+    //so fewer TQ will be used (20 TQ), NBT = 20 TQ
+
+    /*
+    TQ = (BRP+1)/SYSCLK = 25 ns
+
+    bit rate = SYSCL/((1+BRP)*NBT)
+    sample point = (1+TSEG1)/NBT
+
+    TSEG1 = 14 TQ
+    TSEG2 = 5 TQ
+    */
+
+    DBT_reg.word = dev->clock ? dev->clock->dbtcfg : mcp2518fd_dbtcfg_word; //from can_bit_timing.cpp, SJW is as wide as TSEG2 there
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiDBTCFG, DBT_reg.word);
+
+}
+
+void MCP2518fd_TDC_config(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+
+    REG_CiTDC TDC_reg;
+
+    TDC_reg.word = dev->clock ? dev->clock->tdc : mcp2518fd_tdc_word; //auto TDC mode, TDCOffset at the data phase sample point (can_bit_timing.hpp)
+
+    TDC_reg.bF.EdgeFilterEnable = 0; //enable this if there are noise and synchronization issues in startup
+    TDC_reg.bF.SID11Enable = 0;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiTDC, TDC_reg.word);
+
+}
+
+void MCP2518fd_TXQ_FIFO_config(mcp2518fd_dev_t *dev) { //CiTXQCON
+    MCP2518FD_TRACE_FUNC();
+    REG_CiTXQCON TXQ_reg;
+
+    TXQ_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiTXQCON);
+
+    TXQ_reg.txBF.TxNotFullIE = 0;
+    TXQ_reg.txBF.TxEmptyIE = 0;
+    TXQ_reg.txBF.TxAttemptIE = 0;
+
+    //for now not using any interrupts for TX queue
+
+    TXQ_reg.txBF.FRESET = 1; //reset all FIFOs
+    TXQ_reg.txBF.TxPriority = 31; //set as highest priority FIFO
+    TXQ_reg.txBF.TxAttempts = 0; //unlimited attempts for message transmission because we are treating the TX queue as highest priority, so messages are critical
+
+    TXQ_reg.txBF.FifoSize = 3; //4 messages per slot 
+    TXQ_reg.txBF.PayLoadSize = 0b000; //8 bytes 
+
+    //FifoSize defines the number of slots within the FIFO. each slot holds a singular CAN message.
+    
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiTXQCON, TXQ_reg.word);
+
+    mcp_fifo_layout_record(dev, 0, TXQ_reg.word, false);
+    
+   
+
+}
+
+void MCP2518fd_set_TXQ_UINC(mcp2518fd_dev_t *dev) { //UINC belongs in the CiTEFCON and CiTXQCONregister
+    REG_CiTXQCON TXQ_reg;
+
+    TXQ_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiTXQCON);
+
+    TXQ_reg.txBF.UINC = 1;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiTXQCON, TXQ_reg.word); //only the UINC byte goes out, 3 bytes instead of 6+6
+
+
+    //should i poll here?
+
+    //in terms of the design, UINC is meant to be incremented whenever i write a new message within the transmit buffer
+    //should i do this in tandem with the TXREQ bit?
+
+
+}
+
+void MCP2518fd_FIFO_config(mcp2518fd_dev_t *dev, uint8_t n, uint8_t m) { //CiFIFOCON
+    MCP2518FD_TRACE_FUNC();
+
+    REG_CiFIFOCON TXFIFOCON_reg;
+
+    TXFIFOCON_reg.word = mcp2518fd_fifo_reset_vals[0]; //start from reset so unset fields aren't stack garbage
+
+    TXFIFOCON_reg.txBF.PayLoadSize = 0b000;
+    TXFIFOCON_reg.txBF.FifoSize = 9;
+
+    TXFIFOCON_reg.txBF.TxAttempts = 2;
+    TXFIFOCON_reg.txBF.TxPriority = 0; //lowest priority 
+    TXFIFOCON_reg.txBF.FRESET = 1; //reset this FIFO
+
+    TXFIFOCON_reg.txBF.TxEnable = 1; //set as Tx FIFO
+
+    TXFIFOCON_reg.txBF.RTREnable = 1;
+    TXFIFOCON_reg.txBF.TxAttemptIE = 1;
+    TXFIFOCON_reg.txBF.TxEmptyIE = 1;
+    TXFIFOCON_reg.txBF.TxHalfFullIE = 1;
+    TXFIFOCON_reg.txBF.TxNotFullIE = 1;
+
+    for(uint8_t i = 1; i <= n; i++) {
+        MCP2518fd_reg_write(dev, MCP2518FD_REG_CiFIFOCON+i*12, TXFIFOCON_reg.word);
+
+        mcp_fifo_layout_record(dev, i, TXFIFOCON_reg.word, false);
+    }
+
+
+    //check header files at lines 123-126 to ensure base address of FIFO and REG_STRIDE is correct
+
+    REG_CiFIFOCON RXFIFOCON_reg;
+
+    RXFIFOCON_reg.word = mcp2518fd_fifo_reset_vals[0];
+
+    RXFIFOCON_reg.rxBF.PayLoadSize = 0b000;
+    RXFIFOCON_reg.rxBF.FifoSize = 9;
+    
+    RXFIFOCON_reg.rxBF.FRESET = 1;
+    RXFIFOCON_reg.rxBF.TxEnable = 0;
+    RXFIFOCON_reg.rxBF.RxTimeStampEnable = dev->timestamps;
+    RXFIFOCON_reg.rxBF.RxOverFlowIE = 1;
+    RXFIFOCON_reg.rxBF.RxFullIE = 1;
+    RXFIFOCON_reg.rxBF.RxHalfFullIE = 1;
+    RXFIFOCON_reg.rxBF.RxNotEmptyIE = 1;
+    
+
+    for(uint8_t j = 1; j <= m; j++) {
+        MCP2518fd_reg_write(dev, MCP2518FD_REG_CiFIFOCON+(n+j)*12, RXFIFOCON_reg.word);
+
+        mcp_fifo_layout_record(dev, n+j, RXFIFOCON_reg.word, RXFIFOCON_reg.rxBF.RxTimeStampEnable);
+    }
+
+    MCP2518fd_filter_and_mask_enable_config(dev, n, m);    
+
+}
+
+//filter i takes everything and sends it to fifo
+static void mcp_catch_all_filter(mcp2518fd_dev_t *dev, uint8_t i, uint8_t fifo_num) {
+    REG_CiFLTCON filter_control_reg;
+    REG_CiFLTOBJ filter_reg;
+    REG_CiMASK mask_reg;
+
+    filter_reg.word = 0;
+    mask_reg.word = 0;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiFLTOBJ + i*MCP2518FD_FILTER_REG_STRIDE, filter_reg.word);
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiMASK + i*MCP2518FD_FILTER_REG_STRIDE, mask_reg.word);
+
+    uint16_t filter_control_reg_addr = MCP2518FD_REG_CiFLTCON + (i/4)*4;
+
+    filter_control_reg.word = MCP2518fd_reg_get(dev, filter_control_reg_addr);
+
+    switch(i%4) {
+        case 0:
+            filter_control_reg.bF.FLTEN0 = 1;
+            filter_control_reg.bF.F0BP = fifo_num;
+            break;
+
+        case 1:
+            filter_control_reg.bF.FLTEN1 = 1;
+            filter_control_reg.bF.F1BP = fifo_num;
+            break;
+
+        case 2:
+            filter_control_reg.bF.FLTEN2 = 1;
+            filter_control_reg.bF.F2BP = fifo_num;
+            break;
+
+        case 3:
+            filter_control_reg.bF.FLTEN3 = 1;
+            filter_control_reg.bF.F3BP = fifo_num;
+            break;
+    }
+
+    MCP2518fd_reg_write(dev, filter_control_reg_addr, filter_control_reg.word);
+}
+
+void MCP2518fd_filter_and_mask_enable_config(mcp2518fd_dev_t *dev, uint8_t n, uint8_t m) { //CiFLTCON
+    MCP2518FD_TRACE_FUNC();
+
+    //setting catch-all filters only for RX FIFOs
+
+    for(int i = 0; i < m; i++) {
+        mcp_catch_all_filter(dev, i, n+1+i);
+    }
+
+}
+
+/*
+acceptance filter compiler
+
+a filter passes an ID when (id & mask) == (obj & mask), so one filter covers exactly an aligned power of 2 block of IDs
+or some union of blocks that only differ in the don't care bits. compiling is:
+
+    1. split every range into the fewest aligned power of 2 blocks (exact, a range of n IDs takes at most 2*log2(n))
+    2. while there are more than 32 blocks, merge the pair (same FIFO, same IDE) whose merged filter lets through the
+       fewest IDs that nobody asked for. blocks that overlap or are adjacent merge for free
+
+so the result is exact whenever it fits and otherwise only as loose as it has to be. the host still has to check IDs
+if it can't tolerate the extra frames a merged filter lets in.
+*/
+
+typedef struct {
+    uint32_t value;
+    uint32_t care;      //mask bits, 1 = has to match
+    uint8_t  fifo;
+    bool     extended;
+} mcp_filter_term_t;
+
+static uint32_t mcp_filter_width_mask(bool extended) {
+    return extended ? 0x1FFFFFFF : 0x7FF;
+}
+
+//number of IDs a term matches, 2^(don't care bits)
+static uint32_t mcp_filter_term_span(const mcp_filter_term_t *t) {
+    uint32_t dont_care = mcp_filter_width_mask(t->extended) & ~t->care;
+
+    return 1u << __builtin_popcount(dont_care);
+}
+
+static mcp_filter_term_t mcp_filter_term_merge(const mcp_filter_term_t *a, const mcp_filter_term_t *b) {
+    mcp_filter_term_t m = *a;
+
+    m.care = a->care & b->care & ~(a->value ^ b->value);
+    m.value = a->value & m.care;
+
+    return m;
+}
+
+//merge the cheapest compatible pair, returns -1 if nothing can be merged
+static int8_t mcp_filter_merge_cheapest(mcp_filter_term_t *terms, uint16_t *nterms) {
+    int64_t best_cost = INT64_MAX;
+    uint16_t best_a = 0;
+    uint16_t best_b = 0;
+
+    for(uint16_t a = 0; a < *nterms; a++) {
+        for(uint16_t b = a + 1; b < *nterms; b++) {
+            if(terms[a].fifo != terms[b].fifo || terms[a].extended != terms[b].extended) {
+                continue;
+            }
+
+            mcp_filter_term_t m = mcp_filter_term_merge(&terms[a], &terms[b]);
+            int64_t cost = (int64_t)mcp_filter_term_span(&m) - mcp_filter_term_span(&terms[a]) - mcp_filter_term_span(&terms[b]);
+
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_a = a;
+                best_b = b;
+            }
+        }
+    }
+
+    if(best_cost == INT64_MAX) {
+        return -1;
+    }
+
+    terms[best_a] = mcp_filter_term_merge(&terms[best_a], &terms[best_b]);
+    terms[best_b] = terms[--(*nterms)];
+
+    return 0;
+}
+
+//fills filters[MCP2518FD_NUM_FILTERS], returns how many are used or -1 if the ranges can't be covered
+int8_t MCP2518fd_filter_compile(const can_id_range_t *ranges, uint16_t n, mcp2518fd_filter_t *filters) {
+    mcp_filter_term_t terms[MCP2518FD_FILTER_MAX_TERMS];
+    uint16_t nterms = 0;
+
+    for(uint16_t r = 0; r < n; r++) {
+        uint32_t width = mcp_filter_width_mask(ranges[r].extended);
+        uint32_t first = ranges[r].first;
+        uint32_t last = ranges[r].last;
+
+        if(first > last || last > width || ranges[r].fifo == 0 || ranges[r].fifo > 31) {
+            return -1;
+        }
+
+        while(1) {
+            uint32_t size = 1;
+
+            //grow the block while it stays aligned and inside the range
+            while(size <= width && !(first & (2*size - 1)) && last - first >= 2*size - 1) {
+                size *= 2;
+            }
+
+            if(nterms == MCP2518FD_FILTER_MAX_TERMS && mcp_filter_merge_cheapest(terms, &nterms)) {
+                return -1;
+            }
+
+            terms[nterms].value = first;
+            terms[nterms].care = width & ~(size - 1);
+            terms[nterms].fifo = ranges[r].fifo;
+            terms[nterms].extended = ranges[r].extended;
+            nterms++;
+
+            if(last - first < size) {
+                break; //this block reached last
+            }
+
+            first += size;
+        }
+    }
+
+    while(nterms > MCP2518FD_NUM_FILTERS) {
+        if(mcp_filter_merge_cheapest(terms, &nterms)) {
+            return -1; //more distinct FIFO/IDE groups than filters
+        }
+    }
+
+    for(uint16_t i = 0; i < nterms; i++) {
+        REG_CiFLTOBJ obj_reg;
+        REG_CiMASK mask_reg;
+
+        obj_reg.word = 0;
+        mask_reg.word = 0;
+
+        if(terms[i].extended) {
+            //29 bit ID is SID:EID, SID being the top 11 bits
+            obj_reg.bF.SID = terms[i].value >> 18;
+            obj_reg.bF.EID = terms[i].value & 0x3FFFF;
+            obj_reg.bF.EXIDE = 1;
+            mask_reg.bF.MSID = terms[i].care >> 18;
+            mask_reg.bF.MEID = terms[i].care & 0x3FFFF;
+        } else {
+            obj_reg.bF.SID = terms[i].value;
+            mask_reg.bF.MSID = terms[i].care;
+        }
+
+        mask_reg.bF.MIDE = 1; //standard filters shouldn't pass extended frames and the other way round
+
+        filters[i].obj = obj_reg.word;
+        filters[i].mask = mask_reg.word;
+        filters[i].fifo = terms[i].fifo;
+    }
+
+    return nterms;
+}
+
+/*
+filter objects can only be written while their filter is disabled, so: one burst to disable everything, one burst
+for all the FLTOBJ/MASK pairs, one burst to turn them back on. frames arriving in between aren't accepted
+*/
+void MCP2518fd_filter_program(mcp2518fd_dev_t *dev, const mcp2518fd_filter_t *filters, uint8_t count) {
+    MCP2518FD_TRACE_FUNC();
+    uint32_t fltcon[MCP2518FD_NUM_FILTERS / 4];
+    uint32_t fltobj[MCP2518FD_NUM_FILTERS * 2];
+
+    memset(fltcon, 0, sizeof(fltcon));
+    MCP2518fd_reg_write_block(dev, MCP2518FD_REG_CiFLTCON, fltcon, MCP2518FD_NUM_FILTERS / 4);
+
+    if(!count) {
+        return;
+    }
+
+    for(uint8_t i = 0; i < count; i++) {
+        fltobj[2*i] = filters[i].obj;
+        fltobj[2*i + 1] = filters[i].mask;
+
+        //FLTCON is one byte per filter, FLTENn at bit 7 and FnBP below it
+        fltcon[i/4] |= (uint32_t)(0x80 | filters[i].fifo) << ((i%4) * 8);
+    }
+
+    MCP2518fd_reg_write_block(dev, MCP2518FD_REG_CiFLTOBJ, fltobj, 2*count);
+    MCP2518fd_reg_write_block(dev, MCP2518FD_REG_CiFLTCON, fltcon, (count + 3) / 4);
+}
+
+int8_t MCP2518fd_set_filters(mcp2518fd_dev_t *dev, const can_id_range_t *ranges, uint16_t n) {
+    mcp2518fd_filter_t filters[MCP2518FD_NUM_FILTERS];
+    int8_t count = MCP2518fd_filter_compile(ranges, n, filters);
+
+    if(count < 0) {
+        return -1;
+    }
+
+    MCP2518fd_filter_program(dev, filters, count);
+
+    return count;
+}
+
+void MCP_HOT(MCP2518fd_set_FIFO_UINC)(mcp2518fd_dev_t *dev, uint8_t fifo) {
+    REG_CiFIFOCON FIFOCON_reg;
+    uint16_t addr = MCP2518FD_REG_CiFIFOCON + fifo*MCP2518FD_FIFO_REG_STRIDE;
+
+    FIFOCON_reg.word = MCP2518fd_reg_get(dev, addr);
+
+    FIFOCON_reg.rxBF.UINC = 1;
+
+    MCP2518fd_reg_write(dev, addr, FIFOCON_reg.word);
+
+    dev->fifo_layout[fifo].head = (dev->fifo_layout[fifo].head + 1) % dev->fifo_layout[fifo].depth;
+}
+
+void MCP_HOT(MCP2518fd_decode_rx_msgobj)(const uint32_t *obj, bool timestamp, can_rx_frame_t *frame) {
+    CAN_MSGOBJ_ID id;
+    CAN_RX_MSGOBJ_CTRL ctrl;
+
+    id.word = obj[0];
+    ctrl.word = obj[1];
+
+    if(ctrl.bF.IDE) {
+        frame->id = ((uint32_t)id.bF.SID << 18) | id.bF.EID; //SID is the top 11 bits of a 29 bit id
+    } else {
+        frame->id = id.bF.SID;
+    }
+
+    frame->dlc = ctrl.bF.DLC;
+    frame->len = mcp2518fd_dlc_to_bytes[ctrl.bF.DLC];
+    frame->filter_hit = ctrl.bF.FilterHit;
+
+    frame->flags = (ctrl.bF.IDE ? CAN_FRAME_FLAG_IDE : 0)
+                 | (ctrl.bF.RTR ? CAN_FRAME_FLAG_RTR : 0)
+                 | (ctrl.bF.BRS ? CAN_FRAME_FLAG_BRS : 0)
+                 | (ctrl.bF.FDF ? CAN_FRAME_FLAG_FDF : 0)
+                 | (ctrl.bF.ESI ? CAN_FRAME_FLAG_ESI : 0)
+                 | (timestamp ? CAN_FRAME_FLAG_TS : 0);
+
+    frame->timestamp = timestamp ? obj[2] : 0;
+    frame->payload = (const uint8_t *)&obj[timestamp ? 3 : 2];
+}
+
+//returns 1 if a frame was read, 0 if the FIFO was empty
+//frame->payload stays valid for as long as buf isn't reused
+int8_t MCP2518fd_read_rx_msgobj(mcp2518fd_dev_t *dev, uint8_t fifo, can_rx_msgobj_buf_t *buf, can_rx_frame_t *frame) {
+    uint32_t sta_ua[2];
+    REG_CiFIFOSTA FIFOSTA_reg;
+    REG_CiFIFOUA FIFOUA_reg;
+
+    //STA and UA sit next to each other so one burst gets both
+    SPI_read_block_from_MCP(dev, MCP2518FD_REG_CiFIFOSTA + fifo*MCP2518FD_FIFO_REG_STRIDE, sta_ua, 2);
+
+    FIFOSTA_reg.word = sta_ua[0];
+    FIFOUA_reg.word = sta_ua[1];
+
+    if(!FIFOSTA_reg.rxBF.RxNotEmptyIF) {
+        return 0;
+    }
+
+    const mcp2518fd_fifo_layout_t *layout = &dev->fifo_layout[fifo];
+    uint16_t obj_bytes = 8 + (layout->timestamp ? 4 : 0) + layout->payload_bytes;
+
+    //user address is an offset into message RAM
+    SPI_read_raw_from_MCP(dev, MCP2518FD_RAM_START + FIFOUA_reg.bF.UserAddress, buf->cmd, 2 + obj_bytes);
+
+    MCP2518fd_set_FIFO_UINC(dev, fifo);
+
+    MCP2518fd_decode_rx_msgobj(buf->obj, layout->timestamp, frame);
+
+    //a long frame in a short FIFO gets cut to the payload size by the chip, len from the DLC would run off the object
+    if(frame->len > layout->payload_bytes) {
+        frame->len = layout->payload_bytes;
+    }
+
+    return 1;
+}
+
+/*
+frame pool
+
+each list is a stack of free slot indexes threaded through next[], top holds the first free index in the low half
+and a tag in the high half that moves on every push/pop so a pop racing a pop+push of the same slot (ABA) fails its
+compare and retries. the M33 exclusive monitor gets cleared on exception entry and RP2350 has a global monitor on
+SRAM, so the CAS loop is safe against IRQs and the other core without masking anything.
+RP2350 has no data cache, slots are only laid out 8 byte aligned for the timestamp and word copies
+*/
+
+#define CAN_POOL_CLASSIC_SLOT ((offsetof(can_frame_t, data) + 8 + 7) & ~7)
+#define CAN_POOL_FD_SLOT sizeof(can_frame_t)
+
+_Static_assert(CAN_POOL_CLASSIC_FRAMES < 0x7FFF && CAN_POOL_FD_FRAMES < 0x7FFF, "pool index has to fit in 15 bits");
+
+typedef struct {
+    volatile uint32_t top;
+    volatile uint32_t free;
+    volatile uint32_t low_water;
+    volatile uint32_t failed;       //counted by can_frame_alloc, a classic miss that the FD list serves isn't one
+    uint16_t count;
+    uint16_t slot_bytes;
+    uint8_t *mem;
+    volatile uint16_t *next;
+} mcp_pool_t;
+
+static uint64_t can_pool_classic_mem[CAN_POOL_CLASSIC_FRAMES][CAN_POOL_CLASSIC_SLOT/8];
+static uint64_t can_pool_fd_mem[CAN_POOL_FD_FRAMES][CAN_POOL_FD_SLOT/8];
+static volatile uint16_t can_pool_classic_next[CAN_POOL_CLASSIC_FRAMES];
+static volatile uint16_t can_pool_fd_next[CAN_POOL_FD_FRAMES];
+
+static mcp_pool_t can_pools[2] = {
+    {.top = 0xFFFF, .count = CAN_POOL_CLASSIC_FRAMES, .slot_bytes = CAN_POOL_CLASSIC_SLOT, .mem = (uint8_t *)can_pool_classic_mem, .next = can_pool_classic_next},
+    {.top = 0xFFFF, .count = CAN_POOL_FD_FRAMES, .slot_bytes = CAN_POOL_FD_SLOT, .mem = (uint8_t *)can_pool_fd_mem, .next = can_pool_fd_next},
+};
+
+static bool can_pool_ready = false;
+
+//builds the free lists, called from SPI_to_CAN_master_init. only the first call does anything
+void can_pool_init(void) {
+    if(can_pool_ready) {
+        return;
+    }
+
+    for(uint8_t p = 0; p < 2; p++) {
+        mcp_pool_t *pool = &can_pools[p];
+
+        for(uint16_t i = 0; i < pool->count; i++) {
+            pool->next[i] = (i + 1 < pool->count) ? i + 1 : 0xFFFF;
+        }
+
+        pool->top = pool->count ? 0 : 0xFFFF;
+        pool->free = pool->count;
+        pool->low_water = pool->count;
+    }
+
+    __dmb();
+    can_pool_ready = true;
+}
+
+static uint16_t MCP_HOT(mcp_pool_pop)(mcp_pool_t *pool) {
+    uint32_t top = __atomic_load_n(&pool->top, __ATOMIC_ACQUIRE);
+
+    while(1) {
+        uint16_t index = top & 0xFFFF;
+
+        if(index == 0xFFFF) {
+            return 0xFFFF;
+        }
+
+        //next[index] can be stale if someone else got there first, the tag makes the compare fail in that case
+        uint32_t new_top = ((top + 0x10000) & 0xFFFF0000) | pool->next[index];
+
+        if(__atomic_compare_exchange_n(&pool->top, &top, new_top, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+
+    uint32_t free = __atomic_sub_fetch(&pool->free, 1, __ATOMIC_RELAXED);
+    uint32_t low = __atomic_load_n(&pool->low_water, __ATOMIC_RELAXED);
+
+    //CAS min, a plain compare and store can be overwritten by a higher value from the other core
+    while(free < low && !__atomic_compare_exchange_n(&pool->low_water, &low, free, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    return top & 0xFFFF;
+}
+
+static void MCP_HOT(mcp_pool_push)(mcp_pool_t *pool, uint16_t index) {
+    uint32_t top = __atomic_load_n(&pool->top, __ATOMIC_RELAXED);
+    uint32_t new_top;
+
+    do {
+        pool->next[index] = top & 0xFFFF;
+        new_top = ((top + 0x10000) & 0xFFFF0000) | index;
+    } while(!__atomic_compare_exchange_n(&pool->top, &top, new_top, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_add_fetch(&pool->free, 1, __ATOMIC_RELAXED);
+}
+
+/*
+a frame with room for len data bytes, CAN_FRAME_HANDLE_NONE if the pool is out. classic lengths fall back to the FD
+list when the classic one is empty. only len is set, the rest of the frame is whatever the last user left
+*/
+can_frame_handle_t MCP_HOT(can_frame_alloc)(uint8_t len) {
+    uint16_t index;
+
+    if(len > 64) {
+        return CAN_FRAME_HANDLE_NONE;
+    }
+
+    if(len <= 8 && (index = mcp_pool_pop(&can_pools[0])) != 0xFFFF) {
+        can_frame_get(index)->len = len;
+        return index;
+    }
+
+    if((index = mcp_pool_pop(&can_pools[1])) != 0xFFFF) {
+        can_frame_get(index | CAN_FRAME_HANDLE_FD)->len = len;
+        return index | CAN_FRAME_HANDLE_FD;
+    }
+
+    __atomic_add_fetch(&can_pools[(len <= 8) ? 0 : 1].failed, 1, __ATOMIC_RELAXED);
+
+    return CAN_FRAME_HANDLE_NONE;
+}
+
+void MCP_HOT(can_frame_free)(can_frame_handle_t handle) {
+    if(handle == CAN_FRAME_HANDLE_NONE) {
+        return;
+    }
+
+    mcp_pool_push(&can_pools[(handle & CAN_FRAME_HANDLE_FD) ? 1 : 0], handle & ~CAN_FRAME_HANDLE_FD);
+}
+
+can_frame_t *MCP_HOT(can_frame_get)(can_frame_handle_t handle) {
+    const mcp_pool_t *pool = &can_pools[(handle & CAN_FRAME_HANDLE_FD) ? 1 : 0];
+
+    return (can_frame_t *)(pool->mem + (uint32_t)(handle & ~CAN_FRAME_HANDLE_FD) * pool->slot_bytes);
+}
+
+uint8_t can_frame_capacity(can_frame_handle_t handle) {
+    return (handle & CAN_FRAME_HANDLE_FD) ? 64 : 8;
+}
+
+void can_pool_get_stats(bool fd, can_pool_stats_t *stats) {
+    const mcp_pool_t *pool = &can_pools[fd ? 1 : 0];
+
+    stats->free = pool->free;
+    stats->low_water = pool->low_water;
+    stats->failed = pool->failed;
+}
+
+//header plus the data bytes actually in use, never more than a classic slot holds for a classic frame
+static inline void mcp_frame_copy(can_frame_t *dst, const can_frame_t *src) {
+    memcpy(dst, src, offsetof(can_frame_t, data) + src->len);
+}
+
+/*
+interrupt driven RX
+
+the MCP drives INT low while any enabled interrupt is pending. the GPIO IRQ reads CiVEC to find which RX FIFO
+wants service, drains it with burst reads into the RX ring and repeats until RXCODE says nothing is left.
+only RXIE and RXOVIE are enabled in CiINT here so INT releases once the RX FIFOs are empty.
+*/
+
+static void MCP_HOT(can_rx_ring_push)(mcp2518fd_dev_t *dev, uint8_t fifo, const can_rx_frame_t *view) {
+    uint32_t head = dev->rx_ring.head;
+
+    if(head - dev->rx_ring.tail >= CAN_RX_RING_SIZE) {
+        dev->rx_ring.dropped++;
+        return;
+    }
+
+    can_frame_t *frame = &dev->rx_ring.frames[head & (CAN_RX_RING_SIZE - 1)];
+
+    if(dev->rx_handles) {
+        can_frame_handle_t handle = can_frame_alloc(view->len);
+
+        if(handle == CAN_FRAME_HANDLE_NONE) {
+            dev->rx_ring.dropped++;
+            return;
+        }
+
+        dev->rx_ring.handles[head & (CAN_RX_RING_SIZE - 1)] = handle;
+        frame = can_frame_get(handle);
+    }
+
+    frame->id = view->id;
+    frame->dlc = view->dlc;
+    frame->len = view->len;
+    frame->flags = view->flags;
+    frame->fifo = fifo;
+    frame->timestamp_us = (view->flags & CAN_FRAME_FLAG_TS) ? MCP2518fd_timestamp_to_us(dev, view->timestamp) : 0;
+    memcpy(frame->data, view->payload, view->len);
+
+    __dmb(); //frame contents have to land before the consumer can see the new head
+    dev->rx_ring.head = head + 1;
+
+    dev->stats.rx_frames++;
+
+    if(head + 1 - dev->rx_ring.tail > dev->stats.rx_ring_high_water) {
+        dev->stats.rx_ring_high_water = head + 1 - dev->rx_ring.tail;
+    }
+}
+
+bool can_rx_pop(mcp2518fd_dev_t *dev, can_frame_t *frame) {
+    uint32_t tail = dev->rx_ring.tail;
+
+    if(tail == dev->rx_ring.head) {
+        return false;
+    }
+
+    __dmb(); //don't read the frame before we've seen the head that published it
+
+    if(dev->rx_handles) {
+        can_frame_handle_t handle = dev->rx_ring.handles[tail & (CAN_RX_RING_SIZE - 1)];
+
+        mcp_frame_copy(frame, can_frame_get(handle));
+        can_frame_free(handle);
+    } else {
+        *frame = dev->rx_ring.frames[tail & (CAN_RX_RING_SIZE - 1)];
+    }
+
+    __dmb(); //finish copying out before handing the slot back
+    dev->rx_ring.tail = tail + 1;
+
+    return true;
+}
+
+//with rx_handles, hands over the pool frame itself. the caller frees it with can_frame_free()
+bool can_rx_pop_handle(mcp2518fd_dev_t *dev, can_frame_handle_t *handle) {
+    uint32_t tail = dev->rx_ring.tail;
+
+    if(!dev->rx_handles || tail == dev->rx_ring.head) {
+        return false;
+    }
+
+    __dmb();
+    *handle = dev->rx_ring.handles[tail & (CAN_RX_RING_SIZE - 1)];
+
+    __dmb();
+    dev->rx_ring.tail = tail + 1;
+
+    return true;
+}
+
+uint32_t can_rx_available(mcp2518fd_dev_t *dev) {
+    return dev->rx_ring.head - dev->rx_ring.tail;
+}
+
+uint32_t can_rx_dropped(mcp2518fd_dev_t *dev) {
+    return dev->rx_ring.dropped;
+}
+
+static void MCP_HOT(MCP2518fd_drain_rx_fifo)(mcp2518fd_dev_t *dev, uint8_t fifo) {
+    MCP2518FD_TRACE_FUNC();
+    mcp2518fd_fifo_layout_t *layout = &dev->fifo_layout[fifo];
+    uint16_t sta_addr = MCP2518FD_REG_CiFIFOSTA + fifo*MCP2518FD_FIFO_REG_STRIDE;
+    uint16_t con_addr = MCP2518FD_REG_CiFIFOCON + fifo*MCP2518FD_FIFO_REG_STRIDE;
+    uint16_t obj_bytes = 8 + (layout->timestamp ? 4 : 0) + layout->payload_bytes;
+
+    REG_CiFIFOCON FIFOCON_reg;
+    FIFOCON_reg.word = MCP2518fd_reg_get(dev, con_addr);
+    FIFOCON_reg.rxBF.UINC = 1;
+
+    while(1) {
+        uint32_t sta_ua[2];
+        REG_CiFIFOSTA FIFOSTA_reg;
+        REG_CiFIFOUA FIFOUA_reg;
+
+        SPI_read_block_from_MCP(dev, sta_addr, sta_ua, 2);
+        FIFOSTA_reg.word = sta_ua[0];
+        FIFOUA_reg.word = sta_ua[1];
+
+        if(FIFOSTA_reg.rxBF.RxOverFlowIF) {
+            SPI_write_word_to_MCP(dev, sta_addr, 0); //RXOVIF is the only writable bit, writing 0 clears it
+            dev->rx_ring.dropped++;
+        }
+
+        if(!FIFOSTA_reg.rxBF.RxNotEmptyIF) {
+            break;
+        }
+
+        //for RX FIFOs FifoIndex is where the chip will store the next message, so pending = tail - head.
+        //tail == head with NotEmpty set means the FIFO is full
+        uint8_t pending = (FIFOSTA_reg.rxBF.FifoIndex + layout->depth - layout->head) % layout->depth;
+        if(pending == 0) {
+            pending = layout->depth;
+        }
+
+        if(pending > dev->stats.fifo_high_water[fifo]) {
+            dev->stats.fifo_high_water[fifo] = pending;
+        }
+
+        //objects are contiguous until the end of the FIFO, the rest comes on the next pass
+        uint8_t count = layout->depth - layout->head;
+        if(pending < count) {
+            count = pending;
+        }
+        if(count > BUF_LEN/obj_bytes) {
+            count = BUF_LEN/obj_bytes;
+        }
+
+        SPI_read_raw_from_MCP(dev, MCP2518FD_RAM_START + FIFOUA_reg.bF.UserAddress, dev->rx_burst.cmd, 2 + count*obj_bytes);
+
+        for(uint8_t i = 0; i < count; i++) {
+            MCP2518fd_reg_write(dev, con_addr, FIFOCON_reg.word); //control byte only
+        }
+        layout->head = (layout->head + count) % layout->depth;
+
+        for(uint8_t i = 0; i < count; i++) {
+            can_rx_frame_t view;
+            MCP2518fd_decode_rx_msgobj(&dev->rx_burst.obj[i*obj_bytes/4], layout->timestamp, &view);
+
+            //same cut as MCP2518fd_read_rx_msgobj, otherwise the copy reads into the next object (or past the burst)
+            if(view.len > layout->payload_bytes) {
+                view.len = layout->payload_bytes;
+            }
+
+            can_rx_ring_push(dev, fifo, &view);
+        }
+    }
+}
+
+/*
+timestamps
+
+CiTBC counts SYSCLK/(TBCPrescaler+1), set to MCP2518FD_TBC_HZ so the raw timestamp in a message object is already in
+microseconds. the chip stamps at SOF. a 32 bit microsecond counter wraps every ~71 minutes, TBCIF tells us when.
+*/
+
+void MCP2518fd_timestamp_enable(mcp2518fd_dev_t *dev) {
+    uint32_t sysclk = dev->clock ? dev->clock->sysclk_hz : MCP2518FD_SYSCLK_HZ;
+    REG_CiTSCON tscon_reg;
+
+    tscon_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiTSCON);
+    tscon_reg.bF.TBCPrescaler = sysclk / MCP2518FD_TBC_HZ - 1;
+    tscon_reg.bF.TimeStampEOF = 0;
+    tscon_reg.bF.TBCEnable = 1;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiTSCON, tscon_reg.word);
+
+    REG_CiTEFCON tef_reg;
+    tef_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiTEFCON);
+    tef_reg.bF.TimeStampEnable = 1; //only takes RAM once StoreInTEF is on
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiTEFCON, tef_reg.word);
+
+    REG_CiINT int_reg;
+    int_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiINT);
+    int_reg.bF.IE.TBCIE = 1;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiINT, int_reg.word);
+
+    dev->ts.drift_ppb = 0;
+    dev->ts.host_ref_us = 0;
+    dev->ts.enabled = true;
+
+    if(!dev->image.active) {
+        MCP2518fd_timestamp_sync(dev); //otherwise TBC isn't running yet, the bring-up syncs once the image is loaded
+    }
+}
+
+//restart drops the old reference (TBC stopped or was reset) but keeps the drift estimate
+static void mcp_timestamp_resync(mcp2518fd_dev_t *dev, bool restart) {
+    MCP2518FD_TRACE_FUNC();
+    mcp2518fd_timestamp_t *ts = &dev->ts;
+    uint32_t tbc;
+
+    uint64_t before = time_us_64();
+    SPI_read_word_from_MCP(dev, MCP2518FD_REG_CiTBC, &tbc);
+    uint64_t after = time_us_64();
+
+    uint64_t host = before + (after - before)/2; //TBC was latched somewhere in the middle of the read
+
+    //readers run in the INT service too, one interrupting us on this core with seq odd would spin forever
+    uint32_t irq_state = save_and_disable_interrupts();
+
+    ts->seq++;
+    __dmb();
+
+    if(restart) {
+        ts->host_ref_us = 0;
+    }
+
+    if(ts->host_ref_us) {
+        uint32_t tbc_delta = tbc - ts->tbc_ref;
+        int64_t host_delta = host - ts->host_ref_us;
+
+        //too close together and the read jitter swamps the drift
+        if(tbc_delta >= MCP2518FD_TBC_HZ/10) {
+            int32_t measured = (int32_t)((host_delta - (int64_t)tbc_delta) * 1000000000 / tbc_delta);
+
+            ts->drift_ppb = ts->drift_ppb ? (ts->drift_ppb*3 + measured)/4 : measured;
+        }
+    }
+
+    ts->tbc_ref = tbc;
+    ts->host_ref_us = host;
+
+    __dmb();
+    ts->seq++;
+
+    restore_interrupts(irq_state);
+}
+
+void MCP2518fd_timestamp_sync(mcp2518fd_dev_t *dev) {
+    mcp_timestamp_resync(dev, false);
+}
+
+//call every so often from the main loop (or core1), keeps the drift estimate fresh
+void MCP2518fd_timestamp_service(mcp2518fd_dev_t *dev) {
+    uint64_t now = time_us_64();
+
+    if(!dev->ts.enabled || dev->sleep.asleep || now < dev->ts.next_sync_us) {
+        return;
+    }
+
+    dev->ts.next_sync_us = now + MCP2518FD_TS_SYNC_INTERVAL_US;
+
+    MCP2518fd_timestamp_sync(dev);
+}
+
+uint64_t MCP_HOT(MCP2518fd_timestamp_to_us)(mcp2518fd_dev_t *dev, uint32_t tbc) {
+    const mcp2518fd_timestamp_t *ts = &dev->ts;
+    uint32_t seq;
+    int64_t diff;
+    uint64_t host;
+
+    do {
+        seq = ts->seq;
+        __dmb();
+
+        diff = (int32_t)(tbc - ts->tbc_ref);
+        host = ts->host_ref_us + diff + diff * ts->drift_ppb / 1000000000;
+
+        __dmb();
+    } while((seq & 1) || seq != ts->seq);
+
+    return host;
+}
+
+/*
+RAM ECC
+
+with ECCCON.EccEn set the chip corrects single bit errors on read (SECIF) and flags double errors (DEDIF), ErrorAddress
+says where. a corrected read doesn't fix the word in RAM, so MCP2518fd_ECC_service() writes the corrected value back
+(scrubbing) and also reads a few words of RAM on every call so latent errors get found before they turn into double
+errors. RX FIFO slots are never written back, the chip owns them and rewrites them (with fresh parity) on the next
+frame anyway. a double error resets only the FIFO it landed in instead of the whole chip.
+*/
+
+//called from the INT service routine, returns true if there was something to capture
+static bool mcp_ecc_capture(mcp2518fd_dev_t *dev) {
+    REG_ECCSTA sta_reg;
+    mcp2518fd_ecc_stats_t *ecc = &dev->ecc;
+
+    SPI_read_word_from_MCP(dev, MCP2518FD_REG_ECCSTA, &sta_reg.word);
+
+    if(!sta_reg.bF.SECIF && !sta_reg.bF.DEDIF) {
+        return false;
+    }
+
+    SPI_write_byte_to_MCP(dev, MCP2518FD_REG_ECCSTA, 0); //clears SECIF/DEDIF and with them CiINT.ECCIF
+
+    ecc->last_error_addr = sta_reg.bF.ErrorAddress;
+
+    if(sta_reg.bF.DEDIF) {
+        ecc->ded_count++;
+    } else {
+        ecc->sec_count++;
+    }
+
+    uint32_t head = ecc->pending_head;
+
+    if(head - ecc->pending_tail >= MCP2518FD_ECC_PENDING) {
+        ecc->lost_events++;
+        return true;
+    }
+
+    ecc->pending[head & (MCP2518FD_ECC_PENDING - 1)] = sta_reg.bF.ErrorAddress | (sta_reg.bF.DEDIF ? MCP2518FD_ECC_PENDING_DED : 0);
+
+    __dmb();
+    ecc->pending_head = head + 1;
+
+    return true;
+}
+
+//which FIFO owns a RAM address: 0-31 as in the FIFO registers, 32 for the TEF, -1 for unused RAM
+static int8_t mcp_ram_owner(mcp2518fd_dev_t *dev, uint16_t addr) {
+    REG_CiCON con_reg;
+    uint16_t start = MCP2518FD_RAM_START;
+
+    con_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiCON);
+
+    if(con_reg.bF.StoreInTEF) {
+        REG_CiTEFCON tef_reg;
+        tef_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiTEFCON);
+
+        start += (tef_reg.bF.FifoSize + 1) * (8 + (tef_reg.bF.TimeStampEnable ? 4 : 0));
+
+        if(addr < start) {
+            return 32;
+        }
+    }
+
+    for(uint8_t fifo = 0; fifo < 32; fifo++) {
+        const mcp2518fd_fifo_layout_t *layout = &dev->fifo_layout[fifo];
+
+        if(!layout->depth || (fifo == 0 && !con_reg.bF.TXQEnable)) {
+            continue;
+        }
+
+        start += layout->depth * (8 + (layout->timestamp ? 4 : 0) + layout->payload_bytes);
+
+        if(addr < start) {
+            return fifo;
+        }
+    }
+
+    return -1;
+}
+
+static bool mcp_fifo_is_rx(mcp2518fd_dev_t *dev, int8_t fifo) {
+    REG_CiFIFOCON con_reg;
+
+    if(fifo <= 0 || fifo > 31) {
+        return false; //TXQ and TEF are transmit side
+    }
+
+    con_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiFIFOCON + fifo*MCP2518FD_FIFO_REG_STRIDE);
+
+    return !con_reg.txBF.TxEnable;
+}
+
+//drop whatever was in the FIFO holding a double error, everything else keeps running
+static void mcp_ecc_reset_owner(mcp2518fd_dev_t *dev, int8_t fifo) {
+    if(fifo == 32) {
+        REG_CiTEFCON tef_reg;
+
+        tef_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiTEFCON);
+        tef_reg.bF.FRESET = 1;
+        MCP2518fd_reg_write(dev, MCP2518FD_REG_CiTEFCON, tef_reg.word);
+    } else {
+        uint16_t con_addr = MCP2518FD_REG_CiFIFOCON + fifo*MCP2518FD_FIFO_REG_STRIDE;
+        REG_CiFIFOCON con_reg;
+
+        con_reg.word = MCP2518fd_reg_get(dev, con_addr);
+        con_reg.txBF.FRESET = 1;
+        MCP2518fd_reg_write(dev, con_addr, con_reg.word); //FRESET is volatile so this always goes out, 3 bytes
+
+        dev->fifo_layout[fifo].head = 0;
+    }
+
+    dev->ecc.fifo_resets++;
+}
+
+/*
+turns on ECC with both error interrupts. any RAM word read before it was written would come back as a double error,
+so the whole 2 KB is zeroed in burst writes first. call in configuration mode once the FIFOs are set up
+*/
+void MCP2518fd_ECC_enable(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    static const uint32_t zeros[BUF_LEN/4] = {0};
+    REG_ECCCON ecccon_reg;
+
+    ecccon_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_ECCCON);
+    ecccon_reg.bF.EccEn = 1;
+    ecccon_reg.bF.SECIE = 1;
+    ecccon_reg.bF.DEDIE = 1;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_ECCCON, ecccon_reg.word);
+
+    for(uint16_t addr = MCP2518FD_RAM_START; addr < MCP2518FD_RAM_END; addr += BUF_LEN) {
+        SPI_write_block_to_MCP(dev, addr, zeros, BUF_LEN/4);
+    }
+
+    SPI_write_byte_to_MCP(dev, MCP2518FD_REG_ECCSTA, 0); //anything flagged before the RAM was initialised doesn't count
+
+    REG_CiINT int_reg;
+    int_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiINT);
+    int_reg.bF.IE.ECCIE = 1;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiINT, int_reg.word);
+
+    dev->ecc.scrub_addr = MCP2518FD_RAM_START;
+    dev->ecc.enabled = true;
+}
+
+//low priority housekeeping, call from the main loop (or the core1 service loop) whenever there's time
+void MCP2518fd_ECC_service(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    mcp2518fd_ecc_stats_t *ecc = &dev->ecc;
+
+    if(!ecc->enabled || dev->sleep.asleep) {
+        return;
+    }
+
+    while(ecc->pending_tail != ecc->pending_head) {
+        __dmb();
+        uint16_t event = ecc->pending[ecc->pending_tail & (MCP2518FD_ECC_PENDING - 1)];
+        uint16_t addr = (event & ~MCP2518FD_ECC_PENDING_DED) & ~3u;
+        int8_t owner = mcp_ram_owner(dev, addr);
+
+        __dmb();
+        ecc->pending_tail++;
+
+        if(event & MCP2518FD_ECC_PENDING_DED) {
+            if(owner >= 0) {
+                mcp_ecc_reset_owner(dev, owner);
+            }
+
+            uint32_t zero = 0;
+            SPI_write_block_to_MCP(dev, addr, &zero, 1); //gives the word valid parity again
+        } else if(!mcp_fifo_is_rx(dev, owner)) {
+            uint32_t word;
+            SPI_read_block_from_MCP(dev, addr, &word, 1); //comes back corrected
+            SPI_write_block_to_MCP(dev, addr, &word, 1);
+            ecc->scrubbed++;
+        }
+    }
+
+    uint64_t now = time_us_64();
+
+    if(now < ecc->next_scrub_us) {
+        return;
+    }
+
+    ecc->next_scrub_us = now + MCP2518FD_ECC_SCRUB_INTERVAL_US;
+
+    //read a slice of RAM, any error in it shows up in ECCSTA and gets handled on a later pass
+    uint32_t scrub[MCP2518FD_ECC_SCRUB_WORDS];
+
+    SPI_read_block_from_MCP(dev, ecc->scrub_addr, scrub, MCP2518FD_ECC_SCRUB_WORDS);
+
+    ecc->scrub_addr += MCP2518FD_ECC_SCRUB_WORDS*4;
+
+    if(ecc->scrub_addr >= MCP2518FD_RAM_END) {
+        ecc->scrub_addr = MCP2518FD_RAM_START;
+    }
+
+    if(!dev->int_irq_armed) {
+        mcp_ecc_capture(dev); //nobody is taking the INT pin, poll for the slice we just read
+    }
+}
+
+static void MCP2518fd_drain_tef(mcp2518fd_dev_t *dev); //lives with the TX code below
+static void mcp_tx_sched_irq(mcp2518fd_dev_t *dev, uint8_t fifo);
+
+void MCP_HOT(MCP2518fd_service_irq)(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    REG_CiVEC vec_reg;
+    REG_CiINT int_reg;
+
+    dev->bus->in_service = true;
+
+    while(1) {
+        uint32_t vec_int[2];
+
+        //CiINT sits right after CiVEC, the same burst tells us whether ECCIF is up
+        SPI_read_block_from_MCP(dev, MCP2518FD_REG_CiVEC, vec_int, 2);
+        vec_reg.word = vec_int[0];
+        int_reg.word = vec_int[1];
+
+        if(vec_reg.bF.RXCODE <= MCP2518FD_ICODE_FIFO_MAX) {
+            MCP2518fd_drain_rx_fifo(dev, vec_reg.bF.RXCODE);
+            continue;
+        }
+
+        if(vec_reg.bF.TXCODE <= MCP2518FD_ICODE_FIFO_MAX) {
+            mcp_tx_sched_irq(dev, vec_reg.bF.TXCODE);
+            continue;
+        }
+
+        if(vec_reg.bF.ICODE == MCP2518FD_ICODE_RXOVIF) {
+            //overflow on a FIFO that has since been drained, clear it or INT never releases
+            uint32_t rxovif;
+            SPI_read_word_from_MCP(dev, MCP2518FD_REG_CiRXOVIF, &rxovif);
+
+            for(uint8_t fifo = 1; fifo < 32; fifo++) {
+                if(rxovif & (1u << fifo)) {
+                    SPI_write_word_to_MCP(dev, MCP2518FD_REG_CiFIFOSTA + fifo*MCP2518FD_FIFO_REG_STRIDE, 0);
+                    dev->rx_ring.dropped++;
+                }
+            }
+            continue;
+        }
+
+        if(vec_reg.bF.ICODE == MCP2518FD_ICODE_TBCIF) {
+            SPI_write_byte_to_MCP(dev, MCP2518FD_REG_CiINT, (uint8_t)~(1u << 2)); //TBCIF only, writing 1 leaves the others alone
+            dev->ts.wraps++;
+            MCP2518fd_timestamp_sync(dev);
+            continue;
+        }
+
+        //bus wake out of Sleep, the rest of the wake needs polling so MCP2518fd_sleep_service() does it
+        if(vec_reg.bF.ICODE == MCP2518FD_ICODE_WAKIF) {
+            SPI_write_byte_to_MCP(dev, MCP2518FD_REG_CiINT + 1, (uint8_t)~(1u << 6)); //WAKIF only
+
+            if(dev->sleep.asleep && !dev->sleep.wake_pending) {
+                dev->sleep.wake_start_us = time_us_64();
+                dev->sleep.wake_pending = true;
+                __sev(); //core1 may be sat in __wfe
+            }
+            continue;
+        }
+
+        if(vec_reg.bF.ICODE == MCP2518FD_ICODE_TEFIF) {
+            MCP2518fd_drain_tef(dev);
+            continue;
+        }
+
+        //ECC has no ICODE of its own, ECCSTA only needs reading when ECCIF is what's holding INT low
+        if(dev->ecc.enabled && int_reg.bF.IF.ECCIF && mcp_ecc_capture(dev)) {
+            continue;
+        }
+
+        break;
+    }
+
+    dev->bus->in_service = false;
+}
+
+//one raw handler serves every controller, the GPIO bank IRQ doesn't say which device it was for
+static void MCP_HOT(mcp_int_irq_handler)(void) {
+    for(uint8_t i = 0; i < mcp_ndevices; i++) {
+        mcp2518fd_dev_t *dev = mcp_devices[i];
+
+        if(dev->int_irq_armed && (gpio_get_irq_event_mask(dev->int_pin) & GPIO_IRQ_LEVEL_LOW)) {
+            MCP2518fd_service_irq(dev);
+        }
+    }
+}
+
+//call once the RX FIFOs are configured, IRQs are taken on the calling core
+void MCP2518fd_RX_IRQ_init(mcp2518fd_dev_t *dev) {
+    static bool handler_installed = false;
+
+    gpio_init(dev->int_pin);
+    gpio_set_dir(dev->int_pin, GPIO_IN);
+    gpio_pull_up(dev->int_pin);
+
+    REG_CiINT int_reg;
+    int_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiINT);
+    int_reg.bF.IE.RXIE = 1;
+    int_reg.bF.IE.RXOVIE = 1;
+
+    //only the enable half changes so the flag half (which would clear pending flags) is never written
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiINT, int_reg.word);
+
+    if(!handler_installed) {
+        gpio_add_raw_irq_handler(dev->int_pin, mcp_int_irq_handler);
+        handler_installed = true;
+    }
+
+    dev->int_irq_armed = true;
+    gpio_set_irq_enabled(dev->int_pin, GPIO_IRQ_LEVEL_LOW, true);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+
+/*
+batched TX
+
+one burst read of STA+UA tells us where the tail is and how much room is left, then every message object that fits
+goes out in one burst write (two if it wraps past the end of the FIFO). UINC only moves the tail by one slot per write
+so the commit is one 3 byte write per frame to the control byte, with TXREQ set on the last one.
+*/
+
+static uint8_t can_len_to_dlc(uint8_t len) {
+    uint8_t dlc = 0;
+
+    while(dlc < 15 && mcp2518fd_dlc_to_bytes[dlc] < len) {
+        dlc++;
+    }
+
+    return dlc;
+}
+
+//builds one TX message object (T0, T1, payload padded to the FIFO's payload size) into obj, returns words used
+static uint16_t MCP_HOT(MCP2518fd_encode_tx_msgobj)(const can_frame_t *frame, uint32_t seq, uint8_t payload_bytes, uint32_t *obj) {
+    CAN_MSGOBJ_ID id;
+    CAN_TX_MSGOBJ_CTRL ctrl;
+
+    id.word = 0;
+    ctrl.word = 0;
+
+    if(frame->flags & CAN_FRAME_FLAG_IDE) {
+        id.bF.SID = (frame->id >> 18) & 0x7FF;
+        id.bF.EID = frame->id & 0x3FFFF;
+    } else {
+        id.bF.SID = frame->id & 0x7FF;
+    }
+
+    ctrl.bF.DLC = can_len_to_dlc(frame->len);
+    ctrl.bF.IDE = (frame->flags & CAN_FRAME_FLAG_IDE) ? 1 : 0;
+    ctrl.bF.RTR = (frame->flags & CAN_FRAME_FLAG_RTR) ? 1 : 0;
+    ctrl.bF.BRS = (frame->flags & CAN_FRAME_FLAG_BRS) ? 1 : 0;
+    ctrl.bF.FDF = (frame->flags & CAN_FRAME_FLAG_FDF) ? 1 : 0;
+    ctrl.bF.SEQ = seq & CAN_TX_SEQ_MASK;
+
+    obj[0] = id.word;
+    obj[1] = ctrl.word;
+
+    //payload bytes sit in RAM in frame order, so it's a copy plus zero padding up to the FIFO's payload size
+    uint8_t len = (frame->len < payload_bytes) ? frame->len : payload_bytes;
+
+    memcpy(&obj[2], frame->data, len);
+    memset((uint8_t *)&obj[2] + len, 0, payload_bytes - len);
+
+    return 2 + payload_bytes/4;
+}
+
+//frame i of a batch given as either a frame array or a pool handle array
+static inline const can_frame_t *mcp_batch_frame(const can_frame_t *frames, const can_frame_handle_t *handles, uint8_t i) {
+    return handles ? can_frame_get(handles[i]) : &frames[i];
+}
+
+/*
+claims n consecutive SEQs and returns the first. a send can be cut into by the scheduler refill from the INT IRQ (or
+another core sending to the same device), so the range is taken in one atomic step before anything is encoded
+*/
+uint32_t MCP_HOT(can_tx_seq_claim)(mcp2518fd_dev_t *dev, uint8_t n) {
+    return __atomic_fetch_add(&dev->tx_seq, n, __ATOMIC_RELAXED);
+}
+
+//every direct send goes through this first, false if the device was asleep and didn't come back
+bool MCP_HOT(can_tx_wake)(mcp2518fd_dev_t *dev) {
+    return !dev->sleep.asleep || !MCP2518fd_wake(dev);
+}
+
+//queues up to n frames into a TX FIFO (0 = TXQ) and requests transmission, returns how many were accepted.
+//takes either a frame array or a pool handle array, the other one NULL. seq is the first of n SEQs the caller has
+//already claimed, NULL claims them here once we know how many fit
+static uint8_t MCP_HOT(mcp_send_batch)(mcp2518fd_dev_t *dev, uint8_t fifo, const can_frame_t *frames, const can_frame_handle_t *handles, uint8_t n, const uint32_t *seq) {
+    MCP2518FD_TRACE_FUNC();
+    mcp2518fd_fifo_layout_t *layout = &dev->fifo_layout[fifo];
+    uint16_t sta_addr = MCP2518FD_REG_CiFIFOSTA + fifo*MCP2518FD_FIFO_REG_STRIDE;
+    uint16_t con_addr = MCP2518FD_REG_CiFIFOCON + fifo*MCP2518FD_FIFO_REG_STRIDE;
+    uint16_t obj_words = 2 + layout->payload_bytes/4;
+
+    uint32_t sta_ua[2];
+    REG_CiFIFOSTA FIFOSTA_reg;
+    REG_CiFIFOUA FIFOUA_reg;
+
+    if(n == 0 || layout->depth == 0) {
+        return 0;
+    }
+
+    //sending wakes a sleeping device, in LPM the first CS would wake it into reset and the frames would be lost
+    if(!can_tx_wake(dev)) {
+        return 0;
+    }
+
+    SPI_read_block_from_MCP(dev, sta_addr, sta_ua, 2);
+    FIFOSTA_reg.word = sta_ua[0];
+    FIFOUA_reg.word = sta_ua[1];
+
+    //FifoIndex is the next slot the chip will transmit, head is the next slot we fill
+    uint8_t free;
+    if(FIFOSTA_reg.txBF.TxEmptyIF) {
+        free = layout->depth;
+    } else if(!FIFOSTA_reg.txBF.TxNotFullIF) {
+        free = 0;
+    } else {
+        free = (FIFOSTA_reg.txBF.FifoIndex + layout->depth - layout->head) % layout->depth;
+    }
+
+    uint8_t count = (n < free) ? n : free;
+
+    //stop at the first frame that doesn't fit this FIFO's payload size
+    for(uint8_t i = 0; i < count; i++) {
+        if(mcp_batch_frame(frames, handles, i)->len > layout->payload_bytes) {
+            count = i;
+            break;
+        }
+    }
+
+    if(count == 0) {
+        return 0;
+    }
+
+    uint32_t first_seq = seq ? *seq : can_tx_seq_claim(dev, count);
+    uint16_t addr = MCP2518FD_RAM_START + FIFOUA_reg.bF.UserAddress;
+    uint16_t fifo_start = addr - layout->head*obj_words*4;
+    uint8_t slot = layout->head;
+    uint8_t done = 0;
+
+    while(done < count) {
+        mcp_burst_buf_t tx;
+        mcp_burst_buf_t rx;
+        uint16_t nwords = 0;
+        uint16_t burst_addr = addr;
+
+        //fill one burst, stopping at the end of the FIFO or the end of the buffer
+        while(done < count && nwords + obj_words <= BUF_LEN/4) {
+            nwords += MCP2518fd_encode_tx_msgobj(mcp_batch_frame(frames, handles, done), first_seq + done, layout->payload_bytes, &tx.words[nwords]);
+            done++;
+            slot++;
+
+            if(slot == layout->depth) {
+                slot = 0;
+                break;
+            }
+        }
+
+        //objects are built straight behind the command prefix, no copy into a second buffer
+        tx.cmd[0] = (MCP2518FD_INSTR_WRITE << 4) | ((burst_addr >> 8) & 0x0F);
+        tx.cmd[1] = burst_addr & 0xFF;
+
+        spi_write_to_MCP(dev, tx.cmd, rx.cmd, 2 + nwords*4);
+
+        addr = (slot == 0) ? fifo_start : burst_addr + nwords*4;
+    }
+
+    REG_CiFIFOCON commit;
+    commit.word = 0;
+    commit.txBF.UINC = 1;
+
+    for(uint8_t i = 0; i < count; i++) {
+        if(i == count - 1) {
+            commit.txBF.TxRequest = 1;
+        }
+
+        SPI_write_byte_to_MCP(dev, con_addr + 1, commit.byte[1]);
+    }
+
+    layout->head = slot;
+    __atomic_add_fetch(&dev->stats.tx_frames, count, __ATOMIC_RELAXED);
+
+    return count;
+}
+
+uint8_t can_send_batch_fifo(mcp2518fd_dev_t *dev, uint8_t fifo, const can_frame_t *frames, uint8_t n) {
+    return mcp_send_batch(dev, fifo, frames, NULL, n, NULL);
+}
+
+uint8_t can_send_batch(mcp2518fd_dev_t *dev, const can_frame_t *frames, uint8_t n) {
+    return can_send_batch_fifo(dev, 0, frames, n);
+}
+
+/*
+same as can_send_batch_fifo but every accepted frame is tracked until its TEF record comes back. frames get
+consecutive SEQs starting at *first_seq. callback may be NULL, then poll each SEQ with can_tx_poll().
+stops early if the tracking slots for the next SEQs are still in use. the SEQs are claimed before the slots, whatever
+doesn't get sent just leaves a gap in the numbering
+*/
+static uint8_t mcp_send_tracked(mcp2518fd_dev_t *dev, uint8_t fifo, const can_frame_t *frames, const can_frame_handle_t *handles, uint8_t n, can_tx_done_callback_t callback, void *ctx, uint32_t *first_seq) {
+    uint32_t seq = can_tx_seq_claim(dev, (n < CAN_TX_TRACK_SIZE) ? n : CAN_TX_TRACK_SIZE);
+    uint8_t reserved = 0;
+
+    //slots go PENDING before anything is sent, the TEF record can beat us back otherwise
+    while(reserved < n && reserved < CAN_TX_TRACK_SIZE) {
+        can_tx_track_t *track = &dev->tx_track[(seq + reserved) & (CAN_TX_TRACK_SIZE - 1)];
+
+        if(track->state != CAN_TX_TRACK_FREE) {
+            break;
+        }
+
+        track->seq = (seq + reserved) & CAN_TX_SEQ_MASK;
+        track->callback = callback;
+        track->ctx = ctx;
+        track->fifo = fifo;
+        track->handle = handles ? handles[reserved] : CAN_FRAME_HANDLE_NONE;
+        __dmb();
+        track->state = CAN_TX_TRACK_PENDING;
+        reserved++;
+    }
+
+    uint8_t sent = mcp_send_batch(dev, fifo, frames, handles, reserved, &seq);
+
+    for(uint8_t i = sent; i < reserved; i++) {
+        dev->tx_track[(seq + i) & (CAN_TX_TRACK_SIZE - 1)].state = CAN_TX_TRACK_FREE;
+    }
+
+    if(first_seq) {
+        *first_seq = seq & CAN_TX_SEQ_MASK;
+    }
+
+    return sent;
+}
+
+uint8_t can_send_batch_tracked(mcp2518fd_dev_t *dev, uint8_t fifo, const can_frame_t *frames, uint8_t n, can_tx_done_callback_t callback, void *ctx, uint32_t *first_seq) {
+    return mcp_send_tracked(dev, fifo, frames, NULL, n, callback, ctx, first_seq);
+}
+
+/*
+zero copy version for pool frames. the first return value handles now belong to the driver and go back to the pool
+when their TEF record comes in (or when a TEF overflow lost it), the rest stay with the caller
+*/
+uint8_t can_send_handles_tracked(mcp2518fd_dev_t *dev, uint8_t fifo, const can_frame_handle_t *handles, uint8_t n, can_tx_done_callback_t callback, void *ctx, uint32_t *first_seq) {
+    return mcp_send_tracked(dev, fifo, NULL, handles, n, callback, ctx, first_seq);
+}
+
+//true once the frame with this SEQ is out (and frees its slot), for tracked frames sent without a callback
+bool can_tx_poll(mcp2518fd_dev_t *dev, uint32_t seq, uint64_t *tx_time_us) {
+    can_tx_track_t *track = &dev->tx_track[seq & (CAN_TX_TRACK_SIZE - 1)];
+
+    if(track->state != CAN_TX_TRACK_DONE || track->seq != (seq & CAN_TX_SEQ_MASK)) {
+        return false;
+    }
+
+    __dmb();
+
+    if(tx_time_us) {
+        *tx_time_us = track->tx_time_us;
+    }
+
+    __dmb();
+    track->state = CAN_TX_TRACK_FREE;
+
+    return true;
+}
+
+/*
+TEF
+
+records are just T0/T1 (+ timestamp) of each transmitted frame, so all we want out of them is SEQ. TEFSTA has no count,
+only not empty / half full / full, so the drain reads as many records as those guarantee in one burst (stopping at the
+wrap) and goes round again until the TEF reads empty. UINC still only moves the tail one record per write.
+*/
+void MCP2518fd_TEF_config(mcp2518fd_dev_t *dev, uint8_t depth, bool timestamp) {
+    MCP2518FD_TRACE_FUNC();
+    REG_CiCON con_reg;
+    REG_CiTEFCON tef_reg;
+
+    con_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiCON);
+    con_reg.bF.StoreInTEF = 1;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiCON, con_reg.word);
+
+    tef_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiTEFCON);
+    tef_reg.bF.FifoSize = depth - 1;
+    tef_reg.bF.TimeStampEnable = timestamp;
+    tef_reg.bF.TEFNEIE = 1;
+    tef_reg.bF.FRESET = 1;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiTEFCON, tef_reg.word);
+
+    REG_CiINT int_reg;
+    int_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiINT);
+    int_reg.bF.IE.TEFIE = 1;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiINT, int_reg.word);
+
+    dev->tef_layout.depth = depth;
+    dev->tef_layout.payload_bytes = 0;
+    dev->tef_layout.head = 0;
+    dev->tef_layout.timestamp = timestamp;
+}
+
+static void MCP_HOT(mcp_tx_track_finish)(can_tx_track_t *track, uint64_t tx_time_us) {
+    track->tx_time_us = tx_time_us;
+
+    can_frame_free(track->handle);
+    track->handle = CAN_FRAME_HANDLE_NONE;
+
+    if(track->callback) {
+        track->callback(track->ctx, track->seq, track->tx_time_us);
+        __dmb();
+        track->state = CAN_TX_TRACK_FREE;
+    } else {
+        __dmb();
+        track->state = CAN_TX_TRACK_DONE;
+    }
+}
+
+static void MCP_HOT(mcp_tx_complete)(mcp2518fd_dev_t *dev, uint32_t seq, bool has_ts, uint32_t ts) {
+    can_tx_track_t *track = &dev->tx_track[seq & (CAN_TX_TRACK_SIZE - 1)];
+
+    if(track->state != CAN_TX_TRACK_PENDING || track->seq != seq) {
+        return; //untracked frame
+    }
+
+    mcp_tx_track_finish(track, has_ts ? MCP2518fd_timestamp_to_us(dev, ts) : time_us_64());
+}
+
+/*
+seq is the first record from after a TEF overflow gap. whatever is still pending with an older SEQ in the same FIFO
+went out before it and its record was lost. if seq isn't tracked we don't know its FIFO, so that's every FIFO
+*/
+static void MCP_HOT(mcp_tx_expire_lost)(mcp2518fd_dev_t *dev, uint32_t seq) {
+    const can_tx_track_t *ref = &dev->tx_track[seq & (CAN_TX_TRACK_SIZE - 1)];
+    bool any_fifo = ref->state != CAN_TX_TRACK_PENDING || ref->seq != seq;
+
+    for(uint8_t i = 0; i < CAN_TX_TRACK_SIZE; i++) {
+        can_tx_track_t *track = &dev->tx_track[i];
+        uint32_t age = (seq - track->seq) & CAN_TX_SEQ_MASK;
+
+        if(track->state != CAN_TX_TRACK_PENDING || age == 0 || age > CAN_TX_SEQ_MASK/2) {
+            continue; //not in flight, or sent after seq
+        }
+
+        if(any_fifo || track->fifo == ref->fifo) {
+            mcp_tx_track_finish(track, CAN_TX_TIME_LOST);
+        }
+    }
+}
+
+static void MCP_HOT(MCP2518fd_drain_tef)(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    mcp2518fd_fifo_layout_t *layout = &dev->tef_layout;
+    uint16_t obj_words = 2 + (layout->timestamp ? 1 : 0);
+
+    if(!layout->depth) {
+        return;
+    }
+
+    while(1) {
+        uint32_t sta_ua[2];
+        REG_CiTEFSTA sta_reg;
+        REG_CiFIFOUA ua_reg;
+
+        SPI_read_block_from_MCP(dev, MCP2518FD_REG_CiTEFSTA, sta_ua, 2);
+        sta_reg.word = sta_ua[0];
+        ua_reg.word = sta_ua[1];
+
+        if(sta_reg.bF.TEFOVIF) {
+            SPI_write_byte_to_MCP(dev, MCP2518FD_REG_CiTEFSTA, 0);
+            dev->tef_overflows++;
+
+            //the TEF is full, what's in it went out before the frames whose records were dropped
+            dev->tef_gap = true;
+            dev->tef_gap_skip = layout->depth;
+        }
+
+        if(!sta_reg.bF.TEFNotEmptyIF) {
+            break;
+        }
+
+        uint8_t n = sta_reg.bF.TEFFullIF ? layout->depth : sta_reg.bF.TEFHalfFullIF ? (layout->depth + 1)/2 : 1;
+
+        //TEF sits at the start of RAM so UA/object size is the tail slot
+        uint8_t tail = ua_reg.bF.UserAddress / (obj_words*4);
+
+        if(tail + n > layout->depth) {
+            n = layout->depth - tail;
+        }
+
+        uint32_t records[32 * 3];
+
+        SPI_read_block_from_MCP(dev, MCP2518FD_RAM_START + ua_reg.bF.UserAddress, records, n*obj_words);
+
+        for(uint8_t i = 0; i < n; i++) {
+            CAN_TX_MSGOBJ_CTRL ctrl;
+            const uint32_t *record = &records[i*obj_words];
+
+            ctrl.word = record[1];
+
+            if(dev->tef_gap) {
+                if(dev->tef_gap_skip) {
+                    dev->tef_gap_skip--;
+                } else {
+                    mcp_tx_expire_lost(dev, ctrl.bF.SEQ);
+                    dev->tef_gap = false;
+                }
+            }
+
+            mcp_tx_complete(dev, ctrl.bF.SEQ, layout->timestamp, layout->timestamp ? record[2] : 0);
+        }
+
+        for(uint8_t i = 0; i < n; i++) {
+            SPI_write_byte_to_MCP(dev, MCP2518FD_REG_CiTEFCON + 1, 0x01); //UINC, FRESET in the same byte stays 0
+        }
+
+        dev->tef_records += n;
+    }
+}
+
+
+//CiINT
+//IOCON
+//set to normal mode (poll)
+
+/*
+TX scheduler. the backlog of each class is single producer (can_tx_sched_send) single consumer (the INT service
+routine), same head/tail scheme as the RX ring. the TX FIFO interrupt is the only thing that moves frames from the
+backlog to the chip so the two never race over a FIFO: a direct send only happens while the backlog is empty, and
+with the backlog empty the service routine leaves the FIFO alone
+*/
+
+static void MCP_HOT(mcp_tx_class_irq)(mcp2518fd_dev_t *dev, can_tx_class_t *c, bool on) {
+    uint16_t addr = MCP2518FD_REG_CiFIFOCON + c->cfg.fifo*MCP2518FD_FIFO_REG_STRIDE;
+    REG_CiFIFOCON con_reg;
+
+    con_reg.word = MCP2518fd_reg_get(dev, addr);
+    con_reg.txBF.TxNotFullIE = on && !c->cfg.refill_half;
+    con_reg.txBF.TxHalfFullIE = on && c->cfg.refill_half;
+
+    c->irq_on = on; //before the write, the interrupt can fire the moment it lands
+
+    MCP2518fd_reg_write(dev, addr, con_reg.word);
+}
+
+static bool mcp_fifo_is_tx(mcp2518fd_dev_t *dev, uint8_t fifo) {
+    if(fifo == 0) {
+        REG_CiCON con_reg;
+        con_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiCON);
+        return con_reg.bF.TXQEnable && dev->fifo_layout[0].depth;
+    }
+
+    return dev->fifo_layout[fifo].depth && !mcp_fifo_is_rx(dev, fifo);
+}
+
+/*
+class numbers are the index into classes[]. the TX interrupt enables on every TX FIFO are taken over: FIFOs that
+aren't part of a class get theirs turned off, otherwise turning CiINT.TXIE on would leave INT stuck low on them
+*/
+int8_t MCP2518fd_tx_sched_config(mcp2518fd_dev_t *dev, const can_tx_class_cfg_t *classes, uint8_t n) {
+    MCP2518FD_TRACE_FUNC();
+
+    if(n == 0 || n > CAN_TX_CLASS_MAX) {
+        return -1;
+    }
+
+    for(uint8_t i = 0; i < n; i++) {
+        const can_tx_class_cfg_t *cfg = &classes[i];
+
+        if(cfg->fifo > 31 || !mcp_fifo_is_tx(dev, cfg->fifo) || cfg->priority > 31 || cfg->attempts > 3) {
+            return -1;
+        }
+
+        if(cfg->fifo == 0 && cfg->refill_half) {
+            return -1; //the TXQ has no half empty interrupt
+        }
+
+        for(uint8_t j = 0; j < i; j++) {
+            if(classes[j].fifo == cfg->fifo || classes[j].priority == cfg->priority) {
+                return -1;
+            }
+        }
+    }
+
+    //a reconfigure hands whatever was still queued back to the pool
+    for(uint8_t i = 0; i < dev->tx_nclasses; i++) {
+        can_tx_class_t *c = &dev->tx_classes[i];
+
+        for(uint32_t k = c->tail; k != c->head; k++) {
+            can_frame_free(c->frames[k & (CAN_TX_BACKLOG_SIZE - 1)]);
+        }
+
+        c->tail = c->head;
+    }
+
+    dev->tx_nclasses = 0; //the service routine ignores the classes while they're being set up
+
+    REG_CiFIFOCON con_reg;
+
+    for(uint8_t fifo = 0; fifo < 32; fifo++) {
+        if(!mcp_fifo_is_tx(dev, fifo)) {
+            continue;
+        }
+
+        uint16_t addr = MCP2518FD_REG_CiFIFOCON + fifo*MCP2518FD_FIFO_REG_STRIDE;
+
+        con_reg.word = MCP2518fd_reg_get(dev, addr);
+        con_reg.txBF.TxNotFullIE = 0;
+        con_reg.txBF.TxHalfFullIE = 0;
+        con_reg.txBF.TxEmptyIE = 0;
+
+        MCP2518fd_reg_write(dev, addr, con_reg.word);
+    }
+
+    for(uint8_t i = 0; i < n; i++) {
+        can_tx_class_t *c = &dev->tx_classes[i];
+        uint16_t addr = MCP2518FD_REG_CiFIFOCON + classes[i].fifo*MCP2518FD_FIFO_REG_STRIDE;
+
+        memset(c, 0, offsetof(can_tx_class_t, frames)); //the frames themselves don't need clearing
+        c->cfg = classes[i];
+
+        con_reg.word = MCP2518fd_reg_get(dev, addr);
+        con_reg.txBF.TxPriority = c->cfg.priority;
+        con_reg.txBF.TxAttempts = c->cfg.attempts;
+
+        MCP2518fd_reg_write(dev, addr, con_reg.word);
+
+        //insertion sort into the refill order, highest priority first
+        uint8_t j = i;
+
+        while(j > 0 && dev->tx_classes[dev->tx_class_order[j - 1]].cfg.priority < c->cfg.priority) {
+            dev->tx_class_order[j] = dev->tx_class_order[j - 1];
+            j--;
+        }
+
+        dev->tx_class_order[j] = i;
+    }
+
+    REG_CiINT int_reg;
+    int_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiINT);
+    int_reg.bF.IE.TXIE = 1;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiINT, int_reg.word);
+
+    dev->tx_nclasses = n;
+
+    return 0;
+}
+
+//from the INT service routine on a TX FIFO interrupt. every class gets topped up, highest priority first
+static void MCP_HOT(mcp_tx_sched_irq)(mcp2518fd_dev_t *dev, uint8_t fifo) {
+    bool owned = false;
+
+    for(uint8_t i = 0; i < dev->tx_nclasses; i++) {
+        can_tx_class_t *c = &dev->tx_classes[dev->tx_class_order[i]];
+        uint32_t queued = c->head - c->tail;
+
+        while(queued) {
+            __dmb(); //don't read the frames before we've seen the head that published them
+
+            uint32_t slot = c->tail & (CAN_TX_BACKLOG_SIZE - 1);
+            uint32_t run = CAN_TX_BACKLOG_SIZE - slot;
+
+            if(run > queued) {
+                run = queued;
+            }
+
+            uint8_t sent = mcp_send_batch(dev, c->cfg.fifo, NULL, &c->frames[slot], run, NULL);
+
+            for(uint8_t k = 0; k < sent; k++) {
+                can_frame_free(c->frames[slot + k]);
+            }
+
+            __dmb(); //frames are in the chip before the slots go back to the producer
+            c->tail += sent;
+            c->sent += sent;
+            queued -= sent;
+
+            if(sent < run) {
+                break; //FIFO is full, its interrupt is still on and brings us back
+            }
+        }
+
+        if(!queued && c->irq_on) {
+            mcp_tx_class_irq(dev, c, false);
+        }
+
+        if(c->cfg.fifo == fifo) {
+            owned = true;
+        }
+    }
+
+    if(!owned) {
+        //not ours, make sure it can't hold INT low
+        uint16_t addr = MCP2518FD_REG_CiFIFOCON + fifo*MCP2518FD_FIFO_REG_STRIDE;
+        REG_CiFIFOCON con_reg;
+
+        con_reg.word = MCP2518fd_reg_get(dev, addr);
+        con_reg.txBF.TxNotFullIE = 0;
+        con_reg.txBF.TxHalfFullIE = 0;
+        con_reg.txBF.TxEmptyIE = 0;
+
+        MCP2518fd_reg_write(dev, addr, con_reg.word);
+    }
+}
+
+//handle goes on the backlog, the caller has already checked there's room
+static void mcp_tx_sched_enqueue(mcp2518fd_dev_t *dev, can_tx_class_t *c, can_frame_handle_t handle) {
+    uint32_t head = c->head;
+
+    c->frames[head & (CAN_TX_BACKLOG_SIZE - 1)] = handle;
+
+    __dmb(); //frame contents have to land before the consumer can see the new head
+    c->head = head + 1;
+
+    if(head + 1 - c->tail > c->high_water) {
+        c->high_water = head + 1 - c->tail;
+    }
+
+    if(dev->service_on_core1) {
+        __sev();
+    } else if(!c->irq_on && can_tx_wake(dev)) {
+        mcp_tx_class_irq(dev, c, true);
+    }
+}
+
+static can_tx_class_t *mcp_tx_sched_class(mcp2518fd_dev_t *dev, uint8_t cls, uint8_t len) {
+    if(cls >= dev->tx_nclasses) {
+        return NULL;
+    }
+
+    can_tx_class_t *c = &dev->tx_classes[cls];
+
+    if(len > dev->fifo_layout[c->cfg.fifo].payload_bytes) {
+        return NULL; //would wedge the backlog, can_send_batch_fifo never takes it
+    }
+
+    return c;
+}
+
+/*
+queues a frame on class cls, false if the backlog or the frame pool is full or the frame is too long for the class's
+FIFO. with an empty backlog and room in the FIFO it goes straight out, otherwise it's copied into a pool frame and
+waits for the FIFO interrupt. with service_on_core1 this only touches RAM, core1 enables the interrupt from
+MCP2518fd_tx_sched_service()
+*/
+bool can_tx_sched_send(mcp2518fd_dev_t *dev, uint8_t cls, const can_frame_t *frame) {
+    can_tx_class_t *c = mcp_tx_sched_class(dev, cls, frame->len);
+
+    if(!c) {
+        return false;
+    }
+
+    if(!dev->service_on_core1 && c->head == c->tail && can_send_batch_fifo(dev, c->cfg.fifo, frame, 1)) {
+        c->sent++;
+        return true;
+    }
+
+    can_frame_handle_t handle;
+
+    if(c->head - c->tail >= CAN_TX_BACKLOG_SIZE || (handle = can_frame_alloc(frame->len)) == CAN_FRAME_HANDLE_NONE) {
+        c->dropped++;
+        return false;
+    }
+
+    mcp_frame_copy(can_frame_get(handle), frame);
+    mcp_tx_sched_enqueue(dev, c, handle);
+
+    return true;
+}
+
+//same without the copy. on true the handle belongs to the driver and is freed once sent, on false it's still yours
+bool can_tx_sched_send_handle(mcp2518fd_dev_t *dev, uint8_t cls, can_frame_handle_t handle) {
+    can_tx_class_t *c = mcp_tx_sched_class(dev, cls, can_frame_get(handle)->len);
+
+    if(!c) {
+        return false;
+    }
+
+    if(!dev->service_on_core1 && c->head == c->tail && mcp_send_batch(dev, c->cfg.fifo, NULL, &handle, 1, NULL)) {
+        can_frame_free(handle);
+        c->sent++;
+        return true;
+    }
+
+    if(c->head - c->tail >= CAN_TX_BACKLOG_SIZE) {
+        c->dropped++;
+        return false;
+    }
+
+    mcp_tx_sched_enqueue(dev, c, handle);
+
+    return true;
+}
+
+//turns the FIFO interrupt on for any class that has a backlog, called from the core1 loop
+void MCP2518fd_tx_sched_service(mcp2518fd_dev_t *dev) {
+    if(dev->sleep.asleep) {
+        return; //MCP2518fd_sleep_service() wakes it for the backlog first
+    }
+
+    for(uint8_t i = 0; i < dev->tx_nclasses; i++) {
+        can_tx_class_t *c = &dev->tx_classes[i];
+
+        if(!c->irq_on && c->head != c->tail) {
+            mcp_tx_class_irq(dev, c, true);
+        }
+    }
+}
+
+/*
+stats
+*/
+
+//takes a chip sample if the period is up, returns true when it did. call from the main loop (or core1)
+bool MCP2518fd_stats_service(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    mcp2518fd_stats_t *stats = &dev->stats;
+    uint64_t now = time_us_64();
+
+    if(now < stats->next_sample_us || dev->sleep.asleep) {
+        return false;
+    }
+
+    uint32_t elapsed_us = stats->next_sample_us ? (uint32_t)(now - stats->next_sample_us) + stats->period_us : 0;
+    stats->next_sample_us = now + stats->period_us;
+
+    uint32_t diag[3];
+    REG_CiTREC trec;
+    REG_CiBDIAG1 bdiag1;
+
+    SPI_read_block_from_MCP(dev, MCP2518FD_REG_CiTREC, diag, 3);
+
+    trec.word = diag[0];
+    bdiag1.word = diag[2];
+
+    SPI_write_word_to_MCP(dev, MCP2518FD_REG_CiBDIAG1, 0); //flags are sticky and ErrorFreeMsgCount keeps counting otherwise
+
+    //only count entering a state, not staying in it
+    if(trec.bF.ErrorStateWarning && !stats->trec.bF.ErrorStateWarning) {
+        stats->error_warning_entries++;
+    }
+    if((trec.bF.TxErrorStatePassive || trec.bF.RxErrorStatePassive) && !(stats->trec.bF.TxErrorStatePassive || stats->trec.bF.RxErrorStatePassive)) {
+        stats->error_passive_entries++;
+    }
+    if(trec.bF.TxErrorStateBusOff && !stats->trec.bF.TxErrorStateBusOff) {
+        stats->bus_off_entries++;
+    }
+
+    stats->trec = trec;
+    stats->bdiag0.word = diag[1];
+
+    stats->error_free_msgs += bdiag1.bF.ErrorFreeMsgCount;
+    stats->nominal_bit0 += bdiag1.bF.NBit0Error;
+    stats->nominal_bit1 += bdiag1.bF.NBit1Error;
+    stats->nominal_ack += bdiag1.bF.NAckError;
+    stats->nominal_form += bdiag1.bF.NFormError;
+    stats->nominal_stuff += bdiag1.bF.NStuffError;
+    stats->nominal_crc += bdiag1.bF.NCRCError;
+    stats->data_bit0 += bdiag1.bF.DBit0Error;
+    stats->data_bit1 += bdiag1.bF.DBit1Error;
+    stats->data_ack += bdiag1.bF.DAckError;
+    stats->data_form += bdiag1.bF.DFormError;
+    stats->data_stuff += bdiag1.bF.DStuffError;
+    stats->data_crc += bdiag1.bF.DCRCError;
+    stats->tx_bus_off_errors += bdiag1.bF.TXBOError;
+
+    uint32_t rx = stats->rx_frames - stats->last_rx_frames;
+    uint32_t tx = stats->tx_frames - stats->last_tx_frames;
+    uint32_t spi = stats->spi_bytes - stats->last_spi_bytes;
+
+    if(elapsed_us) {
+        stats->rx_fps = (uint64_t)rx * 1000000 / elapsed_us;
+        stats->tx_fps = (uint64_t)tx * 1000000 / elapsed_us;
+    }
+    stats->spi_bytes_per_frame = (rx + tx) ? spi / (rx + tx) : 0;
+
+    stats->last_rx_frames = stats->rx_frames;
+    stats->last_tx_frames = stats->tx_frames;
+    stats->last_spi_bytes = stats->spi_bytes;
+    stats->samples++;
+
+    if(dev->stats_print) {
+        MCP2518fd_stats_print(dev);
+    }
+
+    return true;
+}
+
+//one line per device over stdio (USB and UART are both enabled in CMakeLists.txt)
+void MCP2518fd_stats_print(mcp2518fd_dev_t *dev) {
+    const mcp2518fd_stats_t *stats = &dev->stats;
+    uint8_t fifo_hw = 0;
+
+    for(uint8_t i = 0; i < 32; i++) {
+        if(stats->fifo_high_water[i] > fifo_hw) {
+            fifo_hw = stats->fifo_high_water[i];
+        }
+    }
+
+    printf("CAN cs=%u rx=%lu tx=%lu rx_fps=%lu tx_fps=%lu spi_b/frame=%lu tec=%u rec=%u state=%s "
+           "ewarn=%lu epass=%lu busoff=%lu nerr=%lu/%lu/%lu/%lu/%lu/%lu derr=%lu/%lu/%lu/%lu/%lu/%lu "
+           "fifo_hw=%u ring_hw=%lu dropped=%lu\n",
+           dev->cs_pin,
+           (unsigned long)stats->rx_frames, (unsigned long)stats->tx_frames,
+           (unsigned long)stats->rx_fps, (unsigned long)stats->tx_fps, (unsigned long)stats->spi_bytes_per_frame,
+           stats->trec.bF.TxErrorCount, stats->trec.bF.RxErrorCount,
+           stats->trec.bF.TxErrorStateBusOff ? "busoff" :
+           (stats->trec.bF.TxErrorStatePassive || stats->trec.bF.RxErrorStatePassive) ? "passive" :
+           stats->trec.bF.ErrorStateWarning ? "warning" : "active",
+           (unsigned long)stats->error_warning_entries, (unsigned long)stats->error_passive_entries,
+           (unsigned long)stats->bus_off_entries,
+           (unsigned long)stats->nominal_bit0, (unsigned long)stats->nominal_bit1, (unsigned long)stats->nominal_ack,
+           (unsigned long)stats->nominal_form, (unsigned long)stats->nominal_stuff, (unsigned long)stats->nominal_crc,
+           (unsigned long)stats->data_bit0, (unsigned long)stats->data_bit1, (unsigned long)stats->data_ack,
+           (unsigned long)stats->data_form, (unsigned long)stats->data_stuff, (unsigned long)stats->data_crc,
+           fifo_hw, (unsigned long)stats->rx_ring_high_water, (unsigned long)dev->rx_ring.dropped);
+}
+
+/*
+self test. the chip resets every FIFO and the TEF on the way into configuration mode, so the run is bracketed by
+config mode switches that also reset the host side heads, and anything in flight (including tracked TX) is lost.
+the filters in use are saved from the shadow and put back afterwards. call it on the core that services the device,
+it sends straight from the calling context
+*/
+
+static const uint8_t mcp_selftest_lens[] = {4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+static void mcp_layout_heads_reset(mcp2518fd_dev_t *dev) {
+    for(uint8_t i = 0; i < 32; i++) {
+        dev->fifo_layout[i].head = 0;
+    }
+
+    dev->tef_layout.head = 0;
+}
+
+static inline uint8_t mcp_selftest_byte(uint32_t seq, uint8_t stream, uint8_t i) {
+    uint32_t x = seq * 0x9E3779B1u + stream * 0x85EBCA6Bu + i * 0xC2B2AE35u;
+    return (x ^ (x >> 15)) >> 8;
+}
+
+static void mcp_selftest_frame(can_frame_t *frame, uint8_t stream, uint32_t seq, uint8_t len, bool fd) {
+    frame->id = MCP2518FD_SELFTEST_ID + stream;
+    frame->len = len;
+    frame->flags = fd ? (CAN_FRAME_FLAG_FDF | CAN_FRAME_FLAG_BRS) : 0;
+
+    frame->data[0] = seq & 0xFF;
+    frame->data[1] = (seq >> 8) & 0xFF;
+    frame->data[2] = (seq >> 16) & 0xFF;
+    frame->data[3] = seq >> 24;
+
+    for(uint8_t i = 4; i < len; i++) {
+        frame->data[i] = mcp_selftest_byte(seq, stream, i);
+    }
+}
+
+//0 when the run was clean, -1 if it couldn't start or anything was lost, out of order or corrupted
+int8_t MCP2518fd_self_test(mcp2518fd_dev_t *dev, const mcp2518fd_selftest_cfg_t *cfg, mcp2518fd_selftest_result_t *result) {
+    uint8_t tx_fifo[32];
+    uint8_t rx_fifo[31];
+    uint8_t lens[sizeof(mcp_selftest_lens)];
+    uint8_t nlens = 0;
+    uint8_t max_len = cfg->fd ? 64 : 8;
+    bool tx = cfg->mode != CAN_LISTEN_ONLY_MODE;
+
+    memset(result, 0, sizeof(*result));
+
+    if(dev->service_on_core1) {
+        return -1; //core1 owns the SPI bus
+    }
+
+    if(cfg->mode != CAN_INTERNAL_LOOPBACK_MODE && cfg->mode != CAN_EXTERNAL_LOOPBACK_MODE && cfg->mode != CAN_LISTEN_ONLY_MODE) {
+        return -1;
+    }
+
+    REG_CiCON con_reg;
+    con_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiCON);
+
+    if(con_reg.bF.TXQEnable && dev->fifo_layout[0].depth) {
+        tx_fifo[result->streams++] = 0;
+        max_len = dev->fifo_layout[0].payload_bytes < max_len ? dev->fifo_layout[0].payload_bytes : max_len;
+    }
+
+    for(uint8_t fifo = 1; fifo < 32; fifo++) {
+        if(!dev->fifo_layout[fifo].depth) {
+            continue;
+        }
+
+        if(mcp_fifo_is_rx(dev, fifo)) {
+            rx_fifo[result->rx_fifos++] = fifo;
+        } else {
+            tx_fifo[result->streams++] = fifo;
+        }
+
+        max_len = dev->fifo_layout[fifo].payload_bytes < max_len ? dev->fifo_layout[fifo].payload_bytes : max_len;
+    }
+
+    if(cfg->len) {
+        lens[nlens++] = cfg->len;
+    } else {
+        for(uint8_t i = 0; i < sizeof(mcp_selftest_lens); i++) {
+            if(mcp_selftest_lens[i] <= max_len) {
+                lens[nlens++] = mcp_selftest_lens[i];
+            }
+        }
+    }
+
+    if(tx && (!result->streams || !result->rx_fifos || !nlens || lens[0] < 4 || lens[0] > max_len)) {
+        return -1; //nothing to send with, nothing to receive into, or the sequence number doesn't fit
+    }
+
+    //filters are all non-volatile so the shadow has them exactly
+    uint32_t saved_fltcon[MCP2518FD_NUM_FILTERS / 4];
+    uint32_t saved_fltobj[MCP2518FD_NUM_FILTERS * 2];
+
+    for(uint8_t i = 0; i < MCP2518FD_NUM_FILTERS / 4; i++) {
+        saved_fltcon[i] = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiFLTCON + i*4);
+    }
+
+    for(uint8_t i = 0; i < MCP2518FD_NUM_FILTERS * 2; i++) {
+        saved_fltobj[i] = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiFLTOBJ + i*4);
+    }
+
+    con_reg.word = MCP2518fd_reg_read(dev, MCP2518FD_REG_CiCON);
+    CAN_OPERATION_MODE prev_mode = con_reg.bF.OpMode;
+
+    int8_t error = 0;
+
+    if(MCP2518fd_set_mode(dev, CAN_CONFIGURATION_MODE)) {
+        return -1;
+    }
+
+    mcp_layout_heads_reset(dev);
+
+    if(tx) {
+        can_id_range_t ranges[32];
+
+        for(uint8_t k = 0; k < result->streams; k++) {
+            ranges[k].first = MCP2518FD_SELFTEST_ID + k;
+            ranges[k].last = MCP2518FD_SELFTEST_ID + k;
+            ranges[k].extended = false;
+            ranges[k].fifo = rx_fifo[k % result->rx_fifos];
+        }
+
+        if(MCP2518fd_set_filters(dev, ranges, result->streams) < 0) {
+            error = -1;
+        }
+    }
+
+    can_frame_t frame;
+
+    while(can_rx_pop(dev, &frame)) {
+        //whatever was left from before the run
+    }
+
+    if(!error && MCP2518fd_set_mode(dev, cfg->mode)) {
+        error = -1;
+    }
+
+    uint32_t next_seq[32] = {0};
+    uint32_t expect[32] = {0};
+    uint32_t dropped = can_rx_dropped(dev);
+    uint64_t start = time_us_64();
+    uint64_t last_rx = start;
+
+    while(!error && time_us_64() - start < cfg->timeout_us) {
+        bool done = tx;
+
+        for(uint8_t k = 0; tx && k < result->streams; k++) {
+            if(next_seq[k] < cfg->frames) {
+                can_frame_t batch[8];
+                uint32_t n = cfg->frames - next_seq[k] < 8 ? cfg->frames - next_seq[k] : 8;
+
+                for(uint8_t i = 0; i < n; i++) {
+                    uint32_t seq = next_seq[k] + i;
+                    mcp_selftest_frame(&batch[i], k, seq, lens[(seq + k) % nlens], cfg->fd);
+                }
+
+                uint8_t sent = can_send_batch_fifo(dev, tx_fifo[k], batch, n);
+                next_seq[k] += sent;
+                result->sent += sent;
+            }
+
+            if(expect[k] < cfg->frames) {
+                done = false;
+            }
+        }
+
+        while(can_rx_pop(dev, &frame)) {
+            last_rx = time_us_64();
+            result->received++;
+            result->per_fifo[frame.fifo & 31]++;
+
+            uint8_t k = frame.id - MCP2518FD_SELFTEST_ID;
+
+            if(!tx || (frame.flags & CAN_FRAME_FLAG_IDE) || frame.id < MCP2518FD_SELFTEST_ID || k >= result->streams) {
+                result->foreign++;
+                continue;
+            }
+
+            if(frame.len < 4) {
+                result->length_errors++;
+                continue;
+            }
+
+            uint32_t seq = frame.data[0] | (frame.data[1] << 8) | (frame.data[2] << 16) | ((uint32_t)frame.data[3] << 24);
+
+            if(seq < expect[k]) {
+                result->order_errors++;
+                continue;
+            }
+
+            result->missing += seq - expect[k];
+            expect[k] = seq + 1;
+
+            if(frame.len != lens[(seq + k) % nlens]) {
+                result->length_errors++;
+                continue;
+            }
+
+            for(uint8_t i = 4; i < frame.len; i++) {
+                if(frame.data[i] != mcp_selftest_byte(seq, k, i)) {
+                    result->payload_errors++;
+                    break;
+                }
+            }
+        }
+
+        if(done) {
             break;
         }
-        sleep_ms(1);
     }
 
-   
+    for(uint8_t k = 0; tx && k < result->streams; k++) {
+        result->missing += cfg->frames - expect[k];
+    }
+
+    result->elapsed_us = (tx ? last_rx : time_us_64()) - start;
+    result->fps = result->elapsed_us ? (uint64_t)result->received * 1000000 / result->elapsed_us : 0;
+    result->rx_dropped = can_rx_dropped(dev) - dropped;
+
+    //back to how it was
+    if(MCP2518fd_set_mode(dev, CAN_CONFIGURATION_MODE)) {
+        return -1;
+    }
+
+    mcp_layout_heads_reset(dev);
+
+    uint32_t off[MCP2518FD_NUM_FILTERS / 4] = {0};
+
+    MCP2518fd_reg_write_block(dev, MCP2518FD_REG_CiFLTCON, off, MCP2518FD_NUM_FILTERS / 4);
+    MCP2518fd_reg_write_block(dev, MCP2518FD_REG_CiFLTOBJ, saved_fltobj, MCP2518FD_NUM_FILTERS * 2);
+    MCP2518fd_reg_write_block(dev, MCP2518FD_REG_CiFLTCON, saved_fltcon, MCP2518FD_NUM_FILTERS / 4);
+
+    if(MCP2518fd_set_mode(dev, prev_mode)) {
+        return -1;
+    }
+
+    if(error || result->missing || result->order_errors || result->length_errors || result->payload_errors || result->rx_dropped) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void MCP2518fd_self_test_print(const mcp2518fd_selftest_result_t *result) {
+    printf("SELFTEST streams=%u rx_fifos=%u sent=%lu received=%lu fps=%lu missing=%lu order=%lu length=%lu payload=%lu "
+           "foreign=%lu dropped=%lu elapsed_us=%lu\n",
+           result->streams, result->rx_fifos, (unsigned long)result->sent, (unsigned long)result->received,
+           (unsigned long)result->fps, (unsigned long)result->missing, (unsigned long)result->order_errors,
+           (unsigned long)result->length_errors, (unsigned long)result->payload_errors, (unsigned long)result->foreign,
+           (unsigned long)result->rx_dropped, (unsigned long)result->elapsed_us);
+
+    for(uint8_t fifo = 1; fifo < 32; fifo++) {
+        if(result->per_fifo[fifo]) {
+            printf("SELFTEST fifo=%u received=%lu\n", fifo, (unsigned long)result->per_fifo[fifo]);
+        }
+    }
+}
+
+/*
+RAM layout
+
+    object size = 8 (ID + control word) + 4 if timestamped + payload, TEF objects have no payload
+    TEF, then TXQ, then FIFO1..31 are packed back to back from MCP2518FD_RAM_START, nothing can be placed explicitly
+
+so the whole layout falls out of the sizes. MCP2518fd_available_RAM_calc checks what is configured right now,
+MCP2518fd_plan_RAM sizes a request to fit and MCP2518fd_apply_RAM_plan programs it (configuration mode only).
+*/
+
+//bytes left once TEF/TXQ/FIFOs as configured are placed, negative when the configuration overruns RAM
+int16_t MCP2518fd_available_RAM_calc(mcp2518fd_dev_t *dev) {
+    REG_CiCON con_reg;
+    int16_t used = 0;
+
+    con_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiCON);
+
+    if(con_reg.bF.StoreInTEF) {
+        REG_CiTEFCON tef_reg;
+        tef_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiTEFCON);
+
+        used += (tef_reg.bF.FifoSize + 1) * (8 + (tef_reg.bF.TimeStampEnable ? 4 : 0));
+    }
+
+    for(uint8_t fifo = 0; fifo < 32; fifo++) {
+        const mcp2518fd_fifo_layout_t *layout = &dev->fifo_layout[fifo];
+
+        if(!layout->depth || (fifo == 0 && !con_reg.bF.TXQEnable)) {
+            continue; //never configured by the driver (or TXQ is off), no RAM we need to care about
+        }
+
+        used += layout->depth * (8 + (layout->timestamp ? 4 : 0) + layout->payload_bytes);
+    }
+
+    return MCP2518FD_RAM_SIZE - used;
+}
+
+static int8_t mcp_ram_region_size(const mcp2518fd_fifo_req_t *req, bool tef, mcp2518fd_ram_region_t *region) {
+    region->addr = 0;
+    region->depth = req->depth;
+    region->plsize = 0;
+
+    if(req->depth > 32) {
+        return -1;
+    }
+
+    if(tef) {
+        region->obj_bytes = 8 + (req->timestamp ? 4 : 0);
+        return 0;
+    }
+
+    while(mcp2518fd_payload_size_bytes[region->plsize] < req->payload_bytes) {
+        if(++region->plsize == 8) {
+            return -1; //more than 64 bytes
+        }
+    }
+
+    region->obj_bytes = 8 + ((req->timestamp && !req->tx) ? 4 : 0) + mcp2518fd_payload_size_bytes[region->plsize];
+
+    return 0;
+}
+
+/*
+sizes every region at its requested depth first and rejects the request if that alone doesn't fit. the leftover is
+then handed out one slot per growable region per pass, so RAM goes where it was asked for and no region starves the
+others just because its objects are small. returns -1 on a request that can't be built or doesn't fit.
+*/
+int8_t MCP2518fd_plan_RAM(const mcp2518fd_ram_req_t *req, mcp2518fd_ram_map_t *map) {
+    mcp2518fd_ram_region_t *regions[33];
+    const mcp2518fd_fifo_req_t *reqs[33];
+    uint8_t nregions = 0;
+
+    memset(map, 0, sizeof(*map));
+
+    if(req->nfifos > 31) {
+        return -1;
+    }
+
+    if(req->tef.depth) {
+        if(mcp_ram_region_size(&req->tef, true, &map->tef)) {
+            return -1;
+        }
+        regions[nregions] = &map->tef;
+        reqs[nregions++] = &req->tef;
+    }
+
+    if(req->txq.depth) {
+        mcp2518fd_fifo_req_t txq = req->txq;
+
+        txq.tx = true; //TXQ objects never carry a timestamp
+
+        if(mcp_ram_region_size(&txq, false, &map->fifo[0])) {
+            return -1;
+        }
+        regions[nregions] = &map->fifo[0];
+        reqs[nregions++] = &req->txq;
+    }
+
+    for(uint8_t i = 0; i < req->nfifos; i++) {
+        if(!req->fifo[i].depth || mcp_ram_region_size(&req->fifo[i], false, &map->fifo[i+1])) {
+            return -1;
+        }
+        regions[nregions] = &map->fifo[i+1];
+        reqs[nregions++] = &req->fifo[i];
+    }
+
+    uint32_t used = 0;
+
+    for(uint8_t r = 0; r < nregions; r++) {
+        used += regions[r]->depth * regions[r]->obj_bytes;
+    }
+
+    if(used > MCP2518FD_RAM_SIZE) {
+        return -1;
+    }
+
+    bool grown = true;
+
+    while(grown) {
+        grown = false;
+
+        for(uint8_t r = 0; r < nregions; r++) {
+            if(reqs[r]->grow && regions[r]->depth < 32 && used + regions[r]->obj_bytes <= MCP2518FD_RAM_SIZE) {
+                regions[r]->depth++;
+                used += regions[r]->obj_bytes;
+                grown = true;
+            }
+        }
+    }
+
+    //regions[] is already in chip order
+    uint16_t addr = MCP2518FD_RAM_START;
+
+    for(uint8_t r = 0; r < nregions; r++) {
+        regions[r]->addr = addr;
+        addr += regions[r]->depth * regions[r]->obj_bytes;
+    }
+
+    map->used = used;
+    map->free = MCP2518FD_RAM_SIZE - used;
+
+    return 0;
+}
+
+/*
+programs TEF/TXQ/FIFO1..nfifos from a plan and points one catch-all filter at each RX FIFO, in order. FIFOs start from
+reset values so anything the plan doesn't cover (TxAttempts, priorities) is the chip default.
+*/
+int8_t MCP2518fd_apply_RAM_plan(mcp2518fd_dev_t *dev, const mcp2518fd_ram_req_t *req, const mcp2518fd_ram_map_t *map) {
+    MCP2518FD_TRACE_FUNC();
+    REG_CiCON con_reg;
+
+    con_reg.word = MCP2518fd_reg_read(dev, MCP2518FD_REG_CiCON); //OpMode is volatile, the shadow always has it as 0
+
+    if(con_reg.bF.OpMode != CAN_CONFIGURATION_MODE) {
+        return -1; //FIFO sizes are only writable in configuration mode
+    }
+
+    con_reg.bF.StoreInTEF = req->tef.depth ? 1 : 0;
+    con_reg.bF.TXQEnable = req->txq.depth ? 1 : 0;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiCON, con_reg.word);
+
+    if(req->tef.depth) {
+        MCP2518fd_TEF_config(dev, map->tef.depth, req->tef.timestamp);
+    }
+
+    memset(dev->fifo_layout, 0, sizeof(dev->fifo_layout));
+
+    if(req->txq.depth) {
+        REG_CiTXQCON txq_reg;
+
+        txq_reg.word = mcp2518fd_fifo_reset_vals[0];
+        txq_reg.txBF.FifoSize = map->fifo[0].depth - 1;
+        txq_reg.txBF.PayLoadSize = map->fifo[0].plsize;
+        txq_reg.txBF.FRESET = 1;
+
+        MCP2518fd_reg_write(dev, MCP2518FD_REG_CiTXQCON, txq_reg.word);
+
+        mcp_fifo_layout_record(dev, 0, txq_reg.word, false);
+    }
+
+    uint8_t filter = 0;
+
+    for(uint8_t i = 0; i < req->nfifos; i++) {
+        uint8_t fifo = i + 1;
+        REG_CiFIFOCON fifo_reg;
+
+        fifo_reg.word = mcp2518fd_fifo_reset_vals[0];
+        fifo_reg.txBF.FifoSize = map->fifo[fifo].depth - 1;
+        fifo_reg.txBF.PayLoadSize = map->fifo[fifo].plsize;
+        fifo_reg.txBF.FRESET = 1;
+
+        if(req->fifo[i].tx) {
+            fifo_reg.txBF.TxEnable = 1;
+        } else {
+            fifo_reg.rxBF.TxEnable = 0;
+            fifo_reg.rxBF.RxTimeStampEnable = req->fifo[i].timestamp;
+            fifo_reg.rxBF.RxOverFlowIE = 1;
+            fifo_reg.rxBF.RxNotEmptyIE = 1;
+        }
+
+        MCP2518fd_reg_write(dev, MCP2518FD_REG_CiFIFOCON + fifo*MCP2518FD_FIFO_REG_STRIDE, fifo_reg.word);
+
+        mcp_fifo_layout_record(dev, fifo, fifo_reg.word, !req->fifo[i].tx && req->fifo[i].timestamp);
+
+        if(!req->fifo[i].tx) {
+            mcp_catch_all_filter(dev, filter++, fifo);
+        }
+    }
+
+    return 0;
+}
+
+/*
+low power, see mcp2518fd_sleep_cfg_t. the wake-up filter itself is set up by MCP2518fd_CAN_controller_config since
+CiCON only takes it in configuration mode, everything else is switched on the way into sleep
+*/
+
+static const mcp2518fd_sleep_cfg_t mcp_sleep_default = {0}; //plain Sleep, no idle timer, transceiver left alone
+
+//frames the driver is still holding for this device, sleeping now would strand them
+static bool mcp_tx_work_queued(mcp2518fd_dev_t *dev) {
+    if(dev->tx_ring.head != dev->tx_ring.tail) {
+        return true;
+    }
+
+    for(uint8_t i = 0; i < dev->tx_nclasses; i++) {
+        if(dev->tx_classes[i].head != dev->tx_classes[i].tail) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int8_t mcp_osc_wait(mcp2518fd_dev_t *dev, REG_OSC osc) {
+    REG_OSC ready;
+    ready.word = 0;
+    ready.bF.OscReady = 1;
+    ready.bF.SclkReady = 1;
+    ready.bF.PllReady = osc.bF.PllEnable;
+
+    return mcp_poll_reg(dev, MCP2518FD_REG_OSC, ready.word, ready.word, MCP_OSC_TIMEOUT_US, NULL);
+}
+
+//-1 if there is still something to send (in the chip or queued in the driver) or the chip never stopped its clock
+int8_t MCP2518fd_sleep(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    const mcp2518fd_sleep_cfg_t *cfg = dev->sleep_cfg ? dev->sleep_cfg : &mcp_sleep_default;
+
+    if(dev->sleep.asleep) {
+        return 0;
+    }
+
+    //a pending TXREQ would go out after the wake at best, LPM throws it away
+    if(mcp_tx_work_queued(dev) || MCP2518fd_reg_read(dev, MCP2518FD_REG_CiTXREQ)) {
+        return -1;
+    }
+
+    REG_IOCON iocon_reg;
+    iocon_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_IOCON);
+    iocon_reg.bF.AutoSleepEnable = 1;
+    iocon_reg.bF.ClearAutoSleepOnMatch = 1; //a filter match takes it back out
+    iocon_reg.bF.XcrSTBYEnable = cfg->xcr_standby;
+
+    if(cfg->xcr_standby) {
+        iocon_reg.bF.PinMode0 = 1; //XSTBY is GPIO0 as an output
+        iocon_reg.bF.TRIS0 = 0;
+    }
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_IOCON, iocon_reg.word);
+
+    REG_CiINT int_reg;
+    int_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiINT);
+    int_reg.bF.IE.WAKIE = 1;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiINT, int_reg.word);
+
+    REG_OSC osc_reg;
+    osc_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_OSC);
+    osc_reg.bF.LowPowerModeEnable = cfg->lpm;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_OSC, osc_reg.word);
+
+    //set before the request goes out, a bus wake can come in straight after it
+    dev->sleep.wake_pending = false;
+    dev->sleep.asleep = true;
+
+    REG_CiCON con_reg;
+    con_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_CiCON);
+    con_reg.bF.RequestOpMode = CAN_SLEEP_MODE;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_CiCON, con_reg.word);
+
+    //in LPM the next CS would wake it straight back up, so there's nothing we can check. INT means nothing in LPM
+    //either and servicing it would be exactly such a CS, so the IRQ is parked (the bus hold/release skips it too)
+    if(cfg->lpm) {
+        dev->sleep.int_parked = dev->int_irq_armed;
+
+        if(dev->int_irq_armed) {
+            dev->int_irq_armed = false;
+            gpio_set_irq_enabled(dev->int_pin, GPIO_IRQ_LEVEL_LOW, false);
+        }
+    } else {
+        REG_OSC stopped;
+        stopped.word = 0;
+        stopped.bF.OscDisable = 1;
+
+        if(mcp_poll_reg(dev, MCP2518FD_REG_OSC, stopped.word, stopped.word, MCP_MODE_TIMEOUT_US, NULL)) {
+            dev->sleep.asleep = false;
+            MCP2518fd_set_mode(dev, dev->mode);
+            return -1;
+        }
+    }
+
+    dev->sleep.sleeps++;
+
+    return 0;
+}
+
+//Sleep keeps every register, only the clock has to come back. a bus wake has restarted it already, otherwise
+//clearing OscDisable is the wake
+static int8_t mcp_sleep_exit(mcp2518fd_dev_t *dev) {
+    REG_OSC osc_reg;
+    osc_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_OSC);
+    osc_reg.bF.OscDisable = 0;
+
+    MCP2518fd_reg_write_full(dev, MCP2518FD_REG_OSC, osc_reg.word); //the shadow may not have seen OscDisable go up
+
+    return mcp_osc_wait(dev, osc_reg);
+}
+
+/*
+out of LPM the chip is back at its reset values on the bare crystal. the shadow still holds the whole configuration,
+so it's swapped for the reset image and every word that differs is written back: the clock first, then the three
+register blocks as config image bursts and the few SFRs outside them. the FIFOs come back empty, as after a reset
+*/
+static int8_t mcp_lpm_restore(mcp2518fd_dev_t *dev) {
+    mcp2518fd_shadow_t saved = dev->shadow;
+    uint32_t junk;
+
+    if(dev->clock) {
+        mcp_set_sck(dev, mcp_spi_max_hz(dev->bus, dev->clock->xtal_hz));
+    }
+
+    SPI_read_word_from_MCP(dev, MCP2518FD_REG_OSC, &junk); //CS going low is what wakes it, the answer is meaningless
+
+    MCP2518fd_shadow_reset(dev);
+
+    if(MCP2518fd_oscillator_check(dev)) {
+        return -1;
+    }
+
+    if(dev->clock && MCP2518fd_clock_config(dev, dev->clock)) {
+        return -1;
+    }
+
+    //the Sleep request is still in the saved CiCON, the mode gets requested once everything is back
+    REG_CiCON con_reg;
+    con_reg.word = saved.ctrl[0];
+    con_reg.bF.RequestOpMode = CAN_CONFIGURATION_MODE;
+    saved.ctrl[0] = con_reg.word;
+
+    //fully volatile words are 0 on both sides so they never count as different
+    MCP2518fd_config_image_begin(dev);
+
+    for(uint8_t i = 0; i < 20; i++) {
+        if(saved.ctrl[i] != dev->shadow.ctrl[i]) {
+            MCP2518fd_reg_write(dev, i*4, saved.ctrl[i]);
+        }
+    }
+
+    for(uint8_t i = 0; i < 32; i++) {
+        if(saved.fifo[i] != dev->shadow.fifo[i]) {
+            MCP2518fd_reg_write(dev, MCP2518FD_REG_CiFIFOCON + i*MCP2518FD_FIFO_REG_STRIDE, saved.fifo[i]);
+        }
+    }
+
+    for(uint8_t i = 0; i < 8; i++) {
+        if(saved.fltcon[i] != dev->shadow.fltcon[i]) {
+            MCP2518fd_reg_write(dev, MCP2518FD_REG_CiFLTCON + i*4, saved.fltcon[i]);
+        }
+    }
+
+    for(uint8_t i = 0; i < 64; i++) {
+        if(saved.fltobj[i] != dev->shadow.fltobj[i]) {
+            MCP2518fd_reg_write(dev, MCP2518FD_REG_CiFLTOBJ + i*4, saved.fltobj[i]);
+        }
+    }
+
+    MCP2518fd_config_image_load(dev);
+
+    //IOCON, CRC and ECCCON, OSC is done above and ECCSTA is status
+    for(uint8_t i = 1; i < 4; i++) {
+        MCP2518fd_reg_write(dev, MCP2518FD_REG_OSC + i*4, saved.specific[i]);
+    }
+
+    if(dev->ecc.enabled) {
+        MCP2518fd_ECC_enable(dev); //RAM came back uninitialised, every read of it would flag
+    }
+
+    mcp_layout_heads_reset(dev);
+
+    return 0;
+}
+
+//back to dev->mode, from Sleep or from LPM. -1 if the chip didn't come back, MCP2518fd_init() is all that's left then
+int8_t MCP2518fd_wake(mcp2518fd_dev_t *dev) {
+    MCP2518FD_TRACE_FUNC();
+    mcp2518fd_sleep_state_t *sleep = &dev->sleep;
+
+    if(!sleep->asleep) {
+        return 0;
+    }
+
+    if(!sleep->wake_pending) {
+        sleep->wake_start_us = time_us_64();
+    }
+
+    REG_OSC osc_reg;
+    osc_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_OSC);
+
+    int8_t result = osc_reg.bF.LowPowerModeEnable ? mcp_lpm_restore(dev) : mcp_sleep_exit(dev);
+
+    sleep->asleep = false;
+    sleep->wake_pending = false;
+
+    if(sleep->int_parked) {
+        sleep->int_parked = false;
+        dev->int_irq_armed = true;
+        gpio_set_irq_enabled(dev->int_pin, GPIO_IRQ_LEVEL_LOW, true);
+    }
+
+    if(result) {
+        return -1;
+    }
+
+    REG_IOCON iocon_reg;
+    iocon_reg.word = MCP2518fd_reg_get(dev, MCP2518FD_REG_IOCON);
+    iocon_reg.bF.AutoSleepEnable = 0;
+
+    MCP2518fd_reg_write(dev, MCP2518FD_REG_IOCON, iocon_reg.word);
+
+    if(MCP2518fd_set_mode(dev, dev->mode)) {
+        return -1;
+    }
+
+    uint64_t now = time_us_64();
+
+    sleep->wake_us = now - sleep->wake_start_us;
+    sleep->wakes++;
+    sleep->last_activity_us = now;
+
+    //TBC stood still (or started over) while asleep, the old reference is useless but the drift estimate isn't
+    if(dev->ts.enabled) {
+        mcp_timestamp_resync(dev, true);
+    }
+
+    return 0;
+}
+
+/*
+call every so often from the main loop (core1 does it for its devices). sleeps once nothing has been sent or received
+for sleep_cfg->idle_us, and finishes a wake the INT service saw (WAKIF) or one that is needed because something was
+queued to send. true if the device went to sleep or woke up
+*/
+bool MCP2518fd_sleep_service(mcp2518fd_dev_t *dev) {
+    const mcp2518fd_sleep_cfg_t *cfg = dev->sleep_cfg;
+    mcp2518fd_sleep_state_t *sleep = &dev->sleep;
+
+    if(!cfg) {
+        return false;
+    }
+
+    if(sleep->asleep) {
+        if(sleep->wake_pending || mcp_tx_work_queued(dev)) {
+            MCP2518fd_wake(dev);
+            return true;
+        }
+
+        return false;
+    }
+
+    uint64_t now = time_us_64();
+
+    if(!sleep->last_activity_us || dev->stats.rx_frames != sleep->last_rx_frames || dev->stats.tx_frames != sleep->last_tx_frames || mcp_tx_work_queued(dev)) {
+        sleep->last_rx_frames = dev->stats.rx_frames;
+        sleep->last_tx_frames = dev->stats.tx_frames;
+        sleep->last_activity_us = now;
+        return false;
+    }
+
+    if(!cfg->idle_us || now - sleep->last_activity_us < cfg->idle_us) {
+        return false;
+    }
+
+    if(MCP2518fd_sleep(dev)) {
+        sleep->last_activity_us = now; //still sending, give it another idle_us
+        return false;
+    }
+
+    return true;
+}
+
+/*
+core1 service loop
+
+with service_on_core1 set, MCP2518fd_init() hands the device to core1 and core1 does everything that touches the chip:
+bring-up (so the set_mode/config polling loops don't stall the application), the SPI bus and its DMA IRQ, the INT IRQ and
+FIFO draining. core0 only ever talks to the rings, can_rx_pop() on the way in and can_tx_push() on the way out.
+
+devices are handed over through the inter-core FIFO (a dev pointer one way, the bring-up result the other). IRQs are
+enabled on whichever core calls SPI_DMA_init/MCP2518fd_RX_IRQ_init, so every device sharing a bus has to be in the same
+mode or the DMA completions land on the wrong core.
+*/
+
+static int8_t mcp_dev_bring_up(mcp2518fd_dev_t *dev) {
+    uint64_t start = time_us_64();
+
+    memset(&dev->init_timing, 0, sizeof(dev->init_timing));
+
+    SPI_to_CAN_master_init(dev);
+
+    if(dev->clock) {
+        mcp_set_sck(dev, mcp_spi_max_hz(dev->bus, dev->clock->xtal_hz)); //out of reset SYSCLK is the bare crystal
+    }
+
+    uint64_t t = time_us_64();
+
+    spi_reset_MCP_chip(dev); //should set CAN controller mode to configuration mode already but further checks are made later
+
+    MCP2518fd_shadow_reset(dev);
+
+    if(MCP2518fd_oscillator_check(dev)) {
+        return -1;
+    }
+
+    dev->init_timing.osc_us = time_us_64() - t;
+    t = time_us_64();
+
+    if(MCP2518fd_devid_verify(dev)) {
+        return -1;
+    }
+
+    if(dev->clock && MCP2518fd_clock_config(dev, dev->clock)) {
+        return -1;
+    }
+
+    //everything from here to the mode change only lands in the shadow and goes out in a few bursts at the end
+    MCP2518fd_config_image_begin(dev);
+
+    if(MCP2518fd_CAN_controller_config(dev)) {
+        dev->image.active = false;
+        return -1;
+    }
+
+    MCP2518fd_nominal_bit_timing_config(dev);
+    MCP2518fd_data_bit_timing_config(dev);
+    MCP2518fd_TDC_config(dev);
+
+    if(dev->timestamps) {
+        MCP2518fd_timestamp_enable(dev);
+    }
+
+    if(dev->ram_req) {
+        mcp2518fd_ram_map_t map;
+
+        if(MCP2518fd_plan_RAM(dev->ram_req, &map) || MCP2518fd_apply_RAM_plan(dev, dev->ram_req, &map)) {
+            dev->image.active = false;
+            return -1;
+        }
+    } else {
+        MCP2518fd_TXQ_FIFO_config(dev);
+        MCP2518fd_FIFO_config(dev, dev->tx_fifos, dev->rx_fifos);
+
+        if(dev->tef_depth) {
+            MCP2518fd_TEF_config(dev, dev->tef_depth, dev->timestamps);
+        }
+    }
+
+    if(MCP2518fd_available_RAM_calc(dev) < 0) {
+        dev->image.active = false;
+        return -1; //the FIFOs as configured run past the end of RAM
+    }
+
+    if(dev->ecc_enable) {
+        MCP2518fd_ECC_enable(dev);
+    }
+
+    MCP2518fd_config_image_load(dev);
+
+    if(dev->timestamps) {
+        MCP2518fd_timestamp_sync(dev);
+    }
+
+    dev->init_timing.config_us = time_us_64() - t;
+    t = time_us_64();
+
+    if(MCP2518fd_set_mode(dev, dev->mode)) {
+        return -1;
+    }
+
+    dev->init_timing.mode_us = time_us_64() - t;
+
+    MCP2518fd_RX_IRQ_init(dev); //IRQs end up on the core running the bring-up
+
+    dev->init_timing.total_us = time_us_64() - start;
+
+    return 0;
+}
+
+//pushes whatever is queued into TXQ, returns true while frames are still waiting for room in the chip
+bool MCP2518fd_service_tx(mcp2518fd_dev_t *dev) {
+    can_tx_ring_t *ring = &dev->tx_ring;
+    uint32_t tail = ring->tail;
+    uint32_t queued = ring->head - tail;
+
+    if(!queued) {
+        return false;
+    }
+
+    if(dev->sleep.asleep) {
+        return true; //MCP2518fd_sleep_service() wakes it on the next pass
+    }
+
+    __dmb(); //don't read the frames before we've seen the head that published them
+
+    //frames are contiguous up to the end of the array, anything past the wrap goes on the next pass
+    uint32_t slot = tail & (CAN_TX_RING_SIZE - 1);
+    uint32_t run = CAN_TX_RING_SIZE - slot;
+
+    if(run > queued) {
+        run = queued;
+    }
+
+    uint8_t sent = can_send_batch(dev, &ring->frames[slot], run);
+
+    __dmb(); //the burst has copied the frames out before the slots go back to core0
+    ring->tail = tail + sent;
+
+    return sent < queued;
+}
+
+//earliest time one of the periodic services (idle sleep, ECC scrub, timestamp sync, stats) wants to run next
+static uint64_t mcp_service_deadline(const mcp2518fd_dev_t *dev, uint64_t deadline) {
+    if(dev->sleep.asleep) {
+        return deadline; //nothing periodic runs while asleep, a wake comes in through WAKIF or a send
+    }
+
+    if(dev->sleep_cfg && dev->sleep_cfg->idle_us && dev->sleep.last_activity_us + dev->sleep_cfg->idle_us < deadline) {
+        deadline = dev->sleep.last_activity_us + dev->sleep_cfg->idle_us;
+    }
+
+    if(dev->ecc.enabled && dev->ecc.next_scrub_us < deadline) {
+        deadline = dev->ecc.next_scrub_us;
+    }
+
+    if(dev->ts.enabled && dev->ts.next_sync_us < deadline) {
+        deadline = dev->ts.next_sync_us;
+    }
 
-    //set to CAN FD normal at the end using the MCP2518fd_set_mode function
-    //is CiCON address right??
-}
\ No newline at end of file
+    if(dev->stats.next_sample_us < deadline) {
+        deadline = dev->stats.next_sample_us;
+    }
+
+    return deadline;
+}
+
+static void mcp_core1_service_loop(void) {
+    mcp2518fd_dev_t *devs[MCP2518FD_MAX_DEVICES];
+    uint8_t ndevs = 0;
+
+    while(1) {
+        while(multicore_fifo_rvalid()) {
+            mcp2518fd_dev_t *dev = (mcp2518fd_dev_t *)(uintptr_t)multicore_fifo_pop_blocking();
+            int8_t result = mcp_dev_bring_up(dev);
+
+            if(!result && ndevs < MCP2518FD_MAX_DEVICES) {
+                devs[ndevs++] = dev;
+            }
+
+            multicore_fifo_push_blocking((uint32_t)(int32_t)result);
+        }
+
+        bool backlog = false;
+        uint64_t deadline = UINT64_MAX;
+
+        for(uint8_t i = 0; i < ndevs; i++) {
+            MCP2518fd_sleep_service(devs[i]);
+            backlog |= MCP2518fd_service_tx(devs[i]);
+            MCP2518fd_tx_sched_service(devs[i]);
+            MCP2518fd_ECC_service(devs[i]);
+            MCP2518fd_timestamp_service(devs[i]);
+            MCP2518fd_stats_service(devs[i]);
+            deadline = mcp_service_deadline(devs[i], deadline);
+        }
+
+        if(backlog) {
+            sleep_us(MCP_CORE1_TX_RETRY_US); //chip FIFO is full, give the bus time to drain it
+        } else if(deadline == UINT64_MAX) {
+            __wfe(); //woken by the INT/DMA IRQs, a can_tx_push() or a new device in the inter-core FIFO
+        } else {
+            //same events, but an alarm also ends the wait when the next periodic service is due
+            best_effort_wfe_or_timeout(from_us_since_boot(deadline));
+        }
+    }
+}
+
+//queue a frame for transmission. on core1 devices this only touches the ring, otherwise it sends straight away
+bool can_tx_push(mcp2518fd_dev_t *dev, const can_frame_t *frame) {
+    if(!dev->service_on_core1) {
+        return can_send_batch(dev, frame, 1) == 1;
+    }
+
+    can_tx_ring_t *ring = &dev->tx_ring;
+    uint32_t head = ring->head;
+
+    if(head - ring->tail >= CAN_TX_RING_SIZE) {
+        return false;
+    }
+
+    ring->frames[head & (CAN_TX_RING_SIZE - 1)] = *frame;
+
+    __dmb(); //frame contents have to land before core1 can see the new head
+    ring->head = head + 1;
+
+    __sev();
+
+    return true;
+}
+
+int8_t MCP2518fd_init(mcp2518fd_dev_t *dev) {
+    static bool core1_launched = false;
+
+    if(!dev->service_on_core1) {
+        return mcp_dev_bring_up(dev);
+    }
+
+    if(!core1_launched) {
+        multicore_launch_core1(mcp_core1_service_loop);
+        core1_launched = true;
+    }
+
+    multicore_fifo_push_blocking((uint32_t)(uintptr_t)dev);
+
+    return (int8_t)multicore_fifo_pop_blocking(); //blocks until core1 has finished bringing the chip up
+}
@@ -1,13 +1,54 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
 #include "hardware/timer.h"
 #include "hardware/spi.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "pico/multicore.h"
+
+#ifdef MCP2518FD_PIO_SPI
+#include "hardware/pio.h" //SPI from a PIO state machine (mcp2518fd_spi.pio) instead of the PL022, the CAN_PIO_SPI cmake option
+#endif
 
 #define BUF_LEN 256
 #define MSG_SIZE 8u
 #define CLK_SPD 12500000
+#define MCP2518FD_SCK_MAX 20000000 //MCP2518FD's own SCK ceiling, only reachable on the PIO bus
+#define SPI_DMA_MIN_LEN 16 //transfers shorter than this are cheaper to do blocking than to set up DMA for
+
+#ifndef MCP2518FD_INT_PIN
+#define MCP2518FD_INT_PIN 20 //default MCP2518FD INT (active low, open drain) for a single controller on spi_default
+#endif
+
+#ifndef MCP2518FD_SYSCLK_HZ
+#define MCP2518FD_SYSCLK_HZ 40000000 //40 MHz crystal, no PLL. dev->clock overrides it at runtime
+#endif
+
+#ifndef MCP2518FD_HOT_IN_RAM
+#define MCP2518FD_HOT_IN_RAM 1 //driver hot path in SRAM instead of XIP flash, the CAN_HOT_IN_RAM cmake option
+#endif
+
+#define MCP2518FD_TBC_HZ 1000000 //time base counter runs at 1 MHz so a timestamp is in microseconds
+#define MCP2518FD_TS_SYNC_INTERVAL_US 1000000 //how often MCP2518fd_timestamp_service() re-correlates TBC with time_us_64
+
+#define CAN_RX_RING_SIZE 32 //must be a power of 2
+#define CAN_TX_RING_SIZE 16 //core0 -> core1 TX queue, must be a power of 2
+
+//frame pool, see can_frame_alloc(). index has to fit in 15 bits
+#ifndef CAN_POOL_CLASSIC_FRAMES
+#define CAN_POOL_CLASSIC_FRAMES 64 //up to 8 data bytes
+#endif
+
+#ifndef CAN_POOL_FD_FRAMES
+#define CAN_POOL_FD_FRAMES 32      //up to 64 data bytes
+#endif
+
+#define MCP_CORE1_TX_RETRY_US 50 //how long core1 backs off when the chip TX FIFO is full and frames are still queued
 #define HIGH 1 
 #define LOW 0
 
@@ -285,6 +326,20 @@ typedef union {
     uint8_t  byte[4];
 } REG_CiVEC;
 
+/* CiVEC ICODE/RXCODE/TXCODE values: 0-31 name the FIFO, the rest are below */
+#define MCP2518FD_ICODE_FIFO_MAX    0x1F  /* codes 0x00-0x1F are FIFO CH0-CH31     */
+#define MCP2518FD_ICODE_NO_INT      0x40  /* no interrupt pending                  */
+#define MCP2518FD_ICODE_CERRIF      0x41  /* CAN bus error                         */
+#define MCP2518FD_ICODE_WAKIF       0x42  /* wake-up                               */
+#define MCP2518FD_ICODE_RXOVIF      0x43  /* RX FIFO overflow                      */
+#define MCP2518FD_ICODE_ADDRERR     0x44  /* RAM address error (SERRIF)            */
+#define MCP2518FD_ICODE_MABOV       0x45  /* RX MAB overflow (SERRIF)              */
+#define MCP2518FD_ICODE_TBCIF       0x46  /* time base counter overflow            */
+#define MCP2518FD_ICODE_MODIF       0x47  /* operation mode change                 */
+#define MCP2518FD_ICODE_IVMIF       0x48  /* invalid message                       */
+#define MCP2518FD_ICODE_TEFIF       0x49  /* TX event FIFO                         */
+#define MCP2518FD_ICODE_TXATIF      0x4A  /* TX attempts exhausted                 */
+
 /*--- Interrupt Flags (lower 16 bits of CiINT) -----------------------------*/
 typedef struct {
     uint32_t TXIF       : 1;  /* bit  0 - TX interrupt pending                         */
@@ -773,7 +828,69 @@ static const uint32_t mcp2518fd_specific_reset_vals[] = {
     /* 0xE10 ECCSTA */ 0x00000000
 };
 
-const uint8_t BitReverseTable256[256] = {
+/*===========================================================================*/
+/* SECTION 6: MESSAGE OBJECTS                                                */
+/* Source: MCP2518FD Datasheet, Section "Message Memory" (TX/RX/TEF objects) */
+/* Every message object in RAM is: ID word, control word, optional 32-bit    */
+/* timestamp (RX/TEF only), then the payload padded to a multiple of 4       */
+/*===========================================================================*/
+
+/*--- Message Object ID word (T0 / R0 / TE0) -------------------------------*/
+typedef union {
+    struct {
+        uint32_t SID            : 11; /* bits 10:0  - Standard Identifier           */
+        uint32_t EID            : 18; /* bits 28:11 - Extended Identifier           */
+        uint32_t SID11          : 1;  /* bit  29    - 12th SID bit in FD mode       */
+        uint32_t unimplemented1 : 2;
+    } bF;
+    uint32_t word;
+    uint8_t  byte[4];
+} CAN_MSGOBJ_ID;
+
+/*--- RX Message Object control word (R1) ----------------------------------*/
+typedef union {
+    struct {
+        uint32_t DLC            : 4;  /* bits  3:0  - Data length code              */
+        uint32_t IDE            : 1;  /* bit   4    - Extended identifier           */
+        uint32_t RTR            : 1;  /* bit   5    - Remote transmission request   */
+        uint32_t BRS            : 1;  /* bit   6    - Bit rate switched             */
+        uint32_t FDF            : 1;  /* bit   7    - CAN FD frame                  */
+        uint32_t ESI            : 1;  /* bit   8    - Error status indicator        */
+        uint32_t unimplemented1 : 2;
+        uint32_t FilterHit      : 5;  /* bits 15:11 - Filter that accepted message  */
+        uint32_t unimplemented2 : 16;
+    } bF;
+    uint32_t word;
+    uint8_t  byte[4];
+} CAN_RX_MSGOBJ_CTRL;
+
+/*--- TX / TEF Message Object control word (T1 / TE1) ----------------------*/
+typedef union {
+    struct {
+        uint32_t DLC            : 4;  /* bits  3:0  - Data length code              */
+        uint32_t IDE            : 1;  /* bit   4    - Extended identifier           */
+        uint32_t RTR            : 1;  /* bit   5    - Remote transmission request   */
+        uint32_t BRS            : 1;  /* bit   6    - Switch bit rate               */
+        uint32_t FDF            : 1;  /* bit   7    - CAN FD frame                  */
+        uint32_t ESI            : 1;  /* bit   8    - Error status indicator        */
+        uint32_t SEQ            : 23; /* bits 31:9  - Sequence (copied to TEF)      */
+    } bF;
+    uint32_t word;
+    uint8_t  byte[4];
+} CAN_TX_MSGOBJ_CTRL;
+
+/* CiFIFOCON/CiTXQCON PayLoadSize field -> bytes per message object */
+static const uint8_t mcp2518fd_payload_size_bytes[8] = {
+    8, 12, 16, 20, 24, 32, 48, 64
+};
+
+/* DLC -> payload bytes (ISO 11898-1, DLC 9-15 only valid for FD frames) */
+static const uint8_t mcp2518fd_dlc_to_bytes[16] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64
+};
+
+
+static const uint8_t BitReverseTable256[256] = {
     0x00, 0x80, 0x40, 0xC0, 0x20, 0xA0, 0x60, 0xE0, 0x10, 0x90, 0x50, 0xD0, 0x30, 0xB0, 0x70, 0xF0,
     0x08, 0x88, 0x48, 0xC8, 0x28, 0xA8, 0x68, 0xE8, 0x18, 0x98, 0x58, 0xD8, 0x38, 0xB8, 0x78, 0xF8,
     0x04, 0x84, 0x44, 0xC4, 0x24, 0xA4, 0x64, 0xE4, 0x14, 0x94, 0x54, 0xD4, 0x34, 0xB4, 0x74, 0xF4,
@@ -793,7 +910,7 @@ const uint8_t BitReverseTable256[256] = {
 };
 
 //look up table for crc calculations in the future
-const uint16_t crc16_table[256] = {
+static const uint16_t crc16_table[256] = {
     0x0000, 0x8005, 0x800F, 0x000A, 0x801B, 0x001E, 0x0014, 0x8011,
     0x8033, 0x0036, 0x003C, 0x8039, 0x0028, 0x802D, 0x8027, 0x0022,
     0x8063, 0x0066, 0x006C, 0x8069, 0x0078, 0x807D, 0x8077, 0x0072,
@@ -828,25 +945,608 @@ const uint16_t crc16_table[256] = {
     0x8213, 0x0216, 0x021C, 0x8219, 0x0208, 0x820D, 0x8207, 0x0202
 };
 
-void SPI_to_CAN_master_init(void);
-void spi_write_to_MCP(uint8_t *txbuffer, uint8_t *rxbuffer, uint16_t len);
-void SPI_read_word_from_MCP(uint16_t addr, uint32_t *data);
-void SPI_write_word_to_MCP(uint16_t addr, uint32_t data);
-void spi_reset_MCP_chip(void);
-void MCP2518fd_nominal_bit_timing_config(void);
-void MCP2518fd_data_bit_timing_config(void);
-void MCP2518fd_TDC_config(void);
-void MCP2518fd_TXQ_FIFO_config(void);
-void MCP2518fd_set_TXQ_UINC(void);
-void MCP2518fd_FIFO_config(uint8_t n, uint8_t m);
-void MCP2518fd_filter_and_mask_enable_config(uint8_t n, uint8_t m);
-
-int8_t MCP2518fd_oscillator_check(void);
-int8_t MCP2518fd_devid_verify(void);     
-int8_t MCP2518fd_set_mode(CAN_OPERATION_MODE mode); 
-int8_t MCP2518fd_CAN_controller_config(void);        
-int8_t MCP2518fd_init(void);       
-int8_t MCP2518fd_available_RAM_calc(void);                
+/*
+receive buffer for one message object, laid out so the 2 byte SPI command prefix lands in cmd[]
+and the message object itself (R0, R1, optional timestamp, payload) starts 4-byte aligned in obj[]
+*/
+#define MCP2518FD_MAX_MSGOBJ_WORDS (2 + 1 + 64/4) //ID + control + timestamp + 64 data bytes
+
+typedef struct {
+    uint8_t  pad[2];
+    uint8_t  cmd[2];
+    uint32_t obj[MCP2518FD_MAX_MSGOBJ_WORDS];
+} __attribute__((aligned(4))) can_rx_msgobj_buf_t;
+
+//same thing for a burst over several message objects, the INT service drains an RX FIFO through one of these
+typedef struct {
+    uint8_t  pad[2];
+    uint8_t  cmd[2];
+    uint32_t obj[BUF_LEN/4];
+} __attribute__((aligned(4))) can_rx_burst_buf_t;
+
+#define CAN_FRAME_FLAG_IDE (1u << 0)
+#define CAN_FRAME_FLAG_RTR (1u << 1)
+#define CAN_FRAME_FLAG_BRS (1u << 2)
+#define CAN_FRAME_FLAG_FDF (1u << 3)
+#define CAN_FRAME_FLAG_ESI (1u << 4)
+#define CAN_FRAME_FLAG_TS  (1u << 5) //the frame carries a receive timestamp
+
+//typed view over a can_rx_msgobj_buf_t, payload points straight into the buffer (no copy)
+typedef struct {
+    uint32_t id;          //11 bit SID, or SID:EID as a 29 bit id when CAN_FRAME_FLAG_IDE is set
+    uint8_t  dlc;
+    uint8_t  len;         //payload length in bytes decoded from dlc
+    uint8_t  flags;       //CAN_FRAME_FLAG_*
+    uint8_t  filter_hit;
+    uint32_t timestamp;   //raw CiTBC ticks, valid with CAN_FRAME_FLAG_TS
+    const uint8_t *payload;
+} can_rx_frame_t;
+
+//per FIFO layout the driver remembers so it knows how many bytes a message object takes
+typedef struct {
+    uint8_t payload_bytes;
+    uint8_t depth;
+    uint8_t head;         //slot the next UINC will release, tracked host side since only the driver moves it
+    bool    timestamp;
+} mcp2518fd_fifo_layout_t;
+
+//a frame as stored in the RX ring and handed to can_send_batch (fifo is ignored on TX)
+typedef struct {
+    uint32_t id;
+    uint8_t  dlc;
+    uint8_t  len;
+    uint8_t  flags;
+    uint8_t  fifo;
+    uint64_t timestamp_us; //receive time on the time_us_64() clock, valid with CAN_FRAME_FLAG_TS (ignored on TX)
+    uint8_t  data[64];
+} can_frame_t;
+
+/*
+static frame pool, one list of 8 byte frames and one of 64 byte frames, shared by every device. a handle is an index
+with the top bit picking the list, can_frame_get() turns it into a can_frame_t pointer. a classic frame only has
+data[0..7] behind it, everything the driver does with a frame stops at len so that's safe as long as len stays within
+can_frame_capacity(). alloc/free are lock free (LDREX/STREX on a tagged list head) so any core or IRQ can use them
+*/
+typedef uint16_t can_frame_handle_t;
+
+#define CAN_FRAME_HANDLE_NONE 0xFFFF
+#define CAN_FRAME_HANDLE_FD 0x8000
+
+typedef struct {
+    uint32_t free;
+    uint32_t low_water;
+    uint32_t failed;        //allocations of this size that came back empty, a classic one only if the FD list was empty too
+} can_pool_stats_t;
+
+/*
+single producer (MCP INT service routine) / single consumer (application, either core) ring.
+head is only written by the producer and tail only by the consumer, so no lock is needed,
+just barriers so the frame contents are visible before the index moves.
+*/
+typedef struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t dropped;  //frames lost because the ring (or the pool, with rx_handles) was full
+    can_frame_t frames[CAN_RX_RING_SIZE];
+    can_frame_handle_t handles[CAN_RX_RING_SIZE]; //used instead of frames with dev->rx_handles
+} can_rx_ring_t;
+
+//same idea the other way round, the application (core0) produces and the core1 service loop consumes
+typedef struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    can_frame_t frames[CAN_TX_RING_SIZE];
+} can_tx_ring_t;
+
+
+/*
+RAM planner input, see MCP2518fd_plan_RAM. the chip lays RAM out as TEF, TXQ, FIFO1, FIFO2 ... back to back, so the
+planner only needs sizes and the map it hands back says where each one lands.
+*/
+typedef struct {
+    uint8_t depth;          //slots wanted, 1-32. 0 turns TEF/TXQ off (not allowed for FIFOs)
+    uint8_t payload_bytes;  //rounded up to the next PayLoadSize step, ignored for TEF
+    bool tx;                //FIFOs only, TEF is always TX and TXQ always TX
+    bool timestamp;         //RX FIFOs and TEF only
+    bool grow;              //may be handed leftover RAM, one slot at a time up to 32
+} mcp2518fd_fifo_req_t;
+
+typedef struct {
+    mcp2518fd_fifo_req_t tef;
+    mcp2518fd_fifo_req_t txq;
+    uint8_t nfifos;                 //FIFO1..nfifos are used, the rest stay at reset and take no RAM
+    mcp2518fd_fifo_req_t fifo[31];  //fifo[0] is FIFO1
+} mcp2518fd_ram_req_t;
+
+typedef struct {
+    uint16_t addr;          //absolute address of the first object, 0 when the region is off
+    uint16_t obj_bytes;     //message object size including header and timestamp
+    uint8_t  depth;
+    uint8_t  plsize;        //PayLoadSize code
+} mcp2518fd_ram_region_t;
+
+typedef struct {
+    mcp2518fd_ram_region_t tef;
+    mcp2518fd_ram_region_t fifo[32]; //[0] is TXQ, same numbering as the FIFO registers
+    uint16_t used;
+    uint16_t free;
+} mcp2518fd_ram_map_t;
+
+//an ID or inclusive ID range for MCP2518fd_set_filters, matches are routed to fifo
+typedef struct {
+    uint32_t first;
+    uint32_t last;          //first == last for a single ID
+    bool     extended;      //29 bit IDs, otherwise 11 bit
+    uint8_t  fifo;          //RX FIFO that gets the matches
+} can_id_range_t;
+
+//one compiled hardware filter, obj and mask are ready to go into CiFLTOBJ/CiMASK as is
+typedef struct {
+    uint32_t obj;
+    uint32_t mask;
+    uint8_t  fifo;
+} mcp2518fd_filter_t;
+
+#define MCP2518FD_NUM_FILTERS 32
+#define MCP2518FD_FILTER_MAX_TERMS 96 //working set while compiling, cheapest pairs get merged early if it fills up
+
+/*
+clock profiles, see can_bit_timing.cpp. each one is an oscillator setup plus bit timing that was checked against the
+resulting SYSCLK at compile time. the SPI clock has to stay under 0.85 * SYSCLK/2, so slow profiles also slow SPI down
+*/
+typedef enum {
+    MCP2518FD_CLOCK_40M_500K_2M = 0,    //40 MHz crystal, no PLL (the default timing words)
+    MCP2518FD_CLOCK_40M_500K_5M,
+    MCP2518FD_CLOCK_40M_500K_8M,
+    MCP2518FD_CLOCK_4M_PLL_500K_5M,     //4 MHz crystal x10 PLL
+    MCP2518FD_CLOCK_4M_PLL_500K_8M,
+    MCP2518FD_CLOCK_20M_DIV_500K_2M,    //40 MHz crystal, SYSCLK / 2 for lower power
+    MCP2518FD_CLOCK_20M_DIV_500K_5M,
+    MCP2518FD_CLOCK_PROFILE_COUNT
+} MCP2518FD_CLOCK_PROFILE;
+
+typedef struct {
+    uint32_t xtal_hz;
+    uint32_t sysclk_hz;
+    uint32_t nominal_bitrate;
+    uint32_t data_bitrate;
+    bool     pll;           //REG_OSC.PllEnable
+    bool     sclk_div2;     //REG_OSC.SCLKDIV
+    uint32_t nbtcfg;
+    uint32_t dbtcfg;
+    uint32_t tdc;
+} mcp2518fd_clock_profile_t;
+
+/*
+ECC bookkeeping. the INT service routine only captures SECIF/DEDIF into pending[] and clears them, everything that
+costs SPI time (scrubbing, FIFO resets) happens later in MCP2518fd_ECC_service()
+*/
+#define MCP2518FD_ECC_PENDING 8         //must be a power of 2
+#define MCP2518FD_ECC_PENDING_DED 0x8000 //set in a pending[] entry for a double (uncorrected) error
+#define MCP2518FD_ECC_SCRUB_WORDS 16    //RAM words read back per scrub step
+#define MCP2518FD_ECC_SCRUB_INTERVAL_US 1000 //at most one scrub step this often, a full RAM pass then takes ~32 ms
+
+typedef struct {
+    bool enabled;
+    volatile uint32_t sec_count;        //single errors, corrected on read
+    volatile uint32_t ded_count;        //double errors, data lost
+    volatile uint16_t last_error_addr;
+    volatile uint32_t pending_head;
+    volatile uint32_t pending_tail;
+    volatile uint16_t pending[MCP2518FD_ECC_PENDING]; //ErrorAddress | MCP2518FD_ECC_PENDING_DED
+    uint32_t lost_events;               //pending[] was full
+    uint32_t scrubbed;                  //words rewritten with their corrected value
+    uint32_t fifo_resets;               //FIFOs (or TEF) reset after a double error
+    uint16_t scrub_addr;
+    uint64_t next_scrub_us;
+} mcp2518fd_ecc_stats_t;
+
+/*
+CiTBC <-> time_us_64() correlation. a sync samples both clocks (host time taken either side of the SPI read), the
+signed 32 bit distance to the last sync plus a drift estimate between syncs gives host time for any timestamp within
+~35 minutes of it. syncs happen on every TBCIF overflow and from MCP2518fd_timestamp_service(). seq is odd while the
+reference is being updated so another core converting at the same time retries
+*/
+typedef struct {
+    bool enabled;
+    volatile uint32_t seq;
+    uint32_t tbc_ref;
+    uint64_t host_ref_us;
+    int32_t  drift_ppb;     //chip clock vs RP2350 clock, positive when the host clock runs fast
+    uint32_t wraps;         //TBCIF overflows seen
+    uint64_t next_sync_us;
+} mcp2518fd_timestamp_t;
+
+/*
+TX completion tracking. every frame that goes out gets the next SEQ (23 bits) in its message object and the chip copies
+it into the TEF record once the frame has been sent. tracked frames also get a slot here, indexed by SEQ, which the TEF
+drain fills in: the callback runs (from the INT service routine), or without a callback the slot is left DONE for
+can_tx_poll() to pick up. a TEF overflow loses records, once a record from after the gap comes back every older frame
+still pending in the same FIFO is finished with tx_time_us = CAN_TX_TIME_LOST
+*/
+#define CAN_TX_TRACK_SIZE 32        //tracked frames in flight, must be a power of 2
+#define CAN_TX_SEQ_MASK   0x7FFFFF
+#define CAN_TX_TIME_LOST  UINT64_MAX //its TEF record was lost to an overflow, the frame most likely went out but we can't tell when
+
+typedef void (*can_tx_done_callback_t)(void *ctx, uint32_t seq, uint64_t tx_time_us);
+
+typedef enum {
+    CAN_TX_TRACK_FREE = 0,
+    CAN_TX_TRACK_PENDING,
+    CAN_TX_TRACK_DONE
+} CAN_TX_TRACK_STATE;
+
+typedef struct {
+    volatile uint8_t state;         //CAN_TX_TRACK_STATE
+    uint32_t seq;
+    can_tx_done_callback_t callback;
+    void *ctx;
+    uint8_t fifo;                   //FIFO it was sent through, frames only go out in SEQ order within one FIFO
+    uint64_t tx_time_us;            //SOF of the transmitted frame if TEF timestamps are on, otherwise when it was drained
+    can_frame_handle_t handle;      //pool frame freed when the TEF record comes back, NONE if the frame was copied
+} can_tx_track_t;
+
+/*
+TX scheduler, see MCP2518fd_tx_sched_config(). each message class owns one TX FIFO (or the TXQ) with its own
+TxPriority, so arbitration between classes happens on the chip: a control frame in a higher priority FIFO goes out
+before anything still waiting in a bulk FIFO. what doesn't fit the FIFO waits in the class's host backlog and is
+refilled from the FIFO's TxNotFull (or TxHalfFull) interrupt, which is only enabled while that backlog has frames
+*/
+#define CAN_TX_CLASS_MAX 4
+
+#ifndef CAN_TX_BACKLOG_SIZE
+#define CAN_TX_BACKLOG_SIZE 16 //per class, must be a power of 2
+#endif
+
+typedef struct {
+    uint8_t fifo;           //0 = TXQ, otherwise a TX FIFO
+    uint8_t priority;       //TxPriority 0-31, 31 wins. every class needs its own
+    uint8_t attempts;       //TxAttempts: 0 = one shot, 1 = 3 attempts, 2/3 = unlimited
+    bool refill_half;       //refill at half empty (fewer interrupts, bigger bursts) instead of not full. not on the TXQ
+} can_tx_class_cfg_t;
+
+typedef struct {
+    can_tx_class_cfg_t cfg;
+    volatile uint32_t head;         //written by whoever sends
+    volatile uint32_t tail;         //written by the INT service routine
+    volatile bool irq_on;
+    uint32_t sent;
+    uint32_t dropped;               //backlog or frame pool full
+    uint32_t high_water;
+    can_frame_handle_t frames[CAN_TX_BACKLOG_SIZE]; //pool frames, the backlog owns them until they're sent
+} can_tx_class_t;
+
+/*
+driver statistics. the host side counters are bumped where the driver already has the data in hand (no extra SPI), the
+chip side is one 3 word burst of CiTREC/CiBDIAG0/CiBDIAG1 (0x034 - 0x03C) every period_us from MCP2518fd_stats_service()
+plus a write clearing the sticky BDIAG1 flags. BDIAG1 error counters below count sample periods in which that error was
+seen, not individual errors
+*/
+#define MCP2518FD_STATS_PERIOD_US 1000000
+
+typedef struct {
+    //host side
+    uint32_t rx_frames;
+    uint32_t tx_frames;
+    uint32_t spi_bytes;                 //every byte clocked for this device, command headers included
+    uint8_t  fifo_high_water[32];       //most objects seen waiting in an RX FIFO in one service pass
+    uint32_t rx_ring_high_water;
+
+    //sampled from the chip
+    uint32_t period_us;
+    uint64_t next_sample_us;
+    uint32_t samples;
+    REG_CiTREC trec;
+    REG_CiBDIAG0 bdiag0;
+    uint32_t error_free_msgs;           //ErrorFreeMsgCount summed over samples
+    uint32_t nominal_bit0, nominal_bit1, nominal_ack, nominal_form, nominal_stuff, nominal_crc;
+    uint32_t data_bit0, data_bit1, data_ack, data_form, data_stuff, data_crc;
+    uint32_t tx_bus_off_errors;
+    uint32_t error_warning_entries;     //state transitions between samples
+    uint32_t error_passive_entries;
+    uint32_t bus_off_entries;
+
+    //rates over the last period
+    uint32_t rx_fps;
+    uint32_t tx_fps;
+    uint32_t spi_bytes_per_frame;
+    uint32_t last_rx_frames;
+    uint32_t last_tx_frames;
+    uint32_t last_spi_bytes;
+} mcp2518fd_stats_t;
+
+/*
+built in traffic generator/verifier, see MCP2518fd_self_test(). every TX FIFO (and the TXQ) carries its own stream of
+frames with ID MCP2518FD_SELFTEST_ID + stream, the first 4 data bytes are the stream's sequence number and the rest a
+pattern worked out from it, so the receive side can check order, length and payload without keeping copies. streams
+are spread over the RX FIFOs with exact match filters
+*/
+#define MCP2518FD_SELFTEST_ID 0x700
+
+typedef struct {
+    CAN_OPERATION_MODE mode;   //CAN_INTERNAL_LOOPBACK_MODE, CAN_EXTERNAL_LOOPBACK_MODE or CAN_LISTEN_ONLY_MODE (receive only)
+    uint32_t frames;            //per stream, ignored in listen only
+    uint8_t len;                //payload bytes, 4-64. 0 walks through every length that fits the FIFOs
+    bool fd;                    //FD frames with BRS, otherwise classic (len capped at 8)
+    uint32_t timeout_us;        //whole run, listen only just listens this long
+} mcp2518fd_selftest_cfg_t;
+
+typedef struct {
+    uint8_t streams;
+    uint8_t rx_fifos;
+    uint32_t sent;
+    uint32_t received;
+    uint32_t missing;           //sequence numbers skipped, or never seen by the end of the run
+    uint32_t order_errors;      //sequence number went backwards or repeated
+    uint32_t length_errors;
+    uint32_t payload_errors;
+    uint32_t foreign;           //frames that weren't ours (listen only counts everything here)
+    uint32_t rx_dropped;        //RX ring overflows during the run
+    uint32_t elapsed_us;
+    uint32_t fps;               //received frames per second over the run
+    uint32_t per_fifo[32];      //received frames by RX FIFO
+} mcp2518fd_selftest_result_t;
+
+/*
+SPI transaction trace, build with MCP2518FD_TRACE defined (cmake -DCAN_TRACE=ON) to get it. every transaction gets
+four stamps off the M33 cycle counter: entry into the driver, CS low, last byte clocked, CS high and bus released. so
+wait = cs - start (bus busy, IRQ hold), clock = clocked - cs, finish = end - clocked (for DMA that includes the
+completion IRQ latency). entries go into a per core ring in RAM and only leave it through MCP2518fd_trace_drain(), a
+full ring drops new entries rather than blocking. without MCP2518FD_TRACE none of this is compiled in.
+tools/can_trace_summary.py turns the drained lines into per register / per call site latency histograms.
+*/
+#ifndef MCP2518FD_TRACE_SIZE
+#define MCP2518FD_TRACE_SIZE 128 //per core, must be a power of 2
+#endif
+
+#define MCP2518FD_TRACE_DMA (1 << 0)
+#define MCP2518FD_TRACE_CRC (1 << 1)
+
+typedef struct {
+    const char *site;   //innermost function tagged with MCP2518FD_TRACE_FUNC()
+    uint32_t start;     //cycles
+    uint32_t cs;
+    uint32_t clocked;
+    uint32_t end;
+    uint16_t addr;
+    uint16_t len;
+    uint8_t opcode;
+    uint8_t cs_pin;
+    uint8_t flags;
+} mcp2518fd_trace_entry_t;
+
+#ifdef MCP2518FD_TRACE
+const char *mcp2518fd_trace_site_enter(const char *site);
+void mcp2518fd_trace_site_restore(const char **prev);
+
+//tags every transaction below this point in the calling function with its name, restored on return
+#define MCP2518FD_TRACE_FUNC() \
+    const char *mcp_trace_prev_site __attribute__((cleanup(mcp2518fd_trace_site_restore), unused)) = mcp2518fd_trace_site_enter(__func__)
+#else
+#define MCP2518FD_TRACE_FUNC() do {} while(0)
+#endif
+
+//RAM copy of the configuration registers, see MCP2518fd_reg_get / MCP2518fd_reg_write
+typedef struct {
+    uint32_t ctrl[20];      //0x000 - 0x04C
+    uint32_t fifo[32];      //CiTXQCON, CiFIFOCON1-31 (STA/UA are status and never cached)
+    uint32_t fltcon[8];     //0x1D0 - 0x1EC
+    uint32_t fltobj[64];    //0x1F0 - 0x2EC, CiFLTOBJ/CiMASK pairs
+    uint32_t specific[5];   //0xE00 - 0xE10
+} mcp2518fd_shadow_t;
+
+//called from the DMA completion IRQ once CS has been released
+typedef void (*spi_MCP_callback_t)(void *ctx);
+
+#define MCP2518FD_MAX_DEVICES 4
+
+typedef struct mcp2518fd_bus mcp2518fd_bus_t; //one per SPI instance, owns the DMA channels and transfer queue (can.c)
+
+//where the time in MCP2518fd_init() went, filled in by the bring-up (total stays 0 if it failed)
+typedef struct {
+    uint32_t osc_us;        //reset to oscillator ready
+    uint32_t config_us;     //devid, clocks, timing, FIFOs, RAM, ECC
+    uint32_t mode_us;       //leaving configuration mode, the chip waits for bus idle
+    uint32_t total_us;      //whole bring-up including the RP2350 side SPI/DMA/IRQ setup
+} mcp2518fd_init_timing_t;
+
+/*
+low power. with dev->sleep_cfg set the wake-up filter is on from bring-up and MCP2518fd_sleep_service() puts the
+controller (and with xcr_standby the transceiver, through GPIO0 as XSTBY) to sleep once no frame has gone either way
+for idle_us. in Sleep the registers survive and a bus wake (WAKIF through the wake-up filter) only needs the oscillator
+back and the mode request. in LPM the chip comes back out of reset, MCP2518fd_wake() puts the configuration back from
+the shadow in a few bursts instead of running the whole MCP2518fd_init() again. LPM can't raise INT on a bus wake (all
+its IEs are back at 0), and any CS on it wakes it, so an LPM device only wakes through MCP2518fd_wake().
+sending to a sleeping device (can_send_*, can_tx_push, can_tx_sched_send*) wakes it first and sends 0 frames if the
+wake fails. the wake polls for the oscillator, so don't send to a device that may be asleep from an IRQ
+*/
+typedef struct {
+    uint32_t idle_us;             //bus quiet for this long before sleeping, 0 only sleeps on MCP2518fd_sleep()
+    bool lpm;                     //low power mode (OSC.LowPowerModeEnable) instead of Sleep
+    bool xcr_standby;             //GPIO0 switches the transceiver to standby while asleep (IOCON.XcrSTBYEnable)
+    uint8_t wake_filter_time;     //CiCON.WakeUpFilterTime, 0-3
+} mcp2518fd_sleep_cfg_t;
+
+typedef struct {
+    volatile bool asleep;
+    volatile bool wake_pending;   //WAKIF seen by the INT service, MCP2518fd_sleep_service() finishes the wake
+    bool int_parked;              //INT IRQ switched off for LPM, back on after the wake
+    uint64_t wake_start_us;
+    uint64_t last_activity_us;
+    uint32_t last_rx_frames;
+    uint32_t last_tx_frames;
+    uint32_t sleeps;
+    uint32_t wakes;
+    uint32_t wake_us;             //last wake, WAKIF or MCP2518fd_wake() to back in dev->mode
+} mcp2518fd_sleep_state_t;
+
+/*
+config image, see MCP2518fd_config_image_begin(). while it's active register writes to the control block, FIFO
+control block and filter block only land in the shadow, dirty[] says which words, and trigger[] keeps FRESET/UINC for
+the FIFOs (0-31) and TEF (32) since the shadow drops those
+*/
+typedef struct {
+    bool active;
+    uint64_t dirty[4];      //ctrl, FIFOCON, FLTCON, FLTOBJ/MASK (bit n = word n of that shadow array)
+    uint32_t trigger[33];
+} mcp2518fd_config_image_t;
+
+//everything the driver knows about one MCP2518FD, passed to every driver call. set up with MCP2518fd_dev_setup()
+typedef struct mcp2518fd_dev {
+    spi_inst_t *spi; //NULL on a PIO bus
+    uint sck_pin;
+    uint tx_pin;
+    uint rx_pin;
+    uint cs_pin;
+    uint int_pin;
+
+    //bring-up options, defaults come from MCP2518fd_dev_setup(), change them before MCP2518fd_init()
+    uint8_t tx_fifos;             //FIFO1..tx_fifos are TX, the next rx_fifos are RX
+    uint8_t rx_fifos;
+    uint8_t tef_depth;            //TEF records, 0 leaves the TEF off (the RAM planner path uses ram_req->tef instead)
+    CAN_OPERATION_MODE mode;      //mode requested at the end of bring-up
+    bool service_on_core1;        //run bring-up, SPI, IRQs and FIFO draining on core1
+    const mcp2518fd_ram_req_t *ram_req; //optional, planned with MCP2518fd_plan_RAM instead of tx_fifos/rx_fifos
+    const mcp2518fd_clock_profile_t *clock; //optional, &mcp2518fd_clock_profiles[...], default timing words if NULL
+    const mcp2518fd_sleep_cfg_t *sleep_cfg; //optional, managed low power (see MCP2518fd_sleep_service)
+
+    mcp2518fd_bus_t *bus;
+    bool int_irq_armed;
+    uint32_t crc_errors;          //CRC mismatches seen on CRC reads plus CRCERRIF/FERRIF hits from MCP2518fd_crc_check
+    mcp2518fd_ecc_stats_t ecc;
+    bool ecc_enable;              //bring-up option, turn on RAM ECC (see MCP2518fd_ECC_enable)
+    bool timestamps;              //bring-up option, timestamp RX FIFOs and TEF (on by default)
+    mcp2518fd_timestamp_t ts;
+    mcp2518fd_init_timing_t init_timing;
+    mcp2518fd_sleep_state_t sleep;
+    mcp2518fd_config_image_t image;
+    mcp2518fd_stats_t stats;
+    bool stats_print;             //print a stats line over stdio every sample period
+
+    mcp2518fd_shadow_t shadow;
+    mcp2518fd_fifo_layout_t fifo_layout[32];
+    can_rx_ring_t rx_ring;
+    can_rx_burst_buf_t rx_burst;  //per device, two devices can be drained at once (one on each core, or nested IRQs)
+    can_tx_ring_t tx_ring;        //only used when service_on_core1 is set
+    bool rx_handles;              //RX ring carries pool frames (can_rx_pop_handle), set before bring-up
+
+    mcp2518fd_fifo_layout_t tef_layout;
+    uint32_t tx_seq;              //SEQ the next frame sent will get, only ever taken through can_tx_seq_claim()
+    can_tx_track_t tx_track[CAN_TX_TRACK_SIZE];
+    uint32_t tef_records;
+    uint32_t tef_overflows;
+    bool tef_gap;                 //records were lost, the tracks older than the first record after the gap can't come back
+    uint8_t tef_gap_skip;         //records still ahead of the gap, the ones that were in the TEF when it overflowed
+
+    can_tx_class_t tx_classes[CAN_TX_CLASS_MAX]; //in the order they were configured, that's the class number
+    uint8_t tx_class_order[CAN_TX_CLASS_MAX];    //class numbers, highest priority first
+    uint8_t tx_nclasses;
+} mcp2518fd_dev_t;
+
+void MCP2518fd_dev_setup(mcp2518fd_dev_t *dev, spi_inst_t *spi, uint sck_pin, uint tx_pin, uint rx_pin, uint cs_pin, uint int_pin);
+#ifdef MCP2518FD_PIO_SPI
+void MCP2518fd_dev_setup_pio(mcp2518fd_dev_t *dev, PIO pio, uint sck_pin, uint tx_pin, uint rx_pin, uint cs_pin, uint int_pin);
+#endif
+
+//SCK at or under hz, clamped to 0.85 * SYSCLK/2 and to what the bus can do. 0 is the fastest allowed, returns the real rate
+uint32_t MCP2518fd_set_sck(mcp2518fd_dev_t *dev, uint32_t hz);
+
+void SPI_to_CAN_master_init(mcp2518fd_dev_t *dev);
+void SPI_DMA_init(mcp2518fd_dev_t *dev);
+void spi_write_to_MCP(mcp2518fd_dev_t *dev, uint8_t *txbuffer, uint8_t *rxbuffer, uint16_t len);
+bool spi_write_to_MCP_async(mcp2518fd_dev_t *dev, uint8_t *txbuffer, uint8_t *rxbuffer, uint16_t len, spi_MCP_callback_t callback, void *ctx);
+bool spi_MCP_transfer_done(mcp2518fd_dev_t *dev);
+void spi_MCP_wait_transfer(mcp2518fd_dev_t *dev);
+void SPI_read_word_from_MCP(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t *data);
+void SPI_write_word_to_MCP(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t data);
+void SPI_read_block_from_MCP(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t *buf, uint16_t nwords);
+void SPI_write_block_to_MCP(mcp2518fd_dev_t *dev, uint16_t addr, const uint32_t *buf, uint16_t nwords);
+void SPI_read_raw_from_MCP(mcp2518fd_dev_t *dev, uint16_t addr, uint8_t *buf, uint16_t len);
+void SPI_write_bytes_to_MCP(mcp2518fd_dev_t *dev, uint16_t addr, const uint8_t *data, uint8_t len);
+void SPI_write_byte_to_MCP(mcp2518fd_dev_t *dev, uint16_t addr, uint8_t data);
+int8_t SPI_read_block_crc_from_MCP(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t *buf, uint16_t nwords);
+void SPI_write_block_crc_to_MCP(mcp2518fd_dev_t *dev, uint16_t addr, const uint32_t *buf, uint16_t nwords);
+void SPI_write_byte_safe_to_MCP(mcp2518fd_dev_t *dev, uint16_t addr, uint8_t data);
+int8_t MCP2518fd_crc_check(mcp2518fd_dev_t *dev);
+void spi_reset_MCP_chip(mcp2518fd_dev_t *dev);
+void MCP2518fd_shadow_reset(mcp2518fd_dev_t *dev);
+uint32_t MCP2518fd_reg_get(mcp2518fd_dev_t *dev, uint16_t addr);
+uint32_t MCP2518fd_reg_read(mcp2518fd_dev_t *dev, uint16_t addr);
+void MCP2518fd_reg_write(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t value);
+void MCP2518fd_reg_write_full(mcp2518fd_dev_t *dev, uint16_t addr, uint32_t value);
+void MCP2518fd_config_image_begin(mcp2518fd_dev_t *dev);
+void MCP2518fd_config_image_load(mcp2518fd_dev_t *dev);
+void MCP2518fd_reg_write_block(mcp2518fd_dev_t *dev, uint16_t addr, const uint32_t *buf, uint16_t nwords);
+//bit timing register words, computed at compile time in can_bit_timing.cpp
+extern const uint32_t mcp2518fd_nbtcfg_word;
+extern const uint32_t mcp2518fd_dbtcfg_word;
+extern const uint32_t mcp2518fd_tdc_word;
+extern const mcp2518fd_clock_profile_t mcp2518fd_clock_profiles[MCP2518FD_CLOCK_PROFILE_COUNT];
+
+void MCP2518fd_nominal_bit_timing_config(mcp2518fd_dev_t *dev);
+void MCP2518fd_data_bit_timing_config(mcp2518fd_dev_t *dev);
+void MCP2518fd_TDC_config(mcp2518fd_dev_t *dev);
+void MCP2518fd_TXQ_FIFO_config(mcp2518fd_dev_t *dev);
+void MCP2518fd_set_TXQ_UINC(mcp2518fd_dev_t *dev);
+void MCP2518fd_FIFO_config(mcp2518fd_dev_t *dev, uint8_t n, uint8_t m);
+void MCP2518fd_filter_and_mask_enable_config(mcp2518fd_dev_t *dev, uint8_t n, uint8_t m);
+int8_t MCP2518fd_filter_compile(const can_id_range_t *ranges, uint16_t n, mcp2518fd_filter_t *filters);
+void MCP2518fd_filter_program(mcp2518fd_dev_t *dev, const mcp2518fd_filter_t *filters, uint8_t count);
+int8_t MCP2518fd_set_filters(mcp2518fd_dev_t *dev, const can_id_range_t *ranges, uint16_t n);
+void MCP2518fd_set_FIFO_UINC(mcp2518fd_dev_t *dev, uint8_t fifo);
+void MCP2518fd_decode_rx_msgobj(const uint32_t *obj, bool timestamp, can_rx_frame_t *frame);
+int8_t MCP2518fd_read_rx_msgobj(mcp2518fd_dev_t *dev, uint8_t fifo, can_rx_msgobj_buf_t *buf, can_rx_frame_t *frame);
+void MCP2518fd_RX_IRQ_init(mcp2518fd_dev_t *dev);
+void MCP2518fd_ECC_enable(mcp2518fd_dev_t *dev);
+void MCP2518fd_timestamp_enable(mcp2518fd_dev_t *dev);
+void MCP2518fd_timestamp_sync(mcp2518fd_dev_t *dev);
+void MCP2518fd_timestamp_service(mcp2518fd_dev_t *dev);
+bool MCP2518fd_stats_service(mcp2518fd_dev_t *dev);
+void MCP2518fd_stats_print(mcp2518fd_dev_t *dev);
+int8_t MCP2518fd_self_test(mcp2518fd_dev_t *dev, const mcp2518fd_selftest_cfg_t *cfg, mcp2518fd_selftest_result_t *result);
+void MCP2518fd_self_test_print(const mcp2518fd_selftest_result_t *result);
+uint16_t MCP2518fd_trace_drain(uint16_t max);
+uint32_t MCP2518fd_trace_dropped(void);
+uint64_t MCP2518fd_timestamp_to_us(mcp2518fd_dev_t *dev, uint32_t tbc);
+void MCP2518fd_ECC_service(mcp2518fd_dev_t *dev);
+void MCP2518fd_service_irq(mcp2518fd_dev_t *dev);
+void can_pool_init(void);
+can_frame_handle_t can_frame_alloc(uint8_t len);
+void can_frame_free(can_frame_handle_t handle);
+can_frame_t *can_frame_get(can_frame_handle_t handle);
+uint8_t can_frame_capacity(can_frame_handle_t handle);
+void can_pool_get_stats(bool fd, can_pool_stats_t *stats);
+bool can_rx_pop(mcp2518fd_dev_t *dev, can_frame_t *frame);
+bool can_rx_pop_handle(mcp2518fd_dev_t *dev, can_frame_handle_t *handle);
+uint32_t can_rx_available(mcp2518fd_dev_t *dev);
+uint32_t can_rx_dropped(mcp2518fd_dev_t *dev);
+uint32_t can_tx_seq_claim(mcp2518fd_dev_t *dev, uint8_t n);
+bool can_tx_wake(mcp2518fd_dev_t *dev);
+uint8_t can_send_batch_fifo(mcp2518fd_dev_t *dev, uint8_t fifo, const can_frame_t *frames, uint8_t n);
+uint8_t can_send_batch(mcp2518fd_dev_t *dev, const can_frame_t *frames, uint8_t n);
+uint8_t can_send_batch_tracked(mcp2518fd_dev_t *dev, uint8_t fifo, const can_frame_t *frames, uint8_t n, can_tx_done_callback_t callback, void *ctx, uint32_t *first_seq);
+uint8_t can_send_handles_tracked(mcp2518fd_dev_t *dev, uint8_t fifo, const can_frame_handle_t *handles, uint8_t n, can_tx_done_callback_t callback, void *ctx, uint32_t *first_seq);
+bool can_tx_poll(mcp2518fd_dev_t *dev, uint32_t seq, uint64_t *tx_time_us);
+void MCP2518fd_TEF_config(mcp2518fd_dev_t *dev, uint8_t depth, bool timestamp);
+int8_t MCP2518fd_tx_sched_config(mcp2518fd_dev_t *dev, const can_tx_class_cfg_t *classes, uint8_t n);
+bool can_tx_sched_send(mcp2518fd_dev_t *dev, uint8_t cls, const can_frame_t *frame);
+bool can_tx_sched_send_handle(mcp2518fd_dev_t *dev, uint8_t cls, can_frame_handle_t handle);
+void MCP2518fd_tx_sched_service(mcp2518fd_dev_t *dev);
+int8_t MCP2518fd_sleep(mcp2518fd_dev_t *dev);
+int8_t MCP2518fd_wake(mcp2518fd_dev_t *dev);
+bool MCP2518fd_sleep_service(mcp2518fd_dev_t *dev);
+bool can_tx_push(mcp2518fd_dev_t *dev, const can_frame_t *frame);
+bool MCP2518fd_service_tx(mcp2518fd_dev_t *dev);
+
+int8_t MCP2518fd_oscillator_check(mcp2518fd_dev_t *dev);
+int8_t MCP2518fd_clock_config(mcp2518fd_dev_t *dev, const mcp2518fd_clock_profile_t *profile);
+int8_t MCP2518fd_devid_verify(mcp2518fd_dev_t *dev);     
+int8_t MCP2518fd_set_mode(mcp2518fd_dev_t *dev, CAN_OPERATION_MODE mode); 
+int8_t MCP2518fd_CAN_controller_config(mcp2518fd_dev_t *dev);        
+int8_t MCP2518fd_init(mcp2518fd_dev_t *dev);       
+int16_t MCP2518fd_available_RAM_calc(mcp2518fd_dev_t *dev);
+int8_t MCP2518fd_plan_RAM(const mcp2518fd_ram_req_t *req, mcp2518fd_ram_map_t *map);
+int8_t MCP2518fd_apply_RAM_plan(mcp2518fd_dev_t *dev, const mcp2518fd_ram_req_t *req, const mcp2518fd_ram_map_t *map);                
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,501 @@
+/*
+on-target benchmarks for the driver, built as the can_bench target and run against a single MCP2518FD on spi_default
+(CS = PICO_DEFAULT_SPI_CSN_PIN, INT = MCP2518FD_INT_PIN). the chip runs in internal loopback so no bus or second node
+is needed. each result is one line:
+
+    BENCH,<test>,<param>,<metric>,<value>,<unit>
+
+framed by BENCH_START/BENCH_DONE, everything else on stdio can be ignored. timing comes off the M33 cycle counter so
+sub microsecond results are real, every test repeats enough times to make the loop overhead noise
+*/
+
+#include "can.h"
+#include "pico/stdio_usb.h"
+#include "hardware/clocks.h"
+#include "hardware/structs/m33.h"
+#include "hardware/xip_cache.h"
+
+#define BENCH_SPI_OPS 2000
+#define BENCH_DMA_OPS 500
+#define BENCH_RMW_OPS 2000
+#define BENCH_FRAMES 1000
+#define BENCH_LATENCY_SAMPLES 200
+#define BENCH_TIMEOUT_US 2000000
+
+static mcp2518fd_dev_t bench_dev;
+static uint32_t bench_hz;
+
+static inline uint32_t bench_cycles(void) {
+    return m33_hw->dwt_cyccnt;
+}
+
+static inline float bench_us(uint32_t cycles) {
+    return (float)cycles * 1e6f / (float)bench_hz;
+}
+
+static void bench_result(const char *test, const char *param, const char *metric, float value, const char *unit) {
+    printf("BENCH,%s,%s,%s,%.3f,%s\n", test, param, metric, value, unit);
+}
+
+/*
+SPI
+*/
+
+//back to back single word reads of OSC (always readable, no side effects) and 63 word RAM bursts at a range of SCK,
+//0 is as fast as the bus and the chip's SYSCLK allow
+static void bench_spi_throughput(mcp2518fd_dev_t *dev, uint16_t scratch_addr) {
+    static const uint32_t bauds[] = {1000000, 2000000, 5000000, 10000000, 0};
+    static uint32_t burst[63];
+    char param[24];
+
+    for(uint8_t i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+        uint32_t actual = MCP2518fd_set_sck(dev, bauds[i]);
+        snprintf(param, sizeof(param), "sck=%lu", (unsigned long)actual);
+
+        uint32_t word;
+        uint32_t t0 = bench_cycles();
+
+        for(uint16_t n = 0; n < BENCH_SPI_OPS; n++) {
+            SPI_read_word_from_MCP(dev, MCP2518FD_REG_OSC, &word);
+        }
+
+        uint32_t t = bench_cycles() - t0;
+
+        bench_result("spi_word_read", param, "per_op", bench_us(t) / BENCH_SPI_OPS, "us");
+        bench_result("spi_word_read", param, "rate", BENCH_SPI_OPS * 1e6f / bench_us(t), "ops/s");
+
+        t0 = bench_cycles();
+
+        for(uint16_t n = 0; n < BENCH_SPI_OPS / 10; n++) {
+            SPI_read_block_from_MCP(dev, scratch_addr, burst, 63);
+        }
+
+        t = bench_cycles() - t0;
+
+        bench_result("spi_burst_read", param, "payload", (BENCH_SPI_OPS / 10) * sizeof(burst) * 1e6f / bench_us(t) / 1024, "KiB/s");
+
+        t0 = bench_cycles();
+
+        for(uint16_t n = 0; n < BENCH_SPI_OPS / 10; n++) {
+            SPI_write_block_to_MCP(dev, scratch_addr, burst, 63);
+        }
+
+        t = bench_cycles() - t0;
+
+        bench_result("spi_burst_write", param, "payload", (BENCH_SPI_OPS / 10) * sizeof(burst) * 1e6f / bench_us(t) / 1024, "KiB/s");
+    }
+
+    MCP2518fd_set_sck(dev, 0);
+}
+
+//same READ transfer through the CPU path the driver uses below SPI_DMA_MIN_LEN and through the DMA queue
+static void bench_spi_blocking_vs_dma(mcp2518fd_dev_t *dev, uint16_t scratch_addr) {
+    static const uint16_t lens[] = {6, 14, 34, 66, 130, 254};
+    static uint8_t txbuffer[BUF_LEN];
+    static uint8_t rxbuffer[BUF_LEN];
+    char param[16];
+
+    txbuffer[0] = (MCP2518FD_INSTR_READ << 4) | ((scratch_addr >> 8) & 0x0F);
+    txbuffer[1] = scratch_addr & 0xFF;
+
+    for(uint8_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        uint16_t len = lens[i];
+        snprintf(param, sizeof(param), "len=%u", len);
+
+        uint32_t t0;
+        uint32_t t;
+
+        if(dev->spi) { //raw PL022 baseline, there's no CPU path with a hand driven CS on the PIO bus
+            t0 = bench_cycles();
+
+            for(uint16_t n = 0; n < BENCH_DMA_OPS; n++) {
+                gpio_put(dev->cs_pin, LOW);
+                spi_write_read_blocking(dev->spi, txbuffer, rxbuffer, len);
+                gpio_put(dev->cs_pin, HIGH);
+            }
+
+            t = bench_cycles() - t0;
+
+            bench_result("spi_blocking", param, "per_xfer", bench_us(t) / BENCH_DMA_OPS, "us");
+        }
+
+        t0 = bench_cycles();
+
+        for(uint16_t n = 0; n < BENCH_DMA_OPS; n++) {
+            spi_write_to_MCP_async(dev, txbuffer, rxbuffer, len, NULL, NULL);
+            spi_MCP_wait_transfer(dev);
+        }
+
+        t = bench_cycles() - t0;
+
+        bench_result("spi_dma", param, "per_xfer", bench_us(t) / BENCH_DMA_OPS, "us");
+    }
+}
+
+/*
+register access. filter 31's mask is the scratch register, the filter is never enabled so nothing changes on the bus
+*/
+
+static void bench_register_rmw(mcp2518fd_dev_t *dev) {
+    uint16_t reg = MCP2518FD_REG_CiMASK + 31 * 8;
+    uint32_t word;
+
+    uint32_t t0 = bench_cycles();
+
+    for(uint16_t n = 0; n < BENCH_RMW_OPS; n++) {
+        SPI_read_word_from_MCP(dev, reg, &word);
+        SPI_write_word_to_MCP(dev, reg, word ^ 1);
+    }
+
+    uint32_t t = bench_cycles() - t0;
+
+    bench_result("reg_rmw", "chip_read", "per_op", bench_us(t) / BENCH_RMW_OPS, "us");
+
+    //one bit flip through the shadow: no read, one byte written
+    t0 = bench_cycles();
+
+    for(uint16_t n = 0; n < BENCH_RMW_OPS; n++) {
+        MCP2518fd_reg_write(dev, reg, MCP2518fd_reg_get(dev, reg) ^ 1);
+    }
+
+    t = bench_cycles() - t0;
+
+    bench_result("reg_rmw", "shadow", "per_op", bench_us(t) / BENCH_RMW_OPS, "us");
+
+    //value already in the shadow, should be no SPI at all
+    t0 = bench_cycles();
+
+    for(uint16_t n = 0; n < BENCH_RMW_OPS; n++) {
+        MCP2518fd_reg_write(dev, reg, MCP2518fd_reg_get(dev, reg));
+    }
+
+    t = bench_cycles() - t0;
+
+    bench_result("reg_rmw", "shadow_unchanged", "per_op", bench_us(t) / BENCH_RMW_OPS, "us");
+}
+
+/*
+loopback frames. frames go out through the TXQ in batches of 8 and come back through the INT IRQ into the RX ring,
+so rx rate is the whole path: SPI out, bus, IRQ, FIFO drain, ring
+*/
+
+static void bench_frame_init(can_frame_t *frame, uint8_t len, bool fd) {
+    memset(frame, 0, sizeof(*frame));
+
+    frame->id = 0x123;
+    frame->len = len;
+    frame->flags = fd ? (CAN_FRAME_FLAG_FDF | CAN_FRAME_FLAG_BRS) : 0;
+
+    for(uint8_t i = 0; i < len; i++) {
+        frame->data[i] = i;
+    }
+}
+
+static void bench_loopback_rate(mcp2518fd_dev_t *dev, uint8_t len, bool fd) {
+    static can_frame_t batch[8];
+    can_frame_t rx;
+    char param[24];
+
+    for(uint8_t i = 0; i < 8; i++) {
+        bench_frame_init(&batch[i], len, fd);
+    }
+
+    snprintf(param, sizeof(param), "%s_len=%u", fd ? "fd" : "classic", len);
+
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    uint32_t tx_done = 0;
+    uint64_t start = time_us_64();
+    uint32_t t0 = bench_cycles();
+
+    while(received < BENCH_FRAMES && time_us_64() - start < BENCH_TIMEOUT_US) {
+        if(sent < BENCH_FRAMES) {
+            uint32_t left = BENCH_FRAMES - sent;
+            sent += can_send_batch(dev, batch, left < 8 ? left : 8);
+
+            if(sent == BENCH_FRAMES) {
+                tx_done = bench_cycles() - t0;
+            }
+        }
+
+        while(can_rx_pop(dev, &rx)) {
+            received++;
+        }
+    }
+
+    uint32_t t = bench_cycles() - t0;
+
+    bench_result("loopback_tx", param, "rate", tx_done ? sent * 1e6f / bench_us(tx_done) : 0, "frames/s");
+    bench_result("loopback_rx", param, "rate", received * 1e6f / bench_us(t), "frames/s");
+    bench_result("loopback_rx", param, "lost", BENCH_FRAMES - received, "frames");
+}
+
+/*
+IRQ latency, two views:
+- irq_service: INT armed off and polled, so the time from INT going low to the frame sitting in the RX ring is
+  exactly the service routine (VEC read, object read, UINC, ring push), NVIC entry not included. run warm and with the
+  XIP cache invalidated right before each service, the cold max is the worst case a flash resident hot path can hit
+  (compare a CAN_HOT_IN_RAM=ON and OFF build)
+- sof_to_ring: normal IRQ path, receive timestamp (taken at SOF) against the moment the ring shows the frame, which
+  adds the frame's own time on the bus
+*/
+
+static void bench_irq_service(mcp2518fd_dev_t *dev, const can_frame_t *frame, bool cold) {
+    const char *param = cold ? "classic_len=8,xip_cold" : "classic_len=8";
+    can_frame_t rx;
+    uint32_t min = UINT32_MAX, max = 0;
+    uint64_t sum = 0;
+    uint16_t samples = 0;
+
+    dev->int_irq_armed = false;
+    gpio_set_irq_enabled(dev->int_pin, GPIO_IRQ_LEVEL_LOW, false);
+
+    for(uint16_t n = 0; n < BENCH_LATENCY_SAMPLES; n++) {
+        if(!can_send_batch(dev, frame, 1)) {
+            continue;
+        }
+
+        uint64_t start = time_us_64();
+
+        while(can_rx_available(dev) == 0 && time_us_64() - start < BENCH_TIMEOUT_US) {
+            while(gpio_get(dev->int_pin) && time_us_64() - start < BENCH_TIMEOUT_US) {
+                tight_loop_contents();
+            }
+
+            if(cold) {
+                xip_cache_invalidate_all();
+            }
+
+            uint32_t t0 = bench_cycles();
+
+            MCP2518fd_service_irq(dev);
+
+            if(can_rx_available(dev)) {
+                uint32_t t = bench_cycles() - t0;
+
+                min = t < min ? t : min;
+                max = t > max ? t : max;
+                sum += t;
+                samples++;
+            }
+        }
+
+        while(can_rx_pop(dev, &rx)) {
+        }
+    }
+
+    dev->int_irq_armed = true;
+    gpio_set_irq_enabled(dev->int_pin, GPIO_IRQ_LEVEL_LOW, true);
+
+    if(samples) {
+        bench_result("irq_service", param, "min", bench_us(min), "us");
+        bench_result("irq_service", param, "avg", bench_us(sum / samples), "us");
+        bench_result("irq_service", param, "max", bench_us(max), "us");
+    }
+}
+
+static void bench_irq_latency(mcp2518fd_dev_t *dev) {
+    can_frame_t frame;
+    can_frame_t rx;
+    uint16_t samples = 0;
+
+    bench_frame_init(&frame, 8, false);
+
+    bench_irq_service(dev, &frame, false);
+    bench_irq_service(dev, &frame, true);
+
+    uint64_t lmin = UINT64_MAX, lmax = 0, lsum = 0;
+
+    for(uint16_t n = 0; n < BENCH_LATENCY_SAMPLES; n++) {
+        if(!can_send_batch(dev, &frame, 1)) {
+            continue;
+        }
+
+        uint64_t start = time_us_64();
+
+        while(can_rx_available(dev) == 0 && time_us_64() - start < BENCH_TIMEOUT_US) {
+            tight_loop_contents();
+        }
+
+        uint64_t seen = time_us_64();
+
+        if(can_rx_pop(dev, &rx) && (rx.flags & CAN_FRAME_FLAG_TS) && seen >= rx.timestamp_us) {
+            uint64_t l = seen - rx.timestamp_us;
+
+            lmin = l < lmin ? l : lmin;
+            lmax = l > lmax ? l : lmax;
+            lsum += l;
+            samples++;
+        }
+    }
+
+    if(samples) {
+        bench_result("sof_to_ring", "classic_len=8", "min", lmin, "us");
+        bench_result("sof_to_ring", "classic_len=8", "avg", (float)lsum / samples, "us");
+        bench_result("sof_to_ring", "classic_len=8", "max", lmax, "us");
+    }
+}
+
+/*
+low power resume: sleep, wake from the host side and time it to the chip being back in loopback (wake) and to the
+first frame sent after the wake sitting in the RX ring (first_frame). compare with init,-,time, which is what a
+wake by re-running MCP2518fd_init() would cost
+*/
+
+static void bench_sleep_wake(mcp2518fd_dev_t *dev, bool lpm) {
+    const mcp2518fd_sleep_cfg_t cfg = {.lpm = lpm};
+    const char *param = lpm ? "lpm" : "sleep";
+    can_frame_t frame;
+    can_frame_t rx;
+
+    bench_frame_init(&frame, 8, false);
+    dev->sleep_cfg = &cfg;
+
+    if(MCP2518fd_sleep(dev)) {
+        printf("BENCH_WARN,%s refused\n", param);
+        dev->sleep_cfg = NULL;
+        return;
+    }
+
+    sleep_ms(10);
+
+    uint32_t t0 = bench_cycles();
+    int8_t status = MCP2518fd_wake(dev);
+    uint32_t t_wake = bench_cycles() - t0;
+
+    uint64_t start = time_us_64();
+    bool seen = false;
+
+    if(!status && can_send_batch(dev, &frame, 1)) {
+        while(!seen && time_us_64() - start < BENCH_TIMEOUT_US) {
+            seen = can_rx_pop(dev, &rx);
+        }
+    }
+
+    uint32_t t = bench_cycles() - t0;
+
+    bench_result("wake", param, "wake", bench_us(t_wake), "us");
+    bench_result("wake", param, "first_frame", seen ? bench_us(t) : 0, "us");
+    bench_result("wake", param, "pass", !status && seen, "bool");
+
+    dev->sleep_cfg = NULL;
+}
+
+//the driver's own self test at each SCK, a board that's marginal at some clock shows up as errors rather than a crash
+static void bench_self_test(mcp2518fd_dev_t *dev) {
+    static const uint32_t bauds[] = {1000000, 5000000, 10000000, 0};
+    mcp2518fd_selftest_cfg_t cfg = {
+        .mode = CAN_INTERNAL_LOOPBACK_MODE,
+        .frames = BENCH_FRAMES,
+        .len = 0,
+        .fd = true,
+        .timeout_us = BENCH_TIMEOUT_US,
+    };
+    mcp2518fd_selftest_result_t result;
+    char param[24];
+
+    for(uint8_t i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+        snprintf(param, sizeof(param), "sck=%lu", (unsigned long)MCP2518fd_set_sck(dev, bauds[i]));
+
+        int8_t status = MCP2518fd_self_test(dev, &cfg, &result);
+
+        bench_result("selftest", param, "rate", result.fps, "frames/s");
+        bench_result("selftest", param, "errors", result.missing + result.order_errors + result.length_errors + result.payload_errors, "frames");
+        bench_result("selftest", param, "pass", status == 0, "bool");
+    }
+
+    MCP2518fd_set_sck(dev, 0);
+}
+
+int main() {
+    static const uint8_t fd_lens[] = {0, 8, 12, 16, 20, 24, 32, 48, 64};
+
+    //64 byte objects everywhere so every FD length fits, sized to leave the last ~460 bytes of RAM free for the bursts
+    static const mcp2518fd_ram_req_t ram_req = {
+        .tef = {.depth = 8, .timestamp = true},
+        .txq = {.depth = 8, .payload_bytes = 64},
+        .nfifos = 1,
+        .fifo = {
+            {.depth = 12, .payload_bytes = 64, .timestamp = true},
+        },
+    };
+
+    stdio_init_all();
+
+    //give a USB host a moment to open the port so the start of the run isn't lost
+    for(uint16_t i = 0; i < 50 && !stdio_usb_connected(); i++) {
+        sleep_ms(100);
+    }
+
+    m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+    m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
+    bench_hz = clock_get_hz(clk_sys);
+
+    mcp2518fd_dev_t *dev = &bench_dev;
+
+#ifdef MCP2518FD_PIO_SPI
+    MCP2518fd_dev_setup_pio(dev, pio0, PICO_DEFAULT_SPI_SCK_PIN, PICO_DEFAULT_SPI_TX_PIN, PICO_DEFAULT_SPI_RX_PIN,
+                            PICO_DEFAULT_SPI_CSN_PIN, MCP2518FD_INT_PIN);
+#else
+    MCP2518fd_dev_setup(dev, spi_default, PICO_DEFAULT_SPI_SCK_PIN, PICO_DEFAULT_SPI_TX_PIN, PICO_DEFAULT_SPI_RX_PIN,
+                        PICO_DEFAULT_SPI_CSN_PIN, MCP2518FD_INT_PIN);
+#endif
+    dev->mode = CAN_INTERNAL_LOOPBACK_MODE;
+    dev->ram_req = &ram_req;
+
+    uint64_t t0 = time_us_64();
+    int8_t init_result = MCP2518fd_init(dev);
+    uint64_t init_us = time_us_64() - t0; //before any printf, those block on the UART
+
+    if(init_result) {
+        printf("BENCH_FAIL,init\n");
+        while(1) {
+            tight_loop_contents();
+        }
+    }
+
+    printf("BENCH_START,clk_sys=%lu,mcp_sysclk=%lu,nbtcfg=0x%08lX,dbtcfg=0x%08lX\n",
+           (unsigned long)bench_hz, (unsigned long)MCP2518FD_SYSCLK_HZ,
+           (unsigned long)mcp2518fd_nbtcfg_word, (unsigned long)mcp2518fd_dbtcfg_word);
+    bench_result("build", "-", "hot_in_ram", MCP2518FD_HOT_IN_RAM, "flag");
+#ifdef MCP2518FD_PIO_SPI
+    bench_result("build", "-", "pio_spi", 1, "flag");
+#else
+    bench_result("build", "-", "pio_spi", 0, "flag");
+#endif
+    bench_result("build", "-", "sck", MCP2518fd_set_sck(dev, 0), "Hz");
+    bench_result("init", "-", "time", init_us, "us");
+    bench_result("init", "-", "osc", dev->init_timing.osc_us, "us");
+    bench_result("init", "-", "config", dev->init_timing.config_us, "us");
+    bench_result("init", "-", "mode", dev->init_timing.mode_us, "us");
+
+    //unused tail of the message RAM is free for SPI bursts
+    if(MCP2518fd_available_RAM_calc(dev) >= 63 * 4) {
+        uint16_t scratch_addr = MCP2518FD_RAM_END - 63 * 4;
+
+        bench_spi_throughput(dev, scratch_addr);
+        bench_spi_blocking_vs_dma(dev, scratch_addr);
+    } else {
+        printf("BENCH_WARN,no spare RAM for the SPI tests\n");
+    }
+
+    bench_register_rmw(dev);
+
+    bench_loopback_rate(dev, 0, false);
+    bench_loopback_rate(dev, 8, false);
+
+    for(uint8_t i = 0; i < sizeof(fd_lens) / sizeof(fd_lens[0]); i++) {
+        bench_loopback_rate(dev, fd_lens[i], true);
+    }
+
+    bench_irq_latency(dev);
+    bench_sleep_wake(dev, false);
+    bench_sleep_wake(dev, true);
+    bench_self_test(dev);
+
+    printf("BENCH_DONE,crc_errors=%lu,rx_dropped=%lu\n", (unsigned long)dev->crc_errors, (unsigned long)can_rx_dropped(dev));
+
+    while(1) {
+        tight_loop_contents();
+    }
+}
@@ -0,0 +1,63 @@
+/*
+bit timing words for the configured clock/bitrates, worked out at compile time by can_bit_timing.hpp
+override any of these with target_compile_definitions, a combination that doesn't work fails the build here
+*/
+
+#include "can.h"
+#include "can_bit_timing.hpp"
+
+#ifndef CAN_NOMINAL_BITRATE
+#define CAN_NOMINAL_BITRATE 500000
+#endif
+
+#ifndef CAN_NOMINAL_SAMPLE_PERMILLE
+#define CAN_NOMINAL_SAMPLE_PERMILLE 800
+#endif
+
+#ifndef CAN_DATA_BITRATE
+#define CAN_DATA_BITRATE 2000000
+#endif
+
+#ifndef CAN_DATA_SAMPLE_PERMILLE
+#define CAN_DATA_SAMPLE_PERMILLE 750
+#endif
+
+using default_profile = mcp2518fd::timing_profile<MCP2518FD_SYSCLK_HZ,
+                                                  CAN_NOMINAL_BITRATE, CAN_NOMINAL_SAMPLE_PERMILLE,
+                                                  CAN_DATA_BITRATE, CAN_DATA_SAMPLE_PERMILLE>;
+
+//40 MHz, 500k @ 80%, 2M @ 75% has to come out as the values the config functions used to hard code
+static_assert(mcp2518fd::timing_profile<40000000, 500000, 800, 2000000, 750>::nbtcfg == 0x003E0F0F, "calculator regression");
+
+//the chip's PLL only multiplies by 10 and SYSCLK tops out at 40 MHz
+template <uint32_t Xtal, bool Pll, bool Div2, uint32_t Nominal, uint32_t NominalSP, uint32_t Data, uint32_t DataSP>
+constexpr mcp2518fd_clock_profile_t make_clock_profile() {
+    constexpr uint32_t sysclk = (Pll ? Xtal * 10 : Xtal) / (Div2 ? 2 : 1);
+
+    static_assert(sysclk <= 40000000, "SYSCLK over 40 MHz");
+    static_assert(!Pll || Xtal * 10 <= 40000000, "PLL output over 40 MHz");
+
+    using timing = mcp2518fd::timing_profile<sysclk, Nominal, NominalSP, Data, DataSP>;
+
+    return {Xtal, sysclk, Nominal, Data, Pll, Div2, timing::nbtcfg, timing::dbtcfg, timing::tdc};
+}
+
+extern "C" {
+const uint32_t mcp2518fd_nbtcfg_word = default_profile::nbtcfg;
+const uint32_t mcp2518fd_dbtcfg_word = default_profile::dbtcfg;
+const uint32_t mcp2518fd_tdc_word = default_profile::tdc;
+
+/*
+data phase TQ counts at 40 MHz: 2M = 20, 5M = 8, 8M = 5. the faster profiles keep BRP at 0 (one SYSCLK per TQ) so TDC
+has the finest resolution, and 8M goes to an 80% sample point because 5 TQ can't do 75%
+*/
+const mcp2518fd_clock_profile_t mcp2518fd_clock_profiles[MCP2518FD_CLOCK_PROFILE_COUNT] = {
+    make_clock_profile<40000000, false, false, 500000, 800, 2000000, 750>(),
+    make_clock_profile<40000000, false, false, 500000, 800, 5000000, 750>(),
+    make_clock_profile<40000000, false, false, 500000, 800, 8000000, 800>(),
+    make_clock_profile<4000000,  true,  false, 500000, 800, 5000000, 750>(),
+    make_clock_profile<4000000,  true,  false, 500000, 800, 8000000, 800>(),
+    make_clock_profile<40000000, false, true,  500000, 800, 2000000, 750>(),
+    make_clock_profile<40000000, false, true,  500000, 800, 5000000, 750>(),
+};
+}
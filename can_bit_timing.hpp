@@ -0,0 +1,132 @@
+/*******************************************************************************
+ * can_bit_timing.hpp
+ *
+ * compile time bit timing calculator for the MCP2518FD
+ *
+ * takes SYSCLK, the nominal/data bitrates and sample points and searches for
+ * BRP/TSEG1/TSEG2/SJW, then packs them straight into CiNBTCFG/CiDBTCFG/CiTDC
+ * words. everything is constexpr so the search runs in the compiler and only
+ * the three words end up in the image. a profile that can't be hit exactly
+ * fails the build through the static_asserts in mcp2518fd::timing_profile.
+ *
+ * same maths as the comments in MCP2518fd_nominal_bit_timing_config():
+ *
+ *   TQ          = (BRP+1)/SYSCLK
+ *   bit time    = 1 (SYNC) + TSEG1 (PROP + PHASE 1) + TSEG2 (PHASE 2)  in TQ
+ *   bit rate    = SYSCLK / ((BRP+1) * bit time)
+ *   sample pt   = (1 + TSEG1) / bit time
+ *
+ * register fields are 0 based (TQ - 1), the structs below hold real TQ counts.
+ ******************************************************************************/
+
+#ifndef CAN_BIT_TIMING_HPP
+#define CAN_BIT_TIMING_HPP
+
+#include <cstdint>
+
+namespace mcp2518fd {
+
+struct segment_limits {
+    uint32_t max_brp;       //in prescaler steps (BRP+1)
+    uint32_t max_tseg1;     //in TQ
+    uint32_t max_tseg2;
+    uint32_t max_sjw;
+};
+
+//CiNBTCFG: BRP 8 bits, TSEG1 8 bits, TSEG2 7 bits, SJW 7 bits
+constexpr segment_limits nominal_limits = {256, 256, 128, 128};
+//CiDBTCFG: BRP 8 bits, TSEG1 5 bits, TSEG2 4 bits, SJW 4 bits
+constexpr segment_limits data_limits = {256, 32, 16, 16};
+
+struct bit_timing {
+    bool     ok;
+    uint32_t brp;           //prescaler, BRP field + 1
+    uint32_t tseg1;         //TQ
+    uint32_t tseg2;         //TQ
+    uint32_t sjw;           //TQ
+    uint32_t sample_permille;
+};
+
+/*
+smallest prescaler first, so we get the most TQ per bit (finest sample point resolution and, for the data phase, the
+smallest TQ for TDC). the bit has to be an exact number of TQ, a bitrate that SYSCLK can't divide down to is an error
+rather than something that gets rounded.
+*/
+constexpr bit_timing calc_bit_timing(uint32_t sysclk, uint32_t bitrate, uint32_t sample_permille, const segment_limits &lim) {
+    bit_timing best = {false, 0, 0, 0, 0, 0};
+
+    if(!bitrate || sample_permille >= 1000) {
+        return best;
+    }
+
+    for(uint32_t brp = 1; brp <= lim.max_brp; brp++) {
+        if(sysclk % (brp * bitrate)) {
+            continue;
+        }
+
+        uint32_t ntq = sysclk / (brp * bitrate);
+
+        if(ntq < 4) {
+            break; //only gets smaller from here
+        }
+
+        //round the sample point to the nearest TQ, SYNC counts towards it
+        uint32_t tseg1 = (ntq * sample_permille + 500) / 1000 - 1;
+        uint32_t tseg2 = ntq - 1 - tseg1;
+
+        if(tseg1 < 1 || tseg2 < 1 || tseg1 > lim.max_tseg1 || tseg2 > lim.max_tseg2) {
+            continue;
+        }
+
+        best.ok = true;
+        best.brp = brp;
+        best.tseg1 = tseg1;
+        best.tseg2 = tseg2;
+        best.sjw = tseg2 < lim.max_sjw ? tseg2 : lim.max_sjw; //as wide as PHASE 2 allows for the most resync headroom
+        best.sample_permille = (1 + tseg1) * 1000 / ntq;
+
+        return best;
+    }
+
+    return best;
+}
+
+constexpr uint32_t nbtcfg_word(const bit_timing &t) {
+    return ((t.brp - 1) << 24) | ((t.tseg1 - 1) << 16) | ((t.tseg2 - 1) << 8) | (t.sjw - 1);
+}
+
+constexpr uint32_t dbtcfg_word(const bit_timing &t) {
+    return ((t.brp - 1) << 24) | ((t.tseg1 - 1) << 16) | ((t.tseg2 - 1) << 8) | (t.sjw - 1);
+}
+
+/*
+auto TDC measures the loop delay and adds TDCO to it to place the secondary sample point. Microchip's recommendation
+is TDCO = data phase sample point in SYSCLKs, which is (DBRP+1)*(DTSEG1+1) in register terms
+*/
+constexpr int32_t tdc_offset(const bit_timing &data) {
+    return static_cast<int32_t>(data.brp * data.tseg1);
+}
+
+constexpr uint32_t tdc_word(const bit_timing &data) {
+    //TDCMode 0b10 (auto) at 17:16, TDCOffset 7 bit two's complement at 14:8
+    return (0b10u << 16) | ((static_cast<uint32_t>(tdc_offset(data)) & 0x7F) << 8);
+}
+
+template <uint32_t Sysclk, uint32_t NominalBitrate, uint32_t NominalSamplePermille, uint32_t DataBitrate, uint32_t DataSamplePermille>
+struct timing_profile {
+    static constexpr bit_timing nominal = calc_bit_timing(Sysclk, NominalBitrate, NominalSamplePermille, nominal_limits);
+    static constexpr bit_timing data = calc_bit_timing(Sysclk, DataBitrate, DataSamplePermille, data_limits);
+
+    static_assert(nominal.ok, "nominal bitrate can't be made from SYSCLK with the CiNBTCFG field widths");
+    static_assert(data.ok, "data bitrate can't be made from SYSCLK with the CiDBTCFG field widths");
+    static_assert(DataBitrate >= NominalBitrate, "data phase has to be at least as fast as the arbitration phase");
+    static_assert(tdc_offset(data) <= 63, "TDCO doesn't fit the 7 bit signed CiTDC field");
+
+    static constexpr uint32_t nbtcfg = nbtcfg_word(nominal);
+    static constexpr uint32_t dbtcfg = dbtcfg_word(data);
+    static constexpr uint32_t tdc = tdc_word(data);
+};
+
+} // namespace mcp2518fd
+
+#endif /* CAN_BIT_TIMING_HPP */
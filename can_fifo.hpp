@@ -0,0 +1,379 @@
+/*******************************************************************************
+ * can_fifo.hpp
+ *
+ * compile time FIFO and message object layouts for the MCP2518FD
+ *
+ * the C driver keeps the payload size of every FIFO in dev->fifo_layout and
+ * works out object sizes, DLCs and transfer lengths per frame at run time.
+ * when the layout is fixed at build time none of that has to happen: a
+ * tx_fifo<1, 8, 8> knows its CiFIFOCON/STA/UA addresses, that its objects are
+ * 16 bytes, that a send is one 10 byte STA+UA read, one 18 byte object write
+ * and one 3 byte UINC/TXREQ write, and a frame<8> knows its DLC is 8. all of
+ * it folds into constants so the hot path is straight line code with fixed
+ * length SPI transfers and no lookups into the layout tables.
+ *
+ *   using ctrl = mcp2518fd::tx_fifo<1, 8, 8>;
+ *   using bulk = mcp2518fd::tx_fifo<2, 4, 64>;
+ *   using rx   = mcp2518fd::rx_fifo<3, 16, 8, true>;
+ *   using ram  = mcp2518fd::ram_layout<8, true, mcp2518fd::no_txq, ctrl, bulk, rx>;
+ *
+ *   dev.ram_req = &ram::req;        //bring-up plans and applies it as usual
+ *   ...
+ *   mcp2518fd::frame<8> f = {0x123, 0, {1, 2, 3, 4, 5, 6, 7, 8}};
+ *   ctrl::send(&dev, f);
+ *
+ * the calls use the same SPI primitives (and DMA threshold) as can.c, they go
+ * around the RX ring and the TX scheduler, so keep these FIFOs out of the
+ * INT driven paths (no RxNotEmptyIE on an rx_fifo you poll, no class on a
+ * tx_fifo you send to directly).
+ ******************************************************************************/
+
+#ifndef CAN_FIFO_HPP
+#define CAN_FIFO_HPP
+
+#include <cstdint>
+#include <cstring>
+
+#include "can.h"
+
+namespace mcp2518fd {
+
+constexpr uint8_t dlc_bytes[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+constexpr uint8_t plsize_bytes[8] = {8, 12, 16, 20, 24, 32, 48, 64};
+
+//PayLoadSize code for an exact payload size, 0xFF if the chip has no such step
+constexpr uint8_t plsize_code(uint8_t bytes) {
+    for(uint8_t i = 0; i < 8; i++) {
+        if(plsize_bytes[i] == bytes) {
+            return i;
+        }
+    }
+
+    return 0xFF;
+}
+
+//DLC for an exact length, 0xFF for lengths CAN FD can't send (9, 13, ...)
+constexpr uint8_t len_to_dlc(uint8_t len) {
+    for(uint8_t i = 0; i < 16; i++) {
+        if(dlc_bytes[i] == len) {
+            return i;
+        }
+    }
+
+    return 0xFF;
+}
+
+constexpr uint8_t cmd_hi(uint8_t instr, uint16_t addr) {
+    return static_cast<uint8_t>((instr << 4) | ((addr >> 8) & 0x0F));
+}
+
+constexpr uint8_t cmd_lo(uint16_t addr) {
+    return static_cast<uint8_t>(addr & 0xFF);
+}
+
+inline void put_le32(uint8_t *b, uint32_t v) {
+    b[0] = v & 0xFF;
+    b[1] = (v >> 8) & 0xFF;
+    b[2] = (v >> 16) & 0xFF;
+    b[3] = (v >> 24) & 0xFF;
+}
+
+inline uint32_t get_le32(const uint8_t *b) {
+    return b[0] | (b[1] << 8) | (b[2] << 16) | (static_cast<uint32_t>(b[3]) << 24);
+}
+
+//ID word, SID/EID split the same way as MCP2518fd_encode_tx_msgobj
+inline uint32_t id_word(uint32_t id, uint8_t flags) {
+    if(flags & CAN_FRAME_FLAG_IDE) {
+        return ((id >> 18) & 0x7FF) | ((id & 0x3FFFF) << 11);
+    }
+
+    return id & 0x7FF;
+}
+
+/*
+a TX frame with a length fixed by its type, so the DLC is a constant. flags takes CAN_FRAME_FLAG_IDE/RTR/BRS, FDF is
+added for anything over 8 bytes
+*/
+template <uint8_t Len>
+struct frame {
+    static_assert(len_to_dlc(Len) != 0xFF, "not a CAN/CAN FD frame length");
+
+    static constexpr uint8_t len = Len;
+    static constexpr uint8_t dlc = len_to_dlc(Len);
+    static constexpr uint8_t fixed_flags = (Len > 8) ? CAN_FRAME_FLAG_FDF : 0;
+
+    uint32_t id;
+    uint8_t flags;
+    uint8_t data[Len ? Len : 1];
+};
+
+//what comes out of an rx_fifo, the length is whatever the sender used so it stays a run time value
+template <uint8_t PayloadBytes>
+struct rx_frame {
+    uint32_t id;
+    uint8_t dlc;
+    uint8_t len;
+    uint8_t flags;
+    uint8_t filter;
+    uint32_t timestamp;     //raw TBC, MCP2518fd_timestamp_to_us() converts it. 0 without timestamps
+    uint8_t data[PayloadBytes];
+};
+
+template <uint8_t Index, uint8_t Depth, uint8_t PayloadBytes, uint8_t HeaderBytes>
+struct fifo_base {
+    static_assert(Index < 32, "FIFO index out of range");
+    static_assert(Depth >= 1 && Depth <= 32, "FIFO depth is 1-32");
+    static_assert(plsize_code(PayloadBytes) != 0xFF, "payload size has to be one of the PayLoadSize steps (8, 12, 16, 20, 24, 32, 48, 64)");
+
+    static constexpr uint8_t index = Index;
+    static constexpr uint8_t depth = Depth;
+    static constexpr uint8_t payload_bytes = PayloadBytes;
+    static constexpr uint8_t plsize = plsize_code(PayloadBytes);
+
+    static constexpr uint16_t con_addr = MCP2518FD_REG_CiFIFOCON + Index*MCP2518FD_FIFO_REG_STRIDE;
+    static constexpr uint16_t sta_addr = MCP2518FD_REG_CiFIFOSTA + Index*MCP2518FD_FIFO_REG_STRIDE;
+    static constexpr uint16_t ua_addr = MCP2518FD_REG_CiFIFOUA + Index*MCP2518FD_FIFO_REG_STRIDE;
+
+    static constexpr uint16_t obj_bytes = HeaderBytes + PayloadBytes;
+    static constexpr uint16_t ram_bytes = obj_bytes * Depth;
+
+    //every transfer length on the hot path, and whether spi_write_to_MCP will hand it to DMA
+    static constexpr uint16_t sta_ua_len = 2 + 8;
+    static constexpr uint16_t obj_len = 2 + obj_bytes;
+    static constexpr bool obj_dma = obj_len >= SPI_DMA_MIN_LEN;
+
+    static_assert(obj_len <= 2 + BUF_LEN, "message object longer than a burst buffer");
+
+    //true if the driver's view of this FIFO (from bring-up or the RAM planner) is the one this type was built for
+    static bool matches(const mcp2518fd_dev_t *dev) {
+        return dev->fifo_layout[Index].depth == Depth && dev->fifo_layout[Index].payload_bytes == PayloadBytes;
+    }
+
+protected:
+    //STA and UA in one burst, returns STA and sets ua
+    static uint32_t read_sta_ua(mcp2518fd_dev_t *dev, uint16_t *ua) {
+        uint8_t buf[sta_ua_len] = {cmd_hi(MCP2518FD_INSTR_READ, sta_addr), cmd_lo(sta_addr)};
+
+        spi_write_to_MCP(dev, buf, buf, sta_ua_len);
+
+        *ua = get_le32(&buf[6]) & 0xFFF;
+        return get_le32(&buf[2]);
+    }
+
+    //UINC (and TXREQ) live in byte 1 of FIFOCON, FRESET next to them stays 0
+    static void commit(mcp2518fd_dev_t *dev, uint8_t bits) {
+        uint8_t buf[3] = {cmd_hi(MCP2518FD_INSTR_WRITE, con_addr + 1), cmd_lo(con_addr + 1), bits};
+
+        spi_write_to_MCP(dev, buf, buf, 3);
+    }
+
+    static void advance(mcp2518fd_dev_t *dev) {
+        mcp2518fd_fifo_layout_t *layout = &dev->fifo_layout[Index];
+
+        layout->head = (layout->head + 1 == Depth) ? 0 : layout->head + 1;
+    }
+};
+
+//Index 0 is the TXQ. TX objects never carry a timestamp
+template <uint8_t Index, uint8_t Depth, uint8_t PayloadBytes>
+struct tx_fifo : fifo_base<Index, Depth, PayloadBytes, 8> {
+    using base = fifo_base<Index, Depth, PayloadBytes, 8>;
+
+    static constexpr bool tx = true;
+    static constexpr bool timestamp = false;
+
+    /*
+    false if the FIFO is full (or the device was asleep and didn't wake). the SEQ is claimed through
+    can_tx_seq_claim() like the C send paths do, so it can't collide with a scheduler refill from the INT IRQ
+    */
+    template <uint8_t Len>
+    static bool send(mcp2518fd_dev_t *dev, const frame<Len> &f) {
+        static_assert(Len <= PayloadBytes, "frame doesn't fit this FIFO's payload size");
+
+        uint16_t ua;
+
+        if(!can_tx_wake(dev)) {
+            return false; //in LPM the first CS would wake it into reset and lose the frame
+        }
+
+        if(!(base::read_sta_ua(dev, &ua) & 0x1)) {
+            return false; //TFNRFNIF clear, no free slot
+        }
+
+        uint32_t seq = can_tx_seq_claim(dev, 1);
+
+        uint16_t addr = MCP2518FD_RAM_START + ua;
+        uint8_t flags = f.flags | frame<Len>::fixed_flags;
+        uint32_t ctrl = frame<Len>::dlc
+                      | ((flags & CAN_FRAME_FLAG_IDE) ? (1u << 4) : 0)
+                      | ((flags & CAN_FRAME_FLAG_RTR) ? (1u << 5) : 0)
+                      | ((flags & CAN_FRAME_FLAG_BRS) ? (1u << 6) : 0)
+                      | ((flags & CAN_FRAME_FLAG_FDF) ? (1u << 7) : 0)
+                      | ((seq & CAN_TX_SEQ_MASK) << 9);
+
+        uint8_t buf[base::obj_len];
+
+        buf[0] = cmd_hi(MCP2518FD_INSTR_WRITE, 0) | ((addr >> 8) & 0x0F);
+        buf[1] = cmd_lo(addr);
+        put_le32(&buf[2], id_word(f.id, flags));
+        put_le32(&buf[6], ctrl);
+        memcpy(&buf[10], f.data, Len);
+        memset(&buf[10 + Len], 0, PayloadBytes - Len);
+
+        spi_write_to_MCP(dev, buf, buf, base::obj_len);
+
+        base::commit(dev, 0x03); //UINC + TXREQ
+        base::advance(dev);
+
+        __atomic_add_fetch(&dev->stats.tx_frames, 1, __ATOMIC_RELAXED);
+
+        return true;
+    }
+
+    static constexpr mcp2518fd_fifo_req_t req() {
+        return {Depth, PayloadBytes, true, false, false};
+    }
+};
+
+template <uint8_t Index, uint8_t Depth, uint8_t PayloadBytes, bool Timestamp = false>
+struct rx_fifo : fifo_base<Index, Depth, PayloadBytes, Timestamp ? 12 : 8> {
+    static_assert(Index >= 1, "the TXQ can't receive");
+
+    using base = fifo_base<Index, Depth, PayloadBytes, Timestamp ? 12 : 8>;
+
+    static constexpr bool tx = false;
+    static constexpr bool timestamp = Timestamp;
+
+    //false if the FIFO is empty. the payload is always copied whole, bytes past len are whatever the chip had
+    static bool receive(mcp2518fd_dev_t *dev, rx_frame<PayloadBytes> *out) {
+        uint16_t ua;
+
+        if(!(base::read_sta_ua(dev, &ua) & 0x1)) {
+            return false; //TFNRFNIF clear, nothing waiting
+        }
+
+        uint16_t addr = MCP2518FD_RAM_START + ua;
+        uint8_t buf[base::obj_len];
+
+        buf[0] = cmd_hi(MCP2518FD_INSTR_READ, 0) | ((addr >> 8) & 0x0F);
+        buf[1] = cmd_lo(addr);
+
+        spi_write_to_MCP(dev, buf, buf, base::obj_len);
+
+        base::commit(dev, 0x01); //UINC
+        base::advance(dev);
+
+        uint32_t id = get_le32(&buf[2]);
+        uint32_t ctrl = get_le32(&buf[6]);
+
+        out->dlc = ctrl & 0xF;
+        out->len = dlc_bytes[out->dlc];
+        out->flags = ((ctrl & (1u << 4)) ? CAN_FRAME_FLAG_IDE : 0)
+                   | ((ctrl & (1u << 5)) ? CAN_FRAME_FLAG_RTR : 0)
+                   | ((ctrl & (1u << 6)) ? CAN_FRAME_FLAG_BRS : 0)
+                   | ((ctrl & (1u << 7)) ? CAN_FRAME_FLAG_FDF : 0)
+                   | ((ctrl & (1u << 8)) ? CAN_FRAME_FLAG_ESI : 0)
+                   | (Timestamp ? CAN_FRAME_FLAG_TS : 0);
+        out->filter = (ctrl >> 11) & 0x1F;
+        out->id = (out->flags & CAN_FRAME_FLAG_IDE) ? (((id & 0x7FF) << 18) | ((id >> 11) & 0x3FFFF)) : (id & 0x7FF);
+
+        if constexpr (Timestamp) {
+            out->timestamp = get_le32(&buf[10]);
+        } else {
+            out->timestamp = 0;
+        }
+
+        memcpy(out->data, &buf[2 + base::obj_bytes - PayloadBytes], PayloadBytes);
+
+        //a long frame in a short FIFO gets cut to the payload size by the chip
+        if(out->len > PayloadBytes) {
+            out->len = PayloadBytes;
+        }
+
+        dev->stats.rx_frames++;
+
+        return true;
+    }
+
+    static constexpr mcp2518fd_fifo_req_t req() {
+        return {Depth, PayloadBytes, false, Timestamp, false};
+    }
+};
+
+//placeholder for ram_layout when the TXQ is off
+struct no_txq {
+    static constexpr uint8_t index = 0;
+    static constexpr uint16_t ram_bytes = 0;
+
+    static constexpr mcp2518fd_fifo_req_t req() {
+        return {0, 8, true, false, false};
+    }
+};
+
+/*
+the chip's RAM order (TEF, TXQ, FIFO1, FIFO2 ...) worked out at compile time. Fifos have to be FIFO1, FIFO2 ... in
+order, the build fails if they aren't or if it doesn't fit in 2 KB. req is a ready made mcp2518fd_ram_req_t for
+dev->ram_req, and since nothing grows the planner comes back with exactly the addresses below
+*/
+template <uint8_t TefDepth, bool TefTimestamp, class Txq, class... Fifos>
+struct ram_layout {
+    static_assert(Txq::index == 0, "second parameter is the TXQ (tx_fifo<0, ...>) or no_txq");
+    static_assert(sizeof...(Fifos) <= 31, "only 31 FIFOs");
+    static_assert(TefDepth <= 32, "TEF depth is 0-32");
+
+    static constexpr uint16_t tef_bytes = TefDepth * (TefTimestamp ? 12 : 8);
+    static constexpr uint16_t used = tef_bytes + Txq::ram_bytes + (0 + ... + Fifos::ram_bytes);
+
+    static_assert(used <= MCP2518FD_RAM_END - MCP2518FD_RAM_START, "layout doesn't fit in message RAM");
+
+    static constexpr bool in_order() {
+        uint8_t idx[] = {0, Fifos::index...};
+
+        for(uint8_t i = 1; i < sizeof(idx); i++) {
+            if(idx[i] != i) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static_assert(in_order(), "FIFOs have to be listed as FIFO1, FIFO2 ... with no gaps");
+
+    //start of a FIFO's objects, absolute address
+    template <uint8_t Index>
+    static constexpr uint16_t addr() {
+        static_assert(Index <= sizeof...(Fifos), "FIFO not in this layout");
+
+        uint16_t sizes[] = {Txq::ram_bytes, Fifos::ram_bytes...};
+        uint16_t offset = tef_bytes;
+
+        for(uint8_t i = 0; i < Index; i++) {
+            offset += sizes[i];
+        }
+
+        return MCP2518FD_RAM_START + offset;
+    }
+
+    static constexpr mcp2518fd_ram_req_t make_req() {
+        mcp2518fd_ram_req_t r{};
+        const mcp2518fd_fifo_req_t fifos[] = {Txq::req(), Fifos::req()...};
+
+        r.tef = {TefDepth, 0, true, TefTimestamp, false};
+        r.txq = fifos[0];
+        r.nfifos = sizeof...(Fifos);
+
+        for(uint8_t i = 0; i < sizeof...(Fifos); i++) {
+            r.fifo[i] = fifos[i + 1];
+        }
+
+        return r;
+    }
+
+    static constexpr mcp2518fd_ram_req_t req = make_req();
+};
+
+} // namespace mcp2518fd
+
+#endif /* CAN_FIFO_HPP */
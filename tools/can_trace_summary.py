@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""
+summarises the TRACE lines MCP2518fd_trace_drain() prints (build with -DCAN_TRACE=ON)
+
+    python3 tools/can_trace_summary.py capture.log
+    cat /dev/ttyACM0 | python3 tools/can_trace_summary.py -
+
+prints latency stats and a log2 histogram per register and per call site. register names come from the
+MCP2518FD_REG_* defines in can.h, FIFO registers are shown as the FIFO they belong to.
+"""
+
+import argparse
+import os
+import re
+import sys
+from collections import defaultdict
+
+OPCODES = {0x0: "RESET", 0x2: "WRITE", 0x3: "READ", 0xA: "WRITE_CRC", 0xB: "READ_CRC", 0xC: "WRITE_SAFE"}
+
+FIFO_BASE = 0x050
+FIFO_STRIDE = 12
+FIFO_END = FIFO_BASE + 32 * FIFO_STRIDE
+RAM_START = 0x400
+RAM_END = 0xC00
+
+
+def load_reg_names(header):
+    names = {}
+    if not os.path.exists(header):
+        return names
+    with open(header) as f:
+        for line in f:
+            m = re.match(r"#define\s+MCP2518FD_REG_(\w+)\s+(0x[0-9A-Fa-f]+)", line)
+            if m:
+                names.setdefault(int(m.group(2), 16), m.group(1))
+    return names
+
+
+def reg_name(addr, names):
+    if RAM_START <= addr < RAM_END:
+        return "RAM"
+    if FIFO_BASE <= addr < FIFO_END:
+        n, off = divmod(addr - FIFO_BASE, FIFO_STRIDE)
+        kind = ("CON", "STA", "UA")[off // 4]
+        return "TXQ" + kind if n == 0 else "FIFO%d%s" % (n, kind)
+    word = addr & ~3
+    if word in names:
+        return names[word] + ("+%d" % (addr - word) if addr != word else "")
+    return "0x%03X" % addr
+
+
+class Stats:
+    def __init__(self):
+        self.total = []
+        self.wait = 0
+        self.clock = 0
+        self.finish = 0
+        self.bytes = 0
+
+    def add(self, wait, clock, finish, length):
+        self.total.append(wait + clock + finish)
+        self.wait += wait
+        self.clock += clock
+        self.finish += finish
+        self.bytes += length
+
+
+def percentile(sorted_vals, p):
+    return sorted_vals[min(len(sorted_vals) - 1, int(len(sorted_vals) * p / 100))]
+
+
+def histogram(vals_us, width=40):
+    buckets = defaultdict(int)
+    for v in vals_us:
+        b = 0
+        while (1 << b) < v:
+            b += 1
+        buckets[b] += 1
+    peak = max(buckets.values())
+    lines = []
+    for b in range(min(buckets), max(buckets) + 1):
+        n = buckets.get(b, 0)
+        label = "<= %6d us" % (1 << b)
+        lines.append("    %s %6d %s" % (label, n, "#" * max(1 if n else 0, n * width // peak)))
+    return lines
+
+
+def report(title, groups, hz, show_hist):
+    print(title)
+    print("  %-34s %7s %9s %9s %9s %9s %9s   wait/clock/finish %%" % ("", "count", "mean us", "p50", "p90", "p99", "max"))
+    for key, st in sorted(groups.items(), key=lambda kv: -sum(kv[1].total)):
+        vals = sorted(t * 1e6 / hz for t in st.total)
+        total = st.wait + st.clock + st.finish or 1
+        print("  %-34s %7d %9.2f %9.2f %9.2f %9.2f %9.2f   %3d/%3d/%3d" % (
+            key[:34], len(vals), sum(vals) / len(vals), percentile(vals, 50), percentile(vals, 90),
+            percentile(vals, 99), vals[-1],
+            100 * st.wait // total, 100 * st.clock // total, 100 * st.finish // total))
+        if show_hist:
+            for line in histogram(vals):
+                print(line)
+    print()
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("log", help="capture file, - for stdin")
+    ap.add_argument("--header", default=os.path.join(here, "..", "can.h"), help="can.h to take register names from")
+    ap.add_argument("--hz", type=int, help="clk_sys in Hz if the capture has no TRACE_HZ line")
+    ap.add_argument("--no-hist", action="store_true", help="table only")
+    args = ap.parse_args()
+
+    names = load_reg_names(args.header)
+    hz = args.hz
+    by_reg = defaultdict(Stats)
+    by_site = defaultdict(Stats)
+    count = 0
+
+    src = sys.stdin if args.log == "-" else open(args.log)
+    for line in src:
+        fields = line.strip().split(",")
+        if fields[0] == "TRACE_HZ" and len(fields) == 2 and not args.hz:
+            hz = int(fields[1])
+        elif fields[0] == "TRACE" and len(fields) == 12:
+            _, core, site, op, addr, length, cs, flags, start, wait, clock, finish = fields
+            op, addr, length = int(op), int(addr, 16), int(length)
+            wait, clock, finish = int(wait), int(clock), int(finish)
+            kind = OPCODES.get(op, "OP%X" % op)
+            if op == 0x0:
+                reg = kind
+            else:
+                reg = "%s %s" % (kind, reg_name(addr, names))
+            by_reg[reg].add(wait, clock, finish, length)
+            by_site["%s (cs %s)" % (site, cs)].add(wait, clock, finish, length)
+            count += 1
+
+    if not count:
+        sys.exit("no TRACE lines found")
+    if not hz:
+        sys.exit("no TRACE_HZ line in the capture, pass --hz")
+
+    print("%d transactions, clk_sys %.1f MHz\n" % (count, hz / 1e6))
+    report("per register", by_reg, hz, not args.no_hist)
+    report("per call site", by_site, hz, not args.no_hist)
+
+
+if __name__ == "__main__":
+    main()